@@ -2,7 +2,11 @@
  * Copyright 2021 Google LLC
  * Author: Daeho Jeong <daehojeong@google.com>
  */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdlib.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <time.h>
 #include <utime.h>
@@ -13,14 +17,31 @@
 #include "erofs/compress.h"
 #include "erofs/decompress.h"
 #include "erofs/dir.h"
-#include "erofs/workqueue.h"
+#include "erofs/lock.h"
 
-static int erofsfsck_check_inode(erofs_nid_t pnid, erofs_nid_t nid);
-struct erofsfsck_work;
+struct erofsfsck_worker;
+struct erofsfsck_dir;
+struct erofsfsck_scan_extent;
+struct erofsfsck_scan_window;
 
 struct erofsfsck_cfg {
-	struct erofs_workqueue wq;
-	struct erofsfsck_work *idle;
+	struct erofsfsck_worker *workers;
+	unsigned int nr_workers;
+	/* tasks queued or running, and those queued only */
+	unsigned long pending;
+	long queued;
+	/* idle workers sleep here until new tasks are queued */
+	erofs_mutex_t idle_lock;
+	erofs_cond_t idle_cond;
+	unsigned int sleeping;
+	bool aborted;
+	/* set once copy_file_range() fails, e.g. across filesystems */
+	bool no_copy_range;
+	void (*worker_fn)(struct erofsfsck_worker *w);
+	/* all extents sorted by their location for --physical-order */
+	struct erofsfsck_scan_extent *scan;
+	struct erofsfsck_scan_window *windows;
+	unsigned long nr_windows, next_window;
 	u64 physical_blocks;
 	u64 logical_blocks;
 	char *extract_path;
@@ -34,7 +55,7 @@ struct erofsfsck_cfg {
 	bool overwrite;
 	bool preserve_owner;
 	bool preserve_perms;
-	bool multithreading;
+	bool physical_order;
 };
 static struct erofsfsck_cfg fsckcfg;
 
@@ -50,6 +71,8 @@ static struct option long_options[] = {
 	{"no-preserve", no_argument, 0, 9},
 	{"no-preserve-owner", no_argument, 0, 10},
 	{"no-preserve-perms", no_argument, 0, 11},
+	{"threads", required_argument, 0, 12},
+	{"physical-order", no_argument, 0, 13},
 	{0, 0, 0, 0},
 };
 
@@ -75,6 +98,8 @@ static void usage(void)
 	      " -p                     print total compression ratio of all files\n"
 	      " --device=X             specify an extra device to be used together\n"
 	      " --extract[=X]          check if all files are well encoded, optionally extract to X\n"
+	      " --threads=#            check (and extract) with # threads (default: number of CPUs)\n"
+	      " --physical-order       check all file data in the order of its location on disk\n"
 	      " --help                 display this help and exit\n"
 	      "\nExtraction options (--extract=X is required):\n"
 	      " --force                allow extracting to root\n"
@@ -147,7 +172,7 @@ static int erofsfsck_parse_options_cfg(int argc, char **argv)
 			}
 			break;
 		case 3:
-			ret = blob_open_ro(optarg);
+			ret = blob_open_ro(&sbi, optarg);
 			if (ret)
 				return ret;
 			++sbi.extra_devices;
@@ -182,12 +207,28 @@ static int erofsfsck_parse_options_cfg(int argc, char **argv)
 			fsckcfg.preserve_perms = false;
 			has_opt_preserve = true;
 			break;
+		case 12:
+			ret = atoi(optarg);
+			if (ret < 1) {
+				erofs_err("invalid number of threads %s", optarg);
+				return -EINVAL;
+			}
+			fsckcfg.nr_workers = ret;
+			break;
+		case 13:
+			fsckcfg.physical_order = true;
+			fsckcfg.check_decomp = true;
+			break;
 		default:
 			return -EINVAL;
 		}
 	}
 
 	if (fsckcfg.extract_path) {
+		if (fsckcfg.physical_order) {
+			erofs_err("--physical-order can't be used with --extract=X");
+			return -EINVAL;
+		}
 		if (!fsckcfg.extract_pos && !fsckcfg.force) {
 			erofs_err("--extract=/ must be used together with --force");
 			return -EINVAL;
@@ -223,41 +264,60 @@ static int erofsfsck_parse_options_cfg(int argc, char **argv)
 	return 0;
 }
 
-static void erofsfsck_set_attributes(struct erofs_inode *inode, char *path)
+/*
+ * Apply the attributes of @inode to the extracted @path, through @fd if it is
+ * still open or -1 otherwise.  The owner goes first since changing it may
+ * clear the set-user-ID bit.
+ */
+static void erofsfsck_set_attributes(struct erofs_inode *inode,
+				     const char *path, int fd)
 {
+#ifdef HAVE_UTIMENSAT
+	const struct timespec times[2] = {
+		[0] = { .tv_sec = inode->i_mtime,
+			.tv_nsec = inode->i_mtime_nsec },
+		[1] = { .tv_sec = inode->i_mtime,
+			.tv_nsec = inode->i_mtime_nsec },
+	};
+#endif
+	mode_t mode = inode->i_mode;
 	int ret;
 
 	/* don't apply attributes when fsck is used without extraction */
 	if (!fsckcfg.extract_path)
 		return;
 
-#ifdef HAVE_UTIMENSAT
-	if (utimensat(AT_FDCWD, path, (struct timespec []) {
-				[0] = { .tv_sec = inode->i_mtime,
-					.tv_nsec = inode->i_mtime_nsec },
-				[1] = { .tv_sec = inode->i_mtime,
-					.tv_nsec = inode->i_mtime_nsec },
-			}, AT_SYMLINK_NOFOLLOW) < 0)
-#else
-	if (utime(path, &((struct utimbuf){.actime = inode->i_mtime,
-					   .modtime = inode->i_mtime})) < 0)
-#endif
-		erofs_warn("failed to set times: %s", path);
+	if (fsckcfg.preserve_owner) {
+		if (fd >= 0)
+			ret = fchown(fd, inode->i_uid, inode->i_gid);
+		else
+			ret = lchown(path, inode->i_uid, inode->i_gid);
+		if (ret < 0)
+			erofs_warn("failed to change ownership: %s", path);
+	}
 
 	if (!S_ISLNK(inode->i_mode)) {
-		if (fsckcfg.preserve_perms)
-			ret = chmod(path, inode->i_mode);
+		if (!fsckcfg.preserve_perms)
+			mode &= ~fsckcfg.umask;
+		if (fd >= 0)
+			ret = fchmod(fd, mode);
 		else
-			ret = chmod(path, inode->i_mode & ~fsckcfg.umask);
+			ret = chmod(path, mode);
 		if (ret < 0)
 			erofs_warn("failed to set permissions: %s", path);
 	}
 
-	if (fsckcfg.preserve_owner) {
-		ret = lchown(path, inode->i_uid, inode->i_gid);
-		if (ret < 0)
-			erofs_warn("failed to change ownership: %s", path);
-	}
+#ifdef HAVE_UTIMENSAT
+	if (fd >= 0)
+		ret = futimens(fd, times);
+	else
+		ret = utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW);
+#else
+	ret = utime(path, &((struct utimbuf){.actime = inode->i_mtime,
+					     .modtime = inode->i_mtime}));
+#endif
+	if (ret < 0)
+		erofs_warn("failed to set times: %s", path);
 }
 
 static int erofs_check_sb_chksum(void)
@@ -267,7 +327,7 @@ static int erofs_check_sb_chksum(void)
 	u32 crc;
 	struct erofs_super_block *sb;
 
-	ret = blk_read(0, buf, 0, 1);
+	ret = blk_read(&sbi, 0, buf, 0, 1);
 	if (ret) {
 		erofs_err("failed to read superblock to check checksum: %d",
 			  ret);
@@ -312,8 +372,8 @@ static int erofs_verify_xattr(struct erofs_inode *inode)
 		}
 	}
 
-	addr = iloc(inode->nid) + inode->inode_isize;
-	ret = dev_read(0, buf, addr, xattr_hdr_size);
+	addr = iloc(inode->sbi, inode->nid) + inode->inode_isize;
+	ret = dev_read(inode->sbi, 0, buf, addr, xattr_hdr_size);
 	if (ret < 0) {
 		erofs_err("failed to read xattr header @ nid %llu: %d",
 			  inode->nid | 0ULL, ret);
@@ -343,7 +403,7 @@ static int erofs_verify_xattr(struct erofs_inode *inode)
 	while (remaining > 0) {
 		unsigned int entry_sz;
 
-		ret = dev_read(0, buf, addr, xattr_entry_size);
+		ret = dev_read(inode->sbi, 0, buf, addr, xattr_entry_size);
 		if (ret) {
 			erofs_err("failed to read xattr entry @ nid %llu: %d",
 				  inode->nid | 0ULL, ret);
@@ -365,67 +425,772 @@ out:
 	return ret;
 }
 
-struct erofsfsck_work {
-	struct erofs_work work;
-	struct erofs_map_blocks map;
-	struct erofs_inode *inode;
-	char *buffer, *raw;
-	struct erofsfsck_work *next;
-	unsigned int raw_size, buffer_size;
-	bool compressed, eio;
+/*
+ * Inodes are checked by a pool of workers, each of which takes tasks from
+ * the bottom of its own deque (so that a subtree is mostly walked by one
+ * thread) and steals from the top of others when running out of tasks.
+ * All results are accumulated per worker and only summed up at the end.
+ */
+struct erofsfsck_worker {
+	erofs_mutex_t lock;		/* protects the deque */
+	struct erofsfsck_task **tasks;
+	unsigned long head, tail, mask;
+	struct erofsfsck_batch *batches;
+	unsigned int nr_batches;
+	/* signalled when another worker finishes one of our batches */
+	erofs_mutex_t batch_lock;
+	erofs_cond_t batch_done;
+	/* extents collected for --physical-order, and buffers to check them */
+	struct erofsfsck_scan_extent *extents;
+	unsigned long nr_extents, max_extents;
+	char *window, *out;
+	size_t window_size, out_size;
+	u64 bytes_read;
+	u64 physical_blocks;
+	u64 logical_blocks;
+	int err;
+	bool corrupted;
+#ifdef EROFS_MT_ENABLED
+	pthread_t th;
+#endif
+};
+
+/*
+ * An inode to check (and to extract to @path) queued by its parent, or a
+ * batch of file data queued by the worker reading the file.
+ */
+struct erofsfsck_task {
+	struct erofsfsck_batch *batch;
+	erofs_nid_t pnid, nid;
+	struct erofsfsck_dir *parent;
+	char *path;
+	size_t pathlen;			/* where names of children go */
+};
+
+/*
+ * A directory is kept until all its children are done, so that its
+ * attributes (e.g. read-only permissions) are applied after them.
+ */
+struct erofsfsck_dir {
+	struct erofsfsck_dir *parent;
+	struct erofs_inode inode;
+	unsigned int refcount;
+	bool failed;
+	char *path;
+	size_t pathlen;
 };
 
-static int erofsfsck_extract_one(struct erofsfsck_work *fw)
+static void erofsfsck_queue(struct erofsfsck_worker *w,
+			    struct erofsfsck_task *t)
 {
-	unsigned int plen = fw->map.m_plen;
-	int ret;
+	/* count it first, so that it can't be finished before */
+	__atomic_add_fetch(&fsckcfg.pending, 1, __ATOMIC_SEQ_CST);
+
+	erofs_mutex_lock(&w->lock);
+	if (w->tail - w->head > w->mask) {
+		unsigned long i, n = (w->mask + 1) << 1;
+		struct erofsfsck_task **tasks = malloc(n * sizeof(*tasks));
+
+		BUG_ON(!tasks);
+		for (i = w->head; i != w->tail; ++i)
+			tasks[i & (n - 1)] = w->tasks[i & w->mask];
+		free(w->tasks);
+		w->tasks = tasks;
+		w->mask = n - 1;
+	}
+	w->tasks[w->tail++ & w->mask] = t;
+	erofs_mutex_unlock(&w->lock);
+
+	__atomic_add_fetch(&fsckcfg.queued, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&fsckcfg.sleeping, __ATOMIC_SEQ_CST)) {
+		erofs_mutex_lock(&fsckcfg.idle_lock);
+		erofs_cond_signal(&fsckcfg.idle_cond);
+		erofs_mutex_unlock(&fsckcfg.idle_lock);
+	}
+}
 
-	fw->eio = false;
-	if (plen > fw->raw_size) {
-		fw->raw_size = plen;
-		fw->raw = realloc(fw->raw, plen);
-		BUG_ON(!fw->raw);
+/* take the newest task of our own, or steal the oldest one of others */
+static struct erofsfsck_task *erofsfsck_dequeue(struct erofsfsck_worker *w,
+						bool steal)
+{
+	struct erofsfsck_task *t = NULL;
+
+	erofs_mutex_lock(&w->lock);
+	if (w->head != w->tail) {
+		if (steal)
+			t = w->tasks[w->head++ & w->mask];
+		else
+			t = w->tasks[--w->tail & w->mask];
 	}
+	erofs_mutex_unlock(&w->lock);
+	if (t)
+		__atomic_sub_fetch(&fsckcfg.queued, 1, __ATOMIC_SEQ_CST);
+	return t;
+}
 
-	if (fw->compressed) {
-		unsigned int llen = fw->map.m_llen;
+/* make sure *@buf can hold @size bytes, whose old content isn't kept */
+static char *erofsfsck_get_buffer(char **buf, size_t *bufsize, size_t size)
+{
+	if (size > *bufsize) {
+		free(*buf);
+		*buf = malloc(size);
+		*bufsize = *buf ? size : 0;
+	}
+	return *buf;
+}
 
-		if (llen > fw->buffer_size) {
-			fw->buffer_size = llen;
-			fw->buffer = realloc(fw->buffer, llen);
-			BUG_ON(!fw->buffer);
-		}
-		ret = z_erofs_read_one_data(fw->inode, &fw->map, fw->raw,
-					    fw->buffer, 0, llen, false);
+/*
+ * Deduplicated files refer to the same pclusters again and again, and so
+ * do tail fragments to the pclusters of the packed inode.  Pclusters which
+ * have been decompressed fine are remembered (and so is their data once
+ * used again when extracting) so that each of them is decompressed at most
+ * twice rather than for each use.  The cache is split into stripes with
+ * their own locks and LRU lists, and the stripe inserting a pcluster drops
+ * its oldest ones when over the limits.
+ */
+#define EROFSFSCK_PCLUSTER_STRIPES	64
+#define EROFSFSCK_PCLUSTER_BUCKETS	1024	/* per stripe */
+#define EROFSFSCK_PCLUSTER_MAX		(1024 * 1024)
+#define EROFSFSCK_PCLUSTER_DATA		(64 * 1024 * 1024)
+
+struct erofsfsck_pcluster {
+	struct erofsfsck_pcluster *next;
+	struct list_head lru;
+	erofs_off_t pa;
+	u64 plen, llen;			/* .llen bytes have been decoded */
+	unsigned short deviceid;
+	bool partial;
+	char *data;
+};
+
+static struct erofsfsck_pcluster_stripe {
+	erofs_mutex_t lock;
+	struct list_head lru;
+	unsigned long nr;
+	u64 hits, misses;
+	struct erofsfsck_pcluster *hash[EROFSFSCK_PCLUSTER_BUCKETS];
+} erofsfsck_pclusters[EROFSFSCK_PCLUSTER_STRIPES];
+
+/* data kept in all stripes, since a single pcluster can decode to MiBs */
+static size_t erofsfsck_pcluster_bytes;
+
+/* (un)shifted data depends on where it's used, so it's copied every time */
+static bool erofsfsck_pcluster_cacheable(struct erofs_map_blocks *map)
+{
+	return map->m_algorithmformat < Z_EROFS_COMPRESSION_MAX &&
+		!(map->m_flags & EROFS_MAP_FRAGMENT);
+}
+
+static bool erofsfsck_pcluster_partial(struct erofs_map_blocks *map)
+{
+	return !(map->m_flags & EROFS_MAP_FULL_MAPPED) ||
+		(map->m_flags & EROFS_MAP_PARTIAL_REF);
+}
+
+static u64 erofsfsck_pcluster_hash(erofs_off_t pa, unsigned short deviceid)
+{
+	return (pa ^ ((u64)deviceid << 48)) * 0x9e3779b97f4a7c15ULL;
+}
+
+static struct erofsfsck_pcluster_stripe *erofsfsck_pcluster_stripe(u64 hash)
+{
+	return &erofsfsck_pclusters[hash >> 58];
+}
+
+static struct erofsfsck_pcluster **
+erofsfsck_pcluster_bucket(struct erofsfsck_pcluster_stripe *s, u64 hash)
+{
+	return &s->hash[(hash >> 32) & (EROFSFSCK_PCLUSTER_BUCKETS - 1)];
+}
+
+static struct erofsfsck_pcluster *
+erofsfsck_pcluster_find(struct erofsfsck_pcluster_stripe *s, u64 hash,
+			struct erofs_map_blocks *map)
+{
+	struct erofsfsck_pcluster *pcl;
+	bool partial = erofsfsck_pcluster_partial(map);
+
+	for (pcl = *erofsfsck_pcluster_bucket(s, hash); pcl; pcl = pcl->next)
+		if (pcl->pa == map->m_pa && pcl->plen == map->m_plen &&
+		    pcl->deviceid == map->m_deviceid &&
+		    pcl->partial == partial)
+			return pcl;
+	return NULL;
+}
+
+/*
+ * Check if the pcluster of @map has been decoded fine up to .m_llen, and
+ * copy @len bytes of its data from @skip to @out if given.
+ */
+static bool erofsfsck_pcluster_lookup(struct erofs_map_blocks *map,
+				      char *out, erofs_off_t skip,
+				      erofs_off_t len)
+{
+	u64 hash = erofsfsck_pcluster_hash(map->m_pa, map->m_deviceid);
+	struct erofsfsck_pcluster_stripe *s = erofsfsck_pcluster_stripe(hash);
+	struct erofsfsck_pcluster *pcl;
+	bool hit = false;
+
+	erofs_mutex_lock(&s->lock);
+	pcl = erofsfsck_pcluster_find(s, hash, map);
+	if (pcl && pcl->llen >= map->m_llen && (!out || pcl->data)) {
+		if (out)
+			memcpy(out, pcl->data + skip, len);
+		list_del(&pcl->lru);
+		list_add(&pcl->lru, &s->lru);
+		hit = true;
+		++s->hits;
 	} else {
-		ret = erofs_read_one_data(&fw->map, fw->raw, 0, plen);
+		++s->misses;
 	}
+	erofs_mutex_unlock(&s->lock);
+	return hit;
+}
 
-	if (ret)
-		fw->eio = true;
+static void erofsfsck_pcluster_evict(struct erofsfsck_pcluster_stripe *s,
+				     struct erofsfsck_pcluster *pcl)
+{
+	struct erofsfsck_pcluster **pp = erofsfsck_pcluster_bucket(s,
+			erofsfsck_pcluster_hash(pcl->pa, pcl->deviceid));
+
+	while (*pp != pcl)
+		pp = &(*pp)->next;
+	*pp = pcl->next;
+	list_del(&pcl->lru);
+	if (pcl->data)
+		__atomic_sub_fetch(&erofsfsck_pcluster_bytes, pcl->llen,
+				   __ATOMIC_RELAXED);
+	--s->nr;
+	free(pcl->data);
+	free(pcl);
+}
+
+/* remember that the pcluster of @map is fine, keeping @data if given */
+static void erofsfsck_pcluster_insert(struct erofs_map_blocks *map,
+				      const char *data)
+{
+	u64 hash = erofsfsck_pcluster_hash(map->m_pa, map->m_deviceid);
+	struct erofsfsck_pcluster_stripe *s = erofsfsck_pcluster_stripe(hash);
+	struct erofsfsck_pcluster **bucket = erofsfsck_pcluster_bucket(s, hash);
+	struct erofsfsck_pcluster *pcl;
+
+	erofs_mutex_lock(&s->lock);
+	pcl = erofsfsck_pcluster_find(s, hash, map);
+	if (!pcl) {
+		/* most are used only once, so don't copy their data yet */
+		data = NULL;
+		pcl = calloc(1, sizeof(*pcl));
+		if (!pcl)
+			goto out;
+		pcl->pa = map->m_pa;
+		pcl->plen = map->m_plen;
+		pcl->deviceid = map->m_deviceid;
+		pcl->partial = erofsfsck_pcluster_partial(map);
+		pcl->next = *bucket;
+		*bucket = pcl;
+		++s->nr;
+	} else {
+		list_del(&pcl->lru);
+	}
+	list_add(&pcl->lru, &s->lru);
+
+	/* keep the longest data decoded so far */
+	if (map->m_llen > pcl->llen || (data && !pcl->data &&
+					map->m_llen == pcl->llen)) {
+		if (pcl->data) {
+			__atomic_sub_fetch(&erofsfsck_pcluster_bytes,
+					   pcl->llen, __ATOMIC_RELAXED);
+			free(pcl->data);
+			pcl->data = NULL;
+		}
+		if (data) {
+			pcl->data = malloc(map->m_llen);
+			if (pcl->data) {
+				memcpy(pcl->data, data, map->m_llen);
+				__atomic_add_fetch(&erofsfsck_pcluster_bytes,
+						   map->m_llen,
+						   __ATOMIC_RELAXED);
+			}
+		}
+		pcl->llen = map->m_llen;
+	}
+
+	while (s->nr > EROFSFSCK_PCLUSTER_MAX / EROFSFSCK_PCLUSTER_STRIPES ||
+	       __atomic_load_n(&erofsfsck_pcluster_bytes, __ATOMIC_RELAXED) >
+			EROFSFSCK_PCLUSTER_DATA) {
+		struct erofsfsck_pcluster *old = list_last_entry(&s->lru,
+				struct erofsfsck_pcluster, lru);
+
+		if (old == pcl)
+			break;
+		erofsfsck_pcluster_evict(s, old);
+	}
+out:
+	erofs_mutex_unlock(&s->lock);
+}
+
+/*
+ * Decompress the pcluster of @map into @out, from @in if given, unless it
+ * has been decompressed before.  @keep means the data is needed in @out.
+ */
+static int erofsfsck_decompress(struct erofs_inode *inode,
+				struct erofs_map_blocks *map, const char *in,
+				char *out, bool keep)
+{
+	bool cacheable = erofsfsck_pcluster_cacheable(map);
+	int ret;
+
+	if (cacheable && erofsfsck_pcluster_lookup(map, keep ? out : NULL, 0,
+						   map->m_llen))
+		return 0;
+	if (in)
+		ret = z_erofs_decompress_one_data(inode, map, in, out, 0,
+						  map->m_llen, false);
+	else
+		ret = z_erofs_read_one_data(inode, map, NULL, out, 0,
+					    map->m_llen, false);
+	if (!ret && cacheable)
+		erofsfsck_pcluster_insert(map, keep ? out : NULL);
+	return ret;
+}
+
+/*
+ * Read @len bytes of the tail fragment of @inode by decompressing whole
+ * pclusters of the packed inode, which are then shared by all fragments
+ * in them.  @buf is used for a pcluster, and @keep means @out is needed.
+ */
+static int erofsfsck_read_fragment(struct erofs_inode *inode, char *out,
+				   erofs_off_t len, char **buf,
+				   size_t *bufsize, bool keep)
+{
+	struct erofs_map_blocks map = {
+		.index = UINT_MAX,
+	};
+	struct erofs_inode *packed;
+	erofs_off_t pos = inode->fragmentoff, end = pos + len, n;
+	bool cacheable;
+	int ret = 0;
+
+	packed = erofs_icache_get(inode->sbi, inode->sbi->packed_nid);
+	if (IS_ERR(packed)) {
+		erofs_err("failed to read packed inode from disk");
+		return PTR_ERR(packed);
+	}
+
+	if (!erofs_inode_is_data_compressed(packed->datalayout)) {
+		ret = erofs_pread(packed, out, len, pos);
+		goto out;
+	}
+	if (end > packed->i_size) {
+		erofs_err("fragment of nid %llu is beyond the packed inode: %llu + %llu",
+			  inode->nid | 0ULL, pos | 0ULL, len | 0ULL);
+		ret = -EFSCORRUPTED;
+		goto out;
+	}
+
+	for (; pos < end; pos += n, out += n) {
+		map.m_la = pos;
+		ret = z_erofs_map_blocks_iter(packed, &map,
+					      EROFS_GET_BLOCKS_FIEMAP);
+		if (ret)
+			break;
+		if (map.m_la + map.m_llen > packed->i_size)
+			map.m_llen = packed->i_size - map.m_la;
+		n = min(end, map.m_la + map.m_llen) - pos;
+
+		if (!(map.m_flags & EROFS_MAP_MAPPED)) {
+			memset(out, 0, n);
+			continue;
+		}
+		if (map.m_flags & EROFS_MAP_FRAGMENT) {
+			erofs_err("packed inode has a fragment itself");
+			ret = -EFSCORRUPTED;
+			break;
+		}
+		/* only copy the part needed rather than the whole pcluster */
+		cacheable = erofsfsck_pcluster_cacheable(&map);
+		if (cacheable &&
+		    erofsfsck_pcluster_lookup(&map, keep ? out : NULL,
+					      pos - map.m_la, n))
+			continue;
+		if (!erofsfsck_get_buffer(buf, bufsize, map.m_llen)) {
+			ret = -ENOMEM;
+			break;
+		}
+		ret = z_erofs_read_one_data(packed, &map, NULL, *buf, 0,
+					    map.m_llen, false);
+		if (ret)
+			break;
+		if (cacheable)
+			erofsfsck_pcluster_insert(&map, keep ? *buf : NULL);
+		if (keep)
+			memcpy(out, *buf + (pos - map.m_la), n);
+	}
+out:
+	erofs_icache_put(packed);
 	return ret;
 }
 
-static void erofsfsck_decompress_work(struct erofs_workqueue *wq,
-				      struct erofs_work *wi)
+static void erofsfsck_pcluster_init(void)
 {
-	(void)erofsfsck_extract_one((struct erofsfsck_work *)wi);
+	unsigned int i;
+
+	for (i = 0; i < EROFSFSCK_PCLUSTER_STRIPES; ++i) {
+		erofs_mutex_init(&erofsfsck_pclusters[i].lock);
+		init_list_head(&erofsfsck_pclusters[i].lru);
+	}
 }
 
-static int erofs_verify_inode_data(struct erofs_inode *inode, int outfd)
+static void erofsfsck_pcluster_exit(void)
+{
+	u64 hits = 0, misses = 0;
+	unsigned int i;
+
+	for (i = 0; i < EROFSFSCK_PCLUSTER_STRIPES; ++i) {
+		struct erofsfsck_pcluster_stripe *s = &erofsfsck_pclusters[i];
+
+		hits += s->hits;
+		misses += s->misses;
+		while (!list_empty(&s->lru))
+			erofsfsck_pcluster_evict(s, list_first_entry(&s->lru,
+					struct erofsfsck_pcluster, lru));
+		erofs_mutex_destroy(&s->lock);
+	}
+	if (hits)
+		erofs_info("Reused pclusters for %llu of %llu decompressions",
+			   hits | 0ULL, (hits + misses) | 0ULL);
+}
+
+/*
+ * Data of a file is read in batches of extents, so that workers running
+ * out of inodes can help with large files.  The owner fills batches into
+ * its ring, queues them for others to steal and then drains the ring in
+ * order to write out the data.  Batches are claimed by atomic state
+ * changes only, so a queued batch which the owner has run by itself (or
+ * even reused for later data) is simply skipped by others.
+ */
+#define EROFSFSCK_BATCH_EXTENTS	64
+#define EROFSFSCK_BATCH_SIZE	(512 * 1024)
+#define EROFSFSCK_MAX_BATCHES	16
+
+enum {
+	EROFSFSCK_BATCH_IDLE,
+	EROFSFSCK_BATCH_READY,
+	EROFSFSCK_BATCH_RUNNING,
+	EROFSFSCK_BATCH_DONE,
+};
+
+/* what z_erofs_read_one_data() needs to know of an extent */
+struct erofsfsck_extent {
+	erofs_off_t pa, la;
+	u64 plen, llen;
+	unsigned int flags;
+	unsigned short deviceid;
+	char algorithmformat;
+};
+
+struct erofsfsck_batch {
+	unsigned int state;
+	struct erofsfsck_worker *owner;
+	struct erofs_inode *inode;
+	struct erofsfsck_extent extents[EROFSFSCK_BATCH_EXTENTS];
+	unsigned int nr;
+	bool compressed, keep;
+	int err;
+	/* data of all extents in a row at @pos, reused across batches */
+	char *buffer;
+	size_t size, buffer_size;
+	erofs_off_t pos;
+	struct erofsfsck_task task;
+};
+
+static void erofsfsck_run_batch(struct erofsfsck_worker *w,
+				struct erofsfsck_batch *b)
 {
+	struct erofs_map_blocks map;
+	char *out;
+	unsigned int i;
 	int ret = 0;
-	erofs_off_t pos = 0;
-	u64 pchunk_len = 0;
-	struct erofsfsck_work *head = NULL, **last = &head;
-	struct erofsfsck_work s, *work;
 
-	s.inode = inode;
-	s.map = (struct erofs_map_blocks) {
+	if (!erofsfsck_get_buffer(&b->buffer, &b->buffer_size, b->size)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	out = b->buffer;
+	for (i = 0; i < b->nr; ++i) {
+		struct erofsfsck_extent *e = &b->extents[i];
+
+		map.m_pa = e->pa;
+		map.m_la = e->la;
+		map.m_plen = e->plen;
+		map.m_llen = e->llen;
+		map.m_flags = e->flags;
+		map.m_deviceid = e->deviceid;
+		map.m_algorithmformat = e->algorithmformat;
+
+		if (e->flags & EROFS_MAP_FRAGMENT)
+			ret = erofsfsck_read_fragment(b->inode, out, e->llen,
+						      &w->out, &w->out_size,
+						      b->keep);
+		else if (b->compressed)
+			ret = erofsfsck_decompress(b->inode, &map, NULL, out,
+						   b->keep);
+		else
+			ret = erofs_read_one_data(b->inode, &map, out, 0,
+						  e->plen);
+		if (ret)
+			break;
+		out += e->llen;
+	}
+out:
+	b->err = ret;
+	/* the owner may be waiting for this very batch */
+	erofs_mutex_lock(&b->owner->batch_lock);
+	__atomic_store_n(&b->state, EROFSFSCK_BATCH_DONE, __ATOMIC_RELEASE);
+	erofs_cond_signal(&b->owner->batch_done);
+	erofs_mutex_unlock(&b->owner->batch_lock);
+}
+
+static bool erofsfsck_claim_batch(struct erofsfsck_worker *w,
+				  struct erofsfsck_batch *b)
+{
+	unsigned int state = EROFSFSCK_BATCH_READY;
+
+	if (!__atomic_compare_exchange_n(&b->state, &state,
+					 EROFSFSCK_BATCH_RUNNING, false,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return false;
+	erofsfsck_run_batch(w, b);
+	return true;
+}
+
+static void erofsfsck_submit_batch(struct erofsfsck_worker *w,
+				   struct erofsfsck_batch *b, bool share)
+{
+	__atomic_store_n(&b->state, EROFSFSCK_BATCH_READY, __ATOMIC_RELEASE);
+	if (share && fsckcfg.nr_workers > 1)
+		erofsfsck_queue(w, &b->task);
+}
+
+static int erofsfsck_pwrite(int fd, const char *buf, size_t len,
+			    erofs_off_t pos)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, buf, len, pos);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			return ret < 0 ? -errno : -EIO;
+		}
+		buf += ret;
+		len -= ret;
+		pos += ret;
+	}
+	return 0;
+}
+
+/* wait for the oldest batch (helping with the others meanwhile) */
+static int erofsfsck_drain_batch(struct erofsfsck_worker *w,
+				 unsigned long *head, unsigned long tail,
+				 int outfd)
+{
+	struct erofsfsck_batch *b = &w->batches[*head % w->nr_batches];
+	unsigned long i;
+	int ret;
+
+	while (!erofsfsck_claim_batch(w, b) &&
+	       __atomic_load_n(&b->state, __ATOMIC_ACQUIRE) !=
+			EROFSFSCK_BATCH_DONE) {
+		for (i = *head + 1; i != tail; ++i)
+			if (erofsfsck_claim_batch(w, &w->batches[i %
+							w->nr_batches]))
+				break;
+		if (i != tail)
+			continue;
+
+		/* nothing left to help with, sleep until the thief is done */
+		erofs_mutex_lock(&w->batch_lock);
+		while (__atomic_load_n(&b->state, __ATOMIC_ACQUIRE) !=
+				EROFSFSCK_BATCH_DONE)
+			erofs_cond_wait(&w->batch_done, &w->batch_lock);
+		erofs_mutex_unlock(&w->batch_lock);
+		break;
+	}
+
+	ret = b->err;
+	if (!ret && outfd >= 0 &&
+	    erofsfsck_pwrite(outfd, b->buffer, b->size, b->pos)) {
+		erofs_err("I/O error occurred when extracting data @ nid %llu",
+			  b->inode->nid | 0ULL);
+		ret = -EIO;
+	}
+	__atomic_store_n(&b->state, EROFSFSCK_BATCH_IDLE, __ATOMIC_RELAXED);
+	++*head;
+	return ret;
+}
+
+/*
+ * With --physical-order, inodes are walked as usual but their data is only
+ * recorded here.  Then all extents are sorted by device and address and
+ * swept through with large reads, so that cold devices see sequential I/O
+ * rather than seeking back and forth between files.
+ */
+#define EROFSFSCK_SCAN_WINDOW	(4 * 1024 * 1024)
+/* read over gaps of up to this size instead of starting a new window */
+#define EROFSFSCK_SCAN_GAP	(128 * 1024)
+/* fragments are read from the packed inode, ordered by their offset */
+#define EROFSFSCK_SCAN_PACKED	USHRT_MAX
+
+struct erofsfsck_scan_extent {
+	struct erofsfsck_extent e;	/* .pa/.deviceid after erofs_map_dev() */
+	erofs_nid_t nid;
+	bool compressed;
+};
+
+struct erofsfsck_scan_window {
+	unsigned long first;		/* index of the first extent */
+	erofs_off_t start, end;
+};
+
+static int erofsfsck_collect_extent(struct erofsfsck_worker *w,
+				    struct erofs_inode *inode,
+				    struct erofs_map_blocks *map,
+				    bool compressed)
+{
+	struct erofs_map_dev mdev = {
+		.m_deviceid = map->m_deviceid,
+		.m_pa = map->m_pa,
+	};
+	struct erofsfsck_scan_extent *se;
+	u64 ofs, len;
+	int ret;
+
+	if (map->m_flags & EROFS_MAP_FRAGMENT) {
+		mdev.m_deviceid = EROFSFSCK_SCAN_PACKED;
+		mdev.m_pa = inode->fragmentoff;
+	} else {
+		ret = erofs_map_dev(inode->sbi, &mdev);
+		if (ret)
+			return ret;
+	}
+
+	/* uncompressed extents are split up to fit in a window */
+	for (ofs = 0; ofs < map->m_llen; ofs += len) {
+		len = compressed ? map->m_llen :
+			min_t(u64, map->m_llen - ofs, EROFSFSCK_SCAN_WINDOW);
+		if (w->nr_extents >= w->max_extents) {
+			unsigned long n = max(1024UL, w->max_extents << 1);
+
+			se = realloc(w->extents, n * sizeof(*se));
+			if (!se)
+				return -ENOMEM;
+			w->extents = se;
+			w->max_extents = n;
+		}
+		se = &w->extents[w->nr_extents++];
+		se->nid = inode->nid;
+		se->compressed = compressed;
+		se->e = (struct erofsfsck_extent) {
+			.pa = mdev.m_pa + ofs,
+			.la = map->m_la + ofs,
+			.plen = compressed ? map->m_plen : len,
+			.llen = len,
+			.flags = map->m_flags,
+			.deviceid = mdev.m_deviceid,
+			.algorithmformat = map->m_algorithmformat,
+		};
+	}
+	return 0;
+}
+
+/*
+ * Extracted data is written at the offsets of its extents, so that holes
+ * are simply skipped.  Large files are preallocated at once to keep them
+ * contiguous, in which case their holes have to be punched out again.
+ */
+#define EROFSFSCK_PREALLOC_MIN	(1024 * 1024)
+
+static bool erofsfsck_preallocate(int fd, erofs_off_t size)
+{
+#if defined(HAVE_FALLOCATE)
+	return fallocate(fd, 0, 0, size) >= 0;
+#else
+	return false;
+#endif
+}
+
+static void erofsfsck_punch_hole(int fd, erofs_off_t pos, erofs_off_t len)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+	/* otherwise it just wastes space since it reads as zeroes anyway */
+	(void)fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			pos, len);
+#endif
+}
+
+#ifdef HAVE_COPY_FILE_RANGE
+/*
+ * Let the kernel copy block-aligned uncompressed data to @outfd without
+ * going through userspace (or even share the blocks if the filesystem
+ * supports reflinks).  Return how much is copied, the rest of which is
+ * left to batches.
+ */
+static u64 erofsfsck_copy_extent(struct erofs_inode *inode,
+				 struct erofs_map_blocks *map, int outfd)
+{
+	struct erofs_map_dev mdev = {
+		.m_deviceid = map->m_deviceid,
+		.m_pa = map->m_pa,
+	};
+	erofs_off_t pos = map->m_la, end = map->m_la + map->m_llen;
+	u64 offset;
+	ssize_t ret;
+	int fd;
+
+	if (__atomic_load_n(&fsckcfg.no_copy_range, __ATOMIC_RELAXED) ||
+	    (map->m_flags & EROFS_MAP_META) ||
+	    erofs_blkoff(map->m_pa) || erofs_blkoff(map->m_la))
+		return 0;
+	if (erofs_map_dev(inode->sbi, &mdev))
+		return 0;
+	offset = mdev.m_pa;
+	fd = dev_get_fd(inode->sbi, mdev.m_deviceid, &offset, map->m_llen);
+	if (fd < 0)
+		return 0;
+
+	while (pos < end) {
+		ret = erofs_copy_file_range(fd, &offset, outfd, &pos,
+					    end - pos);
+		if (ret <= 0) {
+			if (ret < 0) {
+				erofs_dbg("copy_file_range() failed: %s",
+					  strerror(-ret));
+				__atomic_store_n(&fsckcfg.no_copy_range, true,
+						 __ATOMIC_RELAXED);
+			}
+			break;
+		}
+	}
+	return pos - map->m_la;
+}
+#endif
+
+static int erofs_verify_inode_data(struct erofsfsck_worker *w,
+				   struct erofs_inode *inode, int outfd)
+{
+	struct erofs_map_blocks map = {
 		.index = UINT_MAX,
 	};
-	s.buffer = s.raw = NULL;
-	s.buffer_size = s.raw_size = 0;
+	struct erofsfsck_batch *b = NULL;
+	unsigned long head = 0, tail = 0;
+	struct erofs_readahead ra = {};
+	erofs_off_t pos = 0;
+	u64 pchunk_len = 0, ofs, len;
+	bool compressed, preallocated = false, tailhole = false;
+	int ret = 0, err;
 
 	erofs_dbg("verify data chunk of nid(%llu): type(%d)",
 		  inode->nid | 0ULL, inode->datalayout);
@@ -434,142 +1199,166 @@ static int erofs_verify_inode_data(struct erofs_inode *inode, int outfd)
 	case EROFS_INODE_FLAT_PLAIN:
 	case EROFS_INODE_FLAT_INLINE:
 	case EROFS_INODE_CHUNK_BASED:
-		s.compressed = false;
+		compressed = false;
 		break;
 	case EROFS_INODE_FLAT_COMPRESSION_LEGACY:
 	case EROFS_INODE_FLAT_COMPRESSION:
-		s.compressed = true;
+		compressed = true;
 		break;
 	default:
 		erofs_err("unknown datalayout");
 		return -EINVAL;
 	}
 
+	if (outfd >= 0 && inode->i_size >= EROFSFSCK_PREALLOC_MIN)
+		preallocated = erofsfsck_preallocate(outfd, inode->i_size);
+
 	while (pos < inode->i_size) {
-		s.map.m_la = pos;
-		if (s.compressed)
-			ret = z_erofs_map_blocks_iter(inode, &s.map,
+		map.m_la = pos;
+		if (compressed)
+			ret = z_erofs_map_blocks_iter(inode, &map,
 					EROFS_GET_BLOCKS_FIEMAP);
 		else
-			ret = erofs_map_blocks(inode, &s.map,
+			ret = erofs_map_blocks(inode, &map,
 					EROFS_GET_BLOCKS_FIEMAP);
 		if (ret)
 			goto out;
 
-		if (!s.compressed && s.map.m_llen != s.map.m_plen) {
+		if (!compressed && map.m_llen != map.m_plen) {
 			erofs_err("broken chunk length m_la %" PRIu64 " m_llen %" PRIu64 " m_plen %" PRIu64,
-				  s.map.m_la, s.map.m_llen, s.map.m_plen);
+				  map.m_la, map.m_llen, map.m_plen);
 			ret = -EFSCORRUPTED;
 			goto out;
 		}
 
 		/* the last lcluster can be divided into 3 parts */
-		if (s.map.m_la + s.map.m_llen > inode->i_size)
-			s.map.m_llen = inode->i_size - s.map.m_la;
+		if (map.m_la + map.m_llen > inode->i_size)
+			map.m_llen = inode->i_size - map.m_la;
 
-		pchunk_len += s.map.m_plen;
-		pos += s.map.m_llen;
+		pchunk_len += map.m_plen;
+		pos += map.m_llen;
+
+		if (!fsckcfg.check_decomp)
+			continue;
 
 		/* should skip decomp? */
-		if (!(s.map.m_flags & EROFS_MAP_MAPPED) || !fsckcfg.check_decomp)
+		tailhole = !(map.m_flags & EROFS_MAP_MAPPED);
+		if (tailhole) {
+			if (preallocated)
+				erofsfsck_punch_hole(outfd, map.m_la,
+						     map.m_llen);
 			continue;
+		}
 
-		if (fsckcfg.multithreading) {
-			if (fsckcfg.idle) {
-				work = fsckcfg.idle;
-				fsckcfg.idle = work->next;
-				work->next = NULL;
-			} else {
-				work = calloc(1, sizeof(*work));
-				BUG_ON(!work);
-			}
-			*last = work;
-			last = &work->next;
-			work->work.function = erofsfsck_decompress_work;
-			work->map = s.map;
-			work->compressed = s.compressed;
-			ret = erofs_workqueue_add(&fsckcfg.wq, &work->work);
-			if (ret)
-				goto out;	/* XXXX? */
-			pthread_mutex_lock(&fsckcfg.wq.lock);
-			while (!(work = head)->work.function) {
-				if (work->eio)
-					ret = -EIO;
-				else if (outfd >= 0 &&
-					 write(outfd, s.compressed ?
-					       head->buffer : work->raw,
-					       work->map.m_llen) < 0)
-					ret = -EIO;
-				head = head->next;
-				work->next = fsckcfg.idle;
-				fsckcfg.idle = work;
-				if (!head || ret)
-					break;
-			}
-			pthread_mutex_unlock(&fsckcfg.wq.lock);
-			if (!head)
-				last = &head;
-			if (ret)
-				goto err_eio;
-		} else {
-			ret = erofsfsck_extract_one(&s);
+		/* data will be checked later together with all other files */
+		if (fsckcfg.physical_order) {
+			ret = erofsfsck_collect_extent(w, inode, &map,
+						       compressed);
 			if (ret)
 				goto out;
-			if (outfd < 0)
+			continue;
+		}
+
+#ifdef HAVE_COPY_FILE_RANGE
+		if (outfd >= 0 && !compressed) {
+			ofs = erofsfsck_copy_extent(inode, &map, outfd);
+			if (ofs >= map.m_llen)
 				continue;
-			if (write(outfd, s.compressed ? s.buffer : s.raw,
-				  s.map.m_llen) < 0)
-				goto err_eio;
+			map.m_pa += ofs;
+			map.m_la += ofs;
+			map.m_plen -= ofs;
+			map.m_llen -= ofs;
+		}
+#endif
+		erofs_readahead(inode, &ra, map.m_la, map.m_llen);
+
+		/* uncompressed extents can be split up to bound batches */
+		for (ofs = 0; ofs < map.m_llen; ofs += len) {
+			struct erofsfsck_extent *e;
+
+			len = compressed ? map.m_llen :
+				min_t(u64, map.m_llen - ofs,
+				      EROFSFSCK_BATCH_SIZE);
+			/* data after holes or copied ranges goes elsewhere */
+			if (b && b->pos + b->size != map.m_la + ofs) {
+				erofsfsck_submit_batch(w, b, true);
+				b = NULL;
+			}
+			if (!b) {
+				if (tail - head >= w->nr_batches) {
+					ret = erofsfsck_drain_batch(w, &head,
+							tail, outfd);
+					if (ret)
+						goto out;
+				}
+				b = &w->batches[tail++ % w->nr_batches];
+				b->inode = inode;
+				b->compressed = compressed;
+				b->keep = outfd >= 0;
+				b->nr = 0;
+				b->size = 0;
+				b->pos = map.m_la + ofs;
+			}
+
+			e = &b->extents[b->nr++];
+			e->pa = map.m_pa + ofs;
+			e->la = map.m_la + ofs;
+			e->plen = compressed ? map.m_plen : len;
+			e->llen = len;
+			e->flags = map.m_flags;
+			e->deviceid = map.m_deviceid;
+			e->algorithmformat = map.m_algorithmformat;
+			b->size += len;
+			if (b->nr >= EROFSFSCK_BATCH_EXTENTS ||
+			    b->size >= EROFSFSCK_BATCH_SIZE) {
+				/* the last batch would be run here anyway */
+				erofsfsck_submit_batch(w, b, pos < inode->i_size ||
+						       ofs + len < map.m_llen);
+				b = NULL;
+			}
 		}
 	}
+	if (b) {
+		erofsfsck_submit_batch(w, b, false);
+		b = NULL;
+	}
 
 	if (fsckcfg.print_comp_ratio) {
 		if (!erofs_is_packed_inode(inode))
-			fsckcfg.logical_blocks += BLK_ROUND_UP(inode->i_size);
-		fsckcfg.physical_blocks += BLK_ROUND_UP(pchunk_len);
+			w->logical_blocks += BLK_ROUND_UP(inode->i_size);
+		w->physical_blocks += BLK_ROUND_UP(pchunk_len);
 	}
 
 out:
-	if (fsckcfg.multithreading) {
-		while (head) {
-			pthread_mutex_lock(&fsckcfg.wq.lock);
-			while (!(work = head)->work.function) {
-				if (work->eio)
-					ret = -EIO;
-				else if (outfd >= 0 && write(outfd, s.compressed ?
-					  work->buffer : work->raw,
-						  work->map.m_llen) < 0)
-					ret = -EIO;
-				head = head->next;
-				work->next = fsckcfg.idle;
-				fsckcfg.idle = work;
-				if (!head)
-					break;
-			}
-			pthread_mutex_unlock(&fsckcfg.wq.lock);
-		}
+	/* others may still be reading batches, which refer to the inode */
+	if (b) {
+		b->nr = b->size = 0;
+		erofsfsck_submit_batch(w, b, false);
 	}
-
-	if (s.raw)
-		free(s.raw);
-	if (s.buffer)
-		free(s.buffer);
-	return ret < 0 ? ret : 0;
-err_eio:
-	erofs_err("I/O error occurred when extracting data @ nid %llu",
-		  inode->nid | 0ULL);
-	ret = -EIO;
-	goto out;
+	while (head != tail) {
+		err = erofsfsck_drain_batch(w, &head, tail, ret ? -1 : outfd);
+		if (!ret)
+			ret = err;
+	}
+	/* the file size isn't reached by writes if it ends with a hole */
+	if (!ret && outfd >= 0 && tailhole && !preallocated &&
+	    ftruncate(outfd, inode->i_size) < 0) {
+		ret = -errno;
+		erofs_err("failed to truncate to %llu bytes @ nid %llu",
+			  inode->i_size | 0ULL, inode->nid | 0ULL);
+	}
+	return ret;
 }
 
-static inline int erofs_extract_dir(struct erofs_inode *inode)
+static inline int erofs_extract_dir(struct erofsfsck_worker *w,
+				    struct erofs_inode *inode, const char *path)
 {
 	int ret;
 
-	erofs_dbg("create directory %s", fsckcfg.extract_path);
+	erofs_dbg("create directory %s", path);
 
 	/* verify data chunk layout */
-	ret = erofs_verify_inode_data(inode, -1);
+	ret = erofs_verify_inode_data(w, inode, -1);
 	if (ret)
 		return ret;
 
@@ -579,19 +1368,19 @@ static inline int erofs_extract_dir(struct erofs_inode *inode)
 	 * write/execute permission.  These are fixed up later in
 	 * erofsfsck_set_attributes().
 	 */
-	if (mkdir(fsckcfg.extract_path, 0700) < 0) {
+	if (mkdir(path, 0700) < 0) {
 		struct stat st;
 
 		if (errno != EEXIST) {
 			erofs_err("failed to create directory: %s (%s)",
-				  fsckcfg.extract_path, strerror(errno));
+				  path, strerror(errno));
 			return -errno;
 		}
 
-		if (lstat(fsckcfg.extract_path, &st) ||
+		if (lstat(path, &st) ||
 		    !S_ISDIR(st.st_mode)) {
 			erofs_err("path is not a directory: %s",
-				  fsckcfg.extract_path);
+				  path);
 			return -ENOTDIR;
 		}
 
@@ -599,70 +1388,78 @@ static inline int erofs_extract_dir(struct erofs_inode *inode)
 		 * Try to change permissions of existing directory so
 		 * that we can write to it
 		 */
-		if (chmod(fsckcfg.extract_path, 0700) < 0) {
+		if (chmod(path, 0700) < 0) {
 			erofs_err("failed to set permissions: %s (%s)",
-				  fsckcfg.extract_path, strerror(errno));
+				  path, strerror(errno));
 			return -errno;
 		}
 	}
 	return 0;
 }
 
-static inline int erofs_extract_file(struct erofs_inode *inode)
+static inline int erofs_extract_file(struct erofsfsck_worker *w,
+				     struct erofs_inode *inode,
+				     const char *path)
 {
 	bool tryagain = true;
 	int ret, fd;
 
-	erofs_dbg("extract file to path: %s", fsckcfg.extract_path);
+	erofs_dbg("extract file to path: %s", path);
 
 again:
-	fd = open(fsckcfg.extract_path,
+	fd = open(path,
 		  O_WRONLY | O_CREAT | O_NOFOLLOW |
 			(fsckcfg.overwrite ? O_TRUNC : O_EXCL), 0700);
 	if (fd < 0) {
 		if (fsckcfg.overwrite && tryagain) {
 			if (errno == EISDIR) {
 				erofs_warn("try to forcely remove directory %s",
-					   fsckcfg.extract_path);
-				if (rmdir(fsckcfg.extract_path) < 0) {
+					   path);
+				if (rmdir(path) < 0) {
 					erofs_err("failed to remove: %s (%s)",
-						  fsckcfg.extract_path, strerror(errno));
+						  path, strerror(errno));
 					return -EISDIR;
 				}
 			} else if (errno == EACCES &&
-				   chmod(fsckcfg.extract_path, 0700) < 0) {
+				   chmod(path, 0700) < 0) {
 				erofs_err("failed to set permissions: %s (%s)",
-					  fsckcfg.extract_path, strerror(errno));
+					  path, strerror(errno));
 				return -errno;
 			}
 			tryagain = false;
 			goto again;
 		}
-		erofs_err("failed to open: %s (%s)", fsckcfg.extract_path,
+		erofs_err("failed to open: %s (%s)", path,
 			  strerror(errno));
 		return -errno;
 	}
 
 	/* verify data chunk layout */
-	ret = erofs_verify_inode_data(inode, fd);
-	if (ret)
+	ret = erofs_verify_inode_data(w, inode, fd);
+	if (ret) {
+		close(fd);
 		return ret;
+	}
 
+	/* saves path lookups while the file is still open */
+	erofsfsck_set_attributes(inode, path, fd);
 	if (close(fd))
 		return -errno;
 	return ret;
 }
 
-static inline int erofs_extract_symlink(struct erofs_inode *inode)
+static inline int erofs_extract_symlink(struct erofsfsck_worker *w,
+					struct erofs_inode *inode,
+					const char *path)
 {
 	bool tryagain = true;
 	int ret;
 	char *buf = NULL;
 
-	erofs_dbg("extract symlink to path: %s", fsckcfg.extract_path);
+	erofs_dbg("extract symlink to path: %s", path);
 
 	/* verify data chunk layout */
-	ret = erofs_verify_inode_data(inode, -1);
+	ret = erofs_verify_inode_data(w, inode, -1);
 	if (ret)
 		return ret;
 
@@ -681,13 +1478,13 @@ static inline int erofs_extract_symlink(struct erofs_inode *inode)
 
 	buf[inode->i_size] = '\0';
 again:
-	if (symlink(buf, fsckcfg.extract_path) < 0) {
+	if (symlink(buf, path) < 0) {
 		if (errno == EEXIST && fsckcfg.overwrite && tryagain) {
 			erofs_warn("try to forcely remove file %s",
-				   fsckcfg.extract_path);
-			if (unlink(fsckcfg.extract_path) < 0) {
+				   path);
+			if (unlink(path) < 0) {
 				erofs_err("failed to remove: %s",
-					  fsckcfg.extract_path);
+					  path);
 				ret = -errno;
 				goto out;
 			}
@@ -695,7 +1492,7 @@ again:
 			goto again;
 		}
 		erofs_err("failed to create symlink: %s",
-			  fsckcfg.extract_path);
+			  path);
 		ret = -errno;
 	}
 out:
@@ -704,26 +1501,27 @@ out:
 	return ret;
 }
 
-static int erofs_extract_special(struct erofs_inode *inode)
+static int erofs_extract_special(struct erofsfsck_worker *w,
+				 struct erofs_inode *inode, const char *path)
 {
 	bool tryagain = true;
 	int ret;
 
-	erofs_dbg("extract special to path: %s", fsckcfg.extract_path);
+	erofs_dbg("extract special to path: %s", path);
 
 	/* verify data chunk layout */
-	ret = erofs_verify_inode_data(inode, -1);
+	ret = erofs_verify_inode_data(w, inode, -1);
 	if (ret)
 		return ret;
 
 again:
-	if (mknod(fsckcfg.extract_path, inode->i_mode, inode->u.i_rdev) < 0) {
+	if (mknod(path, inode->i_mode, inode->u.i_rdev) < 0) {
 		if (errno == EEXIST && fsckcfg.overwrite && tryagain) {
 			erofs_warn("try to forcely remove file %s",
-				   fsckcfg.extract_path);
-			if (unlink(fsckcfg.extract_path) < 0) {
+				   path);
+			if (unlink(path) < 0) {
 				erofs_err("failed to remove: %s",
-					  fsckcfg.extract_path);
+					  path);
 				return -errno;
 			}
 			tryagain = false;
@@ -731,91 +1529,148 @@ again:
 		}
 		if (errno == EEXIST || fsckcfg.superuser) {
 			erofs_err("failed to create special file: %s",
-				  fsckcfg.extract_path);
+				  path);
 			ret = -errno;
 		} else {
 			erofs_warn("failed to create special file: %s, skipped",
-				   fsckcfg.extract_path);
+				   path);
 			ret = -ECANCELED;
 		}
 	}
 	return ret;
 }
 
-struct erofsfsck_dir_work {
-	struct erofs_work work;
-	erofs_nid_t pnid, nid;
-};
-
-static void erofsfsck_dir_work(struct erofs_workqueue *wq,
-			       struct erofs_work *wi)
+static void erofsfsck_get_dir(struct erofsfsck_dir *dir)
 {
-	struct erofsfsck_dir_work *work = (void *)wi;
+	__atomic_add_fetch(&dir->refcount, 1, __ATOMIC_RELAXED);
+}
 
-	erofsfsck_check_inode(work->pnid, work->nid);
+static void erofsfsck_put_dir(struct erofsfsck_dir *dir)
+{
+	while (dir &&
+	       !__atomic_sub_fetch(&dir->refcount, 1, __ATOMIC_ACQ_REL)) {
+		struct erofsfsck_dir *parent = dir->parent;
+
+		if (!dir->failed &&
+		    !__atomic_load_n(&fsckcfg.aborted, __ATOMIC_RELAXED))
+			erofsfsck_set_attributes(&dir->inode, dir->path, -1);
+		free(dir);
+		dir = parent;
+	}
 }
 
+struct erofsfsck_dirent_ctx {
+	struct erofs_dir_context ctx;
+	struct erofsfsck_worker *w;
+	struct erofsfsck_dir *dir;
+};
+
 static int erofsfsck_dirent_iter(struct erofs_dir_context *ctx)
 {
-	int ret;
-	size_t prev_pos = fsckcfg.extract_pos;
+	struct erofsfsck_dirent_ctx *dctx =
+		container_of(ctx, struct erofsfsck_dirent_ctx, ctx);
+	struct erofsfsck_dir *dir = dctx->dir;
+	struct erofsfsck_task *t;
+	size_t len = 0;
 
 	if (ctx->dot_dotdot)
 		return 0;
 
-	if (fsckcfg.extract_path) {
-		size_t curr_pos = prev_pos;
-
-		fsckcfg.extract_path[curr_pos++] = '/';
-		strncpy(fsckcfg.extract_path + curr_pos, ctx->dname,
-			ctx->de_namelen);
-		curr_pos += ctx->de_namelen;
-		fsckcfg.extract_path[curr_pos] = '\0';
-		fsckcfg.extract_pos = curr_pos;
+	if (dir->path) {
+		len = dir->pathlen + 1 + ctx->de_namelen;
+		if (len >= PATH_MAX) {
+			erofs_err("path too long: %s/%.*s", dir->path,
+				  ctx->de_namelen, ctx->dname);
+			return -ENAMETOOLONG;
+		}
 	}
 
-	if (fsckcfg.multithreading &&
-	    fsckcfg.extract_path && ctx->de_ftype == EROFS_FT_DIR) {
-		struct erofsfsck_dir_work *work;
+	t = malloc(sizeof(*t) + len + 1);
+	if (!t)
+		return -ENOMEM;
+	t->batch = NULL;
+	t->pnid = ctx->dir->nid;
+	t->nid = ctx->de_nid;
+	t->parent = dir;
+	t->path = NULL;
+	t->pathlen = len;
+	if (dir->path) {
+		t->path = (char *)(t + 1);
+		memcpy(t->path, dir->path, dir->pathlen);
+		t->path[dir->pathlen] = '/';
+		memcpy(t->path + dir->pathlen + 1, ctx->dname,
+		       ctx->de_namelen);
+		t->path[len] = '\0';
+	}
+	erofsfsck_get_dir(dir);
+	erofsfsck_queue(dctx->w, t);
+	return 0;
+}
 
-		work = calloc(1, sizeof(*work));
-		if (!work)
-			goto fallback;
+/* queue all children, which will be checked by any worker */
+static int erofsfsck_check_dir(struct erofsfsck_worker *w,
+			       struct erofsfsck_task *t,
+			       struct erofs_inode *inode)
+{
+	size_t len = t->path ? strlen(t->path) + 1 : 0;
+	struct erofsfsck_dirent_ctx dctx;
+	struct erofsfsck_dir *dir;
+	int ret;
 
-		work->work.function = erofsfsck_dir_work;
-		work->pnid = ctx->dir->nid;
-		work->nid = ctx->de_nid;
-		ret = erofs_workqueue_add(&fsckcfg.wq, &work->work);
-		if (ret) {
-			free(work);
-			ret = 0;
-			goto fallback;
-		}
-	} else {
-fallback:
-		ret = erofsfsck_check_inode(ctx->dir->nid, ctx->de_nid);
+	dir = malloc(sizeof(*dir) + len);
+	if (!dir)
+		return -ENOMEM;
+	/* the reference of the task to its parent is handed over */
+	dir->parent = t->parent;
+	t->parent = NULL;
+	dir->inode = *inode;
+	dir->refcount = 1;
+	dir->failed = false;
+	dir->path = NULL;
+	dir->pathlen = t->pathlen;
+	if (t->path) {
+		dir->path = (char *)(dir + 1);
+		memcpy(dir->path, t->path, len);
 	}
 
-	if (fsckcfg.extract_path) {
-		fsckcfg.extract_path[prev_pos] = '\0';
-		fsckcfg.extract_pos = prev_pos;
-	}
+	/* XXXX: the dir depth should be restricted in order to avoid loops */
+	dctx = (struct erofsfsck_dirent_ctx) {
+		.ctx = {
+			.flags = EROFS_READDIR_VALID_PNID,
+			.pnid = t->pnid,
+			.dir = &dir->inode,
+			.cb = erofsfsck_dirent_iter,
+		},
+		.w = w,
+		.dir = dir,
+	};
+	ret = erofs_iterate_dir(&dctx.ctx, true);
+	if (ret)
+		dir->failed = true;
+	erofsfsck_put_dir(dir);
 	return ret;
 }
 
-static int erofsfsck_check_inode(erofs_nid_t pnid, erofs_nid_t nid)
+static int erofsfsck_check_inode(struct erofsfsck_worker *w,
+				 struct erofsfsck_task *t)
 {
 	int ret;
 	struct erofs_inode inode;
 
-	erofs_dbg("check inode: nid(%llu)", nid | 0ULL);
+	erofs_dbg("check inode: nid(%llu)", t->nid | 0ULL);
 
-	inode.nid = nid;
+	/*
+	 * Each inode is visited once here, so it is decoded into a stack copy
+	 * rather than going through the inode cache, which would allocate and
+	 * evict a full struct erofs_inode for every file of the image.
+	 */
+	inode.sbi = &sbi;
+	inode.nid = t->nid;
 	ret = erofs_read_inode_from_disk(&inode);
 	if (ret) {
 		if (ret == -EIO)
 			erofs_err("I/O error occurred when reading nid(%llu)",
-				  nid | 0ULL);
+				  t->nid | 0ULL);
 		goto out;
 	}
 
@@ -824,24 +1679,24 @@ static int erofsfsck_check_inode(erofs_nid_t pnid, erofs_nid_t nid)
 	if (ret)
 		goto out;
 
-	if (fsckcfg.extract_path) {
+	if (t->path) {
 		switch (inode.i_mode & S_IFMT) {
 		case S_IFDIR:
-			ret = erofs_extract_dir(&inode);
+			ret = erofs_extract_dir(w, &inode, t->path);
 			break;
 		case S_IFREG:
 			if (erofs_is_packed_inode(&inode))
 				goto verify;
-			ret = erofs_extract_file(&inode);
+			ret = erofs_extract_file(w, &inode, t->path);
 			break;
 		case S_IFLNK:
-			ret = erofs_extract_symlink(&inode);
+			ret = erofs_extract_symlink(w, &inode, t->path);
 			break;
 		case S_IFCHR:
 		case S_IFBLK:
 		case S_IFIFO:
 		case S_IFSOCK:
-			ret = erofs_extract_special(&inode);
+			ret = erofs_extract_special(w, &inode, t->path);
 			break;
 		default:
 			/* TODO */
@@ -850,34 +1705,439 @@ static int erofsfsck_check_inode(erofs_nid_t pnid, erofs_nid_t nid)
 	} else {
 verify:
 		/* verify data chunk layout */
-		ret = erofs_verify_inode_data(&inode, -1);
+		ret = erofs_verify_inode_data(w, &inode, -1);
 	}
 	if (ret && ret != -ECANCELED)
 		goto out;
 
-	/* XXXX: the dir depth should be restricted in order to avoid loops */
-	if (S_ISDIR(inode.i_mode)) {
-		struct erofs_dir_context ctx = {
-			.flags = EROFS_READDIR_VALID_PNID,
-			.pnid = pnid,
-			.dir = &inode,
-			.cb = erofsfsck_dirent_iter,
-		};
-
-		ret = erofs_iterate_dir(&ctx, true);
-	}
-
-	if (!ret && !erofs_is_packed_inode(&inode))
-		erofsfsck_set_attributes(&inode, fsckcfg.extract_path);
+	/*
+	 * attributes of directories are applied once children are done, and
+	 * those of regular files before they're closed
+	 */
+	if (S_ISDIR(inode.i_mode))
+		ret = erofsfsck_check_dir(w, t, &inode);
+	else if (!ret && !S_ISREG(inode.i_mode))
+		erofsfsck_set_attributes(&inode, t->path, -1);
 
 	if (ret == -ECANCELED)
 		ret = 0;
 out:
 	if (ret && ret != -EIO)
-		fsckcfg.corrupted = true;
+		w->corrupted = true;
+	return ret;
+}
+
+static void erofsfsck_run_task(struct erofsfsck_worker *w,
+			       struct erofsfsck_task *t)
+{
+	int ret;
+
+	if (t->batch) {
+		/* it might be done already, which is fine */
+		erofsfsck_claim_batch(w, t->batch);
+		goto done;
+	}
+
+	/* stop at the first error as a serial walk would do */
+	if (!__atomic_load_n(&fsckcfg.aborted, __ATOMIC_RELAXED)) {
+		ret = erofsfsck_check_inode(w, t);
+		if (ret) {
+			if (!w->err)
+				w->err = ret;
+			__atomic_store_n(&fsckcfg.aborted, true,
+					 __ATOMIC_RELAXED);
+		}
+	}
+	erofsfsck_put_dir(t->parent);
+	free(t);
+done:
+
+	if (!__atomic_sub_fetch(&fsckcfg.pending, 1, __ATOMIC_SEQ_CST)) {
+		erofs_mutex_lock(&fsckcfg.idle_lock);
+		erofs_cond_broadcast(&fsckcfg.idle_cond);
+		erofs_mutex_unlock(&fsckcfg.idle_lock);
+	}
+}
+
+static void erofsfsck_work(struct erofsfsck_worker *w)
+{
+	unsigned int i, me = w - fsckcfg.workers;
+	struct erofsfsck_task *t;
+
+	while (__atomic_load_n(&fsckcfg.pending, __ATOMIC_SEQ_CST)) {
+		t = erofsfsck_dequeue(w, false);
+		for (i = 1; !t && i < fsckcfg.nr_workers; ++i)
+			t = erofsfsck_dequeue(&fsckcfg.workers[(me + i) %
+						fsckcfg.nr_workers], true);
+		if (t) {
+			erofsfsck_run_task(w, t);
+			continue;
+		}
+
+		/* nothing to steal, wait for new tasks or the end */
+		erofs_mutex_lock(&fsckcfg.idle_lock);
+		__atomic_add_fetch(&fsckcfg.sleeping, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&fsckcfg.queued, __ATOMIC_SEQ_CST) <= 0 &&
+		       __atomic_load_n(&fsckcfg.pending, __ATOMIC_SEQ_CST))
+			erofs_cond_wait(&fsckcfg.idle_cond, &fsckcfg.idle_lock);
+		__atomic_sub_fetch(&fsckcfg.sleeping, 1, __ATOMIC_SEQ_CST);
+		erofs_mutex_unlock(&fsckcfg.idle_lock);
+	}
+}
+
+#ifdef EROFS_MT_ENABLED
+static void *erofsfsck_worker_thread(void *arg)
+{
+	fsckcfg.worker_fn(arg);
+	return NULL;
+}
+#endif
+
+/* run @fn on all workers, where the calling thread is the first one */
+static int erofsfsck_run_workers(void (*fn)(struct erofsfsck_worker *w))
+{
+	struct erofsfsck_worker *w = fsckcfg.workers;
+	unsigned int i;
+	int ret;
+#ifdef EROFS_MT_ENABLED
+	unsigned int nr;
+
+	fsckcfg.worker_fn = fn;
+	for (nr = 1; nr < fsckcfg.nr_workers; ++nr) {
+		ret = -pthread_create(&w[nr].th, NULL,
+				      erofsfsck_worker_thread, &w[nr]);
+		if (ret) {
+			erofs_warn("failed to create more than %u threads: %s",
+				   nr, strerror(-ret));
+			break;
+		}
+	}
+#endif
+	fn(w);
+#ifdef EROFS_MT_ENABLED
+	for (i = 1; i < nr; ++i)
+		pthread_join(w[i].th, NULL);
+#endif
+
+	ret = 0;
+	for (i = 0; i < fsckcfg.nr_workers; ++i) {
+		fsckcfg.physical_blocks += w[i].physical_blocks;
+		fsckcfg.logical_blocks += w[i].logical_blocks;
+		w[i].physical_blocks = w[i].logical_blocks = 0;
+		if (w[i].corrupted)
+			fsckcfg.corrupted = true;
+		if (!ret)
+			ret = w[i].err;
+		w[i].err = 0;
+	}
+	return ret;
+}
+
+static int erofsfsck_init_workers(void)
+{
+	unsigned int i;
+
+	if (!fsckcfg.nr_workers)
+		fsckcfg.nr_workers = max(1U, erofs_get_available_processors());
+#ifndef EROFS_MT_ENABLED
+	if (fsckcfg.nr_workers > 1)
+		erofs_warn("multi-threading support isn't enabled, ignoring --threads");
+	fsckcfg.nr_workers = 1;
+#endif
+	fsckcfg.workers = calloc(fsckcfg.nr_workers,
+				 sizeof(*fsckcfg.workers));
+	if (!fsckcfg.workers)
+		return -ENOMEM;
+	erofs_mutex_init(&fsckcfg.idle_lock);
+	erofs_cond_init(&fsckcfg.idle_cond);
+	erofsfsck_pcluster_init();
+	for (i = 0; i < fsckcfg.nr_workers; ++i) {
+		struct erofsfsck_worker *w = &fsckcfg.workers[i];
+
+		unsigned int j;
+
+		erofs_mutex_init(&w->lock);
+		erofs_mutex_init(&w->batch_lock);
+		erofs_cond_init(&w->batch_done);
+		w->mask = 255;
+		w->tasks = malloc((w->mask + 1) * sizeof(*w->tasks));
+		if (!w->tasks)
+			return -ENOMEM;
+
+		/* enough batches in flight to keep others busy */
+		w->nr_batches = fsckcfg.nr_workers < 2 ? 1 :
+			min_t(unsigned int, fsckcfg.nr_workers * 2,
+			      EROFSFSCK_MAX_BATCHES);
+		w->batches = calloc(w->nr_batches, sizeof(*w->batches));
+		if (!w->batches)
+			return -ENOMEM;
+		for (j = 0; j < w->nr_batches; ++j) {
+			w->batches[j].owner = w;
+			w->batches[j].task.batch = &w->batches[j];
+		}
+	}
+	return 0;
+}
+
+/* check the inode @nid and everything below it with all workers */
+static int erofsfsck_check_tree(erofs_nid_t nid, char *path, size_t pathlen)
+{
+	struct erofsfsck_task *t;
+
+	t = malloc(sizeof(*t));
+	if (!t)
+		return -ENOMEM;
+	*t = (struct erofsfsck_task) {
+		.pnid = nid,
+		.nid = nid,
+		.path = path,
+		.pathlen = pathlen,
+	};
+	erofsfsck_queue(fsckcfg.workers, t);
+	return erofsfsck_run_workers(erofsfsck_work);
+}
+
+static int erofsfsck_scan_cmp(const void *a, const void *b)
+{
+	const struct erofsfsck_extent *x = a, *y = b;
+
+	if (x->deviceid != y->deviceid)
+		return x->deviceid < y->deviceid ? -1 : 1;
+	if (x->pa != y->pa)
+		return x->pa < y->pa ? -1 : 1;
+	return 0;
+}
+
+/* uncompressed data only needs to be read, which is done by the caller */
+static int erofsfsck_scan_extent(struct erofsfsck_scan_extent *se,
+				 const char *in, char *out)
+{
+	struct erofs_inode inode = {
+		.sbi = &sbi,
+		.nid = se->nid,
+	};
+	struct erofs_map_blocks map = {
+		.m_pa = se->e.pa,
+		.m_la = se->e.la,
+		.m_plen = se->e.plen,
+		.m_llen = se->e.llen,
+		.m_flags = se->e.flags,
+		.m_deviceid = se->e.deviceid,
+		.m_algorithmformat = se->e.algorithmformat,
+	};
+	int ret;
+
+	if (!se->compressed)
+		return 0;
+	ret = erofsfsck_decompress(&inode, &map, in, out, false);
+	if (ret)
+		erofs_err("failed to verify data of nid %llu @ %llu: %d",
+			  se->nid | 0ULL, se->e.la | 0ULL, ret);
+	return ret;
+}
+
+/*
+ * Fragments are parts of the packed inode, whose data is swept like any
+ * other file, so only check that they are within it.
+ */
+static int erofsfsck_scan_fragments(struct erofsfsck_scan_extent *se,
+				    unsigned long n)
+{
+	struct erofs_inode *packed;
+	int ret = 0;
+
+	if (!n)
+		return 0;
+	packed = erofs_icache_get(&sbi, sbi.packed_nid);
+	if (IS_ERR(packed))
+		return PTR_ERR(packed);
+	for (; n; --n, ++se) {
+		if (se->e.pa + se->e.llen > packed->i_size) {
+			erofs_err("fragment of nid %llu is beyond the packed inode: %llu + %llu",
+				  se->nid | 0ULL, se->e.pa | 0ULL,
+				  se->e.llen | 0ULL);
+			fsckcfg.corrupted = true;
+			ret = -EFSCORRUPTED;
+			break;
+		}
+	}
+	erofs_icache_put(packed);
+	return ret;
+}
+
+static int erofsfsck_scan_window(struct erofsfsck_worker *w, unsigned long i)
+{
+	struct erofsfsck_scan_window *win = &fsckcfg.windows[i];
+	struct erofsfsck_scan_extent *se = &fsckcfg.scan[win->first];
+	struct erofsfsck_scan_extent *end = &fsckcfg.scan[win[1].first];
+	size_t len = win->end - win->start;
+	int dev = se->e.deviceid;
+	int ret;
+
+	/* keep the device busy with the windows after all running ones */
+	if (i + fsckcfg.nr_workers < fsckcfg.nr_windows) {
+		struct erofsfsck_scan_window *ra = win + fsckcfg.nr_workers;
+
+		dev_readahead(&sbi, fsckcfg.scan[ra->first].e.deviceid,
+			      ra->start, ra->end - ra->start);
+	}
+
+	/* really read it even if mapped, as uncompressed data isn't touched */
+	if (!erofsfsck_get_buffer(&w->window, &w->window_size, len))
+		return -ENOMEM;
+	ret = dev_read(&sbi, dev, w->window, win->start, len);
+	if (ret)
+		return ret;
+	w->bytes_read += len;
+
+	for (; se < end; ++se) {
+		if (se->compressed &&
+		    !erofsfsck_get_buffer(&w->out, &w->out_size, se->e.llen))
+			return -ENOMEM;
+		ret = erofsfsck_scan_extent(se, w->window +
+					    (se->e.pa - win->start), w->out);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static void erofsfsck_sweep(struct erofsfsck_worker *w)
+{
+	unsigned long i;
+	int ret;
+
+	while (!__atomic_load_n(&fsckcfg.aborted, __ATOMIC_RELAXED)) {
+		i = __atomic_fetch_add(&fsckcfg.next_window, 1,
+				       __ATOMIC_RELAXED);
+		if (i >= fsckcfg.nr_windows)
+			break;
+		ret = erofsfsck_scan_window(w, i);
+		if (ret) {
+			if (ret != -EIO)
+				w->corrupted = true;
+			w->err = ret;
+			__atomic_store_n(&fsckcfg.aborted, true,
+					 __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/* check the data of all files collected so far in physical order */
+static int erofsfsck_scan(void)
+{
+	struct erofsfsck_scan_extent *se;
+	struct erofsfsck_scan_window *win;
+	unsigned long i, n = 0, nr_windows;
+	struct timespec t0, t1;
+	u64 bytes = 0;
+	double secs;
+	int ret;
+
+	for (i = 0; i < fsckcfg.nr_workers; ++i)
+		n += fsckcfg.workers[i].nr_extents;
+	if (!n)
+		return 0;
+	fsckcfg.scan = malloc(n * sizeof(*fsckcfg.scan));
+	/* there are never more windows than extents */
+	fsckcfg.windows = malloc((n + 1) * sizeof(*fsckcfg.windows));
+	if (!fsckcfg.scan || !fsckcfg.windows)
+		return -ENOMEM;
+
+	for (n = 0, i = 0; i < fsckcfg.nr_workers; ++i) {
+		struct erofsfsck_worker *w = &fsckcfg.workers[i];
+
+		memcpy(fsckcfg.scan + n, w->extents,
+		       w->nr_extents * sizeof(*w->extents));
+		n += w->nr_extents;
+		free(w->extents);
+		w->extents = NULL;
+		w->nr_extents = w->max_extents = 0;
+	}
+	qsort(fsckcfg.scan, n, sizeof(*fsckcfg.scan), erofsfsck_scan_cmp);
+
+	/* fragments are sorted last */
+	for (i = n; i && fsckcfg.scan[i - 1].e.deviceid ==
+			EROFSFSCK_SCAN_PACKED; --i)
+		;
+	ret = erofsfsck_scan_fragments(fsckcfg.scan + i, n - i);
+	if (ret)
+		return ret;
+	n = i;
+
+	/* gather neighbouring extents into block-aligned windows */
+	nr_windows = 0;
+	for (i = 0; i < n; ) {
+		se = &fsckcfg.scan[i];
+		win = &fsckcfg.windows[nr_windows++];
+		win->first = i++;
+		win->start = round_down(se->e.pa, EROFS_BLKSIZ);
+		win->end = round_up(se->e.pa + se->e.plen, EROFS_BLKSIZ);
+		for (; i < n; ++i) {
+			struct erofsfsck_scan_extent *next = &fsckcfg.scan[i];
+			erofs_off_t end = round_up(next->e.pa + next->e.plen,
+						   EROFS_BLKSIZ);
+
+			if (next->e.deviceid != se->e.deviceid ||
+			    next->e.pa > win->end + EROFSFSCK_SCAN_GAP ||
+			    max(end, win->end) - win->start >
+					EROFSFSCK_SCAN_WINDOW)
+				break;
+			win->end = max(end, win->end);
+		}
+	}
+	fsckcfg.windows[nr_windows].first = n;
+	fsckcfg.nr_windows = nr_windows;
+	fsckcfg.next_window = 0;
+
+	erofs_info("Checking %lu extents of file data in %lu windows in physical order",
+		   n, nr_windows);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	ret = erofsfsck_run_workers(erofsfsck_sweep);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	for (i = 0; i < fsckcfg.nr_workers; ++i) {
+		bytes += fsckcfg.workers[i].bytes_read;
+		fsckcfg.workers[i].bytes_read = 0;
+	}
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	erofs_info("Read %.1f MiB in %.3f seconds: %.1f MiB/s",
+		   bytes / 1048576.0, secs,
+		   secs > 0 ? bytes / 1048576.0 / secs : 0);
 	return ret;
 }
 
+static void erofsfsck_exit_workers(void)
+{
+	unsigned int i;
+
+	if (!fsckcfg.workers)
+		return;
+	for (i = 0; i < fsckcfg.nr_workers; ++i) {
+		struct erofsfsck_worker *w = &fsckcfg.workers[i];
+		unsigned int j;
+
+		erofs_mutex_destroy(&w->lock);
+		erofs_cond_destroy(&w->batch_done);
+		erofs_mutex_destroy(&w->batch_lock);
+		free(w->tasks);
+		free(w->extents);
+		free(w->window);
+		free(w->out);
+		if (!w->batches)
+			continue;
+		for (j = 0; j < w->nr_batches; ++j)
+			free(w->batches[j].buffer);
+		free(w->batches);
+	}
+	erofs_cond_destroy(&fsckcfg.idle_cond);
+	erofs_mutex_destroy(&fsckcfg.idle_lock);
+	erofsfsck_pcluster_exit();
+	free(fsckcfg.workers);
+	free(fsckcfg.scan);
+	free(fsckcfg.windows);
+}
+
 int main(int argc, char **argv)
 {
 	int err;
@@ -897,6 +2157,7 @@ int main(int argc, char **argv)
 	fsckcfg.overwrite = false;
 	fsckcfg.preserve_owner = fsckcfg.superuser;
 	fsckcfg.preserve_perms = fsckcfg.superuser;
+	fsckcfg.physical_order = false;
 
 	err = erofsfsck_parse_options_cfg(argc, argv);
 	if (err) {
@@ -905,36 +2166,39 @@ int main(int argc, char **argv)
 		goto exit;
 	}
 
-	err = dev_open_ro(cfg.c_img_path);
+	err = dev_open_ro(&sbi, cfg.c_img_path);
 	if (err) {
 		erofs_err("failed to open image file");
 		goto exit;
 	}
 
-	err = erofs_read_superblock();
+	err = erofs_read_superblock(&sbi);
 	if (err) {
 		erofs_err("failed to read superblock");
 		goto exit_dev_close;
 	}
 
-	if (erofs_sb_has_sb_chksum() && erofs_check_sb_chksum()) {
+	if (erofs_sb_has_sb_chksum(&sbi) && erofs_check_sb_chksum()) {
 		erofs_err("failed to verify superblock checksum");
 		goto exit_put_super;
 	}
 
-	err = erofs_workqueue_create(&fsckcfg.wq,
-			erofs_get_available_processors(), erofs_get_available_processors() << 2);
-	fsckcfg.multithreading = !err;
+	err = erofsfsck_init_workers();
+	if (err)
+		goto exit_exit_workers;
 
-	if (erofs_sb_has_fragments()) {
-		err = erofsfsck_check_inode(sbi.packed_nid, sbi.packed_nid);
+	if (erofs_sb_has_fragments(&sbi)) {
+		err = erofsfsck_check_tree(sbi.packed_nid, NULL, 0);
 		if (err) {
 			erofs_err("failed to verify packed file");
-			goto exit_destroy_wq;
+			goto exit_exit_workers;
 		}
 	}
 
-	err = erofsfsck_check_inode(sbi.root_nid, sbi.root_nid);
+	err = erofsfsck_check_tree(sbi.root_nid, fsckcfg.extract_path,
+				   fsckcfg.extract_pos);
+	if (!err && !fsckcfg.corrupted && fsckcfg.physical_order)
+		err = erofsfsck_scan();
 	if (fsckcfg.corrupted) {
 		if (!fsckcfg.extract_path)
 			erofs_err("Found some filesystem corruption");
@@ -956,15 +2220,14 @@ int main(int argc, char **argv)
 		}
 	}
 
-exit_destroy_wq:
-	erofs_workqueue_terminate(&fsckcfg.wq);
-	erofs_workqueue_destroy(&fsckcfg.wq);
+exit_exit_workers:
+	erofsfsck_exit_workers();
 exit_put_super:
-	erofs_put_super();
+	erofs_put_super(&sbi);
 exit_dev_close:
-	dev_close();
+	dev_close(&sbi);
 exit:
-	blob_closeall();
+	blob_closeall(&sbi);
 	erofs_exit_configure();
 	return err ? 1 : 0;
 }
@@ -6,200 +6,923 @@
 #include <string.h>
 #include <signal.h>
 #include <libgen.h>
-#include <fuse.h>
+#include <float.h>
+#include <fuse_lowlevel.h>
 #include <fuse_opt.h>
 #include "macosx.h"
+#include "trace.h"
+#include "prefetch.h"
 #include "erofs/config.h"
 #include "erofs/print.h"
 #include "erofs/io.h"
 #include "erofs/dir.h"
 #include "erofs/inode.h"
+#include "erofs/xattr.h"
+#include "erofs/stats.h"
+#include "erofs/lock.h"
+#ifdef EROFS_MT_ENABLED
+#include <pthread.h>
+#include <semaphore.h>
+#endif
 
-struct erofsfuse_dir_context {
-	struct erofs_dir_context ctx;
-	fuse_fill_dir_t filler;
-	struct fuse_file_info *fi;
-	void *buf;
+static struct options {
+	const char *disk;
+	const char *mountpoint;
+	u64 offset;
+	unsigned int debug_lvl;
+	unsigned int decompress_workers;
+	unsigned int threads;
+	/* the image never changes, so let the kernel cache everything */
+	double entry_timeout, negative_timeout, attr_timeout;
+	int keep_cache;
+	/* extra devices, opened after all options are parsed */
+	const char *devices[EROFS_MAX_BLOBS];
+	unsigned int nr_devices;
+	const char *blob_cachedir;
+	const char *trace;
+	const char *prefetch;
+	unsigned int prefetch_rate;
+	/* a list of images to be served under the mountpoint, see usage() */
+	const char *images;
+	unsigned int cache_size;
+	bool show_help;
+	bool odebug;
+} fusecfg;
+
+struct erofsfuse_image {
+	/* the name of its directory under the mountpoint with --images */
+	const char *name;
+	const char *disk;
+	const char **devices;
+	unsigned int nr_devices;
+	struct erofs_sb_info *sbi;
 };
 
-static int erofsfuse_fill_dentries(struct erofs_dir_context *ctx)
+static struct erofsfuse_image *images;
+static unsigned int nr_images;
+/* whether the root directory lists all images rather than being one */
+static bool erofsfuse_multi;
+static time_t erofsfuse_mount_time;
+
+/*
+ * FUSE reserves inode 0 and uses FUSE_ROOT_ID for the root directory, and
+ * the next one is the stats file, so the other nids are shifted past them
+ * to keep the mapping one-to-one.  The image is encoded in the upper bits,
+ * which leaves 2^48 nids (i.e. 8 PiB of metadata) to each image.  Inode
+ * numbers are computed in 64 bits since fuse_ino_t is unsigned long with
+ * libfuse 2, and --images is refused where it's too narrow for the split.
+ */
+#define EROFSFUSE_STATS_INO	(FUSE_ROOT_ID + 1)
+#define EROFSFUSE_INO_SHIFT	(FUSE_ROOT_ID + 2)
+#define EROFSFUSE_IMAGE_SHIFT	48
+#define EROFSFUSE_MAX_IMAGES	(1U << (64 - EROFSFUSE_IMAGE_SHIFT))
+
+/* the root directory listing all images */
+static inline bool erofsfuse_is_top(fuse_ino_t ino)
 {
-	struct erofsfuse_dir_context *fusectx = (void *)ctx;
-	struct stat st = {0};
-	char dname[EROFS_NAME_LEN + 1];
+	return erofsfuse_multi && ino == FUSE_ROOT_ID;
+}
 
-	strncpy(dname, ctx->dname, ctx->de_namelen);
-	dname[ctx->de_namelen] = '\0';
-	st.st_mode = erofs_ftype_to_dtype(ctx->de_ftype) << 12;
-	fusectx->filler(fusectx->buf, dname, &st, 0);
+static inline struct erofsfuse_image *erofsfuse_to_image(fuse_ino_t ino)
+{
+	if (ino == FUSE_ROOT_ID)
+		return images;
+	return images + ((u64)ino >> EROFSFUSE_IMAGE_SHIFT);
+}
+
+static inline erofs_nid_t erofsfuse_to_nid(fuse_ino_t ino)
+{
+	if (ino == FUSE_ROOT_ID)
+		return images->sbi->root_nid;
+	return ((u64)ino & ((1ULL << EROFSFUSE_IMAGE_SHIFT) - 1)) -
+		EROFSFUSE_INO_SHIFT;
+}
+
+static inline fuse_ino_t erofsfuse_to_ino(struct erofsfuse_image *img,
+					  erofs_nid_t nid)
+{
+	if (!erofsfuse_multi && nid == img->sbi->root_nid)
+		return FUSE_ROOT_ID;
+	return ((u64)(img - images) << EROFSFUSE_IMAGE_SHIFT) +
+		nid + EROFSFUSE_INO_SHIFT;
+}
+
+/*
+ * A hidden file in the root directory, which isn't listed but can be read
+ * to get the counters of this process, e.g. `cat /mnt/.erofs-stats'.
+ * Files of the same name in the image take precedence.
+ */
+#define EROFSFUSE_STATS_NAME	".erofs-stats"
+
+enum {
+	EROFSFUSE_OP_LOOKUP,
+	EROFSFUSE_OP_FORGET,
+	EROFSFUSE_OP_GETATTR,
+	EROFSFUSE_OP_READLINK,
+	EROFSFUSE_OP_OPEN,
+	EROFSFUSE_OP_READ,
+	EROFSFUSE_OP_RELEASE,
+	EROFSFUSE_OP_OPENDIR,
+	EROFSFUSE_OP_READDIR,
+	EROFSFUSE_OP_RELEASEDIR,
+	EROFSFUSE_OP_GETXATTR,
+	EROFSFUSE_OP_LISTXATTR,
+	EROFSFUSE_NR_OPS,
+	/* not an operation, but bytes replied to reads */
+	EROFSFUSE_STAT_READ_BYTES = EROFSFUSE_NR_OPS,
+};
+
+static const char *erofsfuse_opname[EROFSFUSE_NR_OPS] = {
+	[EROFSFUSE_OP_LOOKUP] = "lookup",
+	[EROFSFUSE_OP_FORGET] = "forget",
+	[EROFSFUSE_OP_GETATTR] = "getattr",
+	[EROFSFUSE_OP_READLINK] = "readlink",
+	[EROFSFUSE_OP_OPEN] = "open",
+	[EROFSFUSE_OP_READ] = "read",
+	[EROFSFUSE_OP_RELEASE] = "release",
+	[EROFSFUSE_OP_OPENDIR] = "opendir",
+	[EROFSFUSE_OP_READDIR] = "readdir",
+	[EROFSFUSE_OP_RELEASEDIR] = "releasedir",
+	[EROFSFUSE_OP_GETXATTR] = "getxattr",
+	[EROFSFUSE_OP_LISTXATTR] = "listxattr",
+};
+
+static inline void erofsfuse_count(unsigned int op)
+{
+	erofs_stats_add_op(op, 1);
+}
+
+/* per-open state kept in fi->fh */
+struct erofsfuse_file {
+	struct erofs_inode *vi;
+	/* reads of the same open file can be served by several threads */
+	erofs_mutex_t ra_lock;
+	struct erofs_readahead ra;
+	/* contents of the stats file taken at open time, if vi is NULL */
+	char *buf;
+	size_t size;
+};
+
+static void erofsfuse_fill_stat(struct erofsfuse_image *img,
+				struct erofs_inode *vi, struct stat *stbuf)
+{
+	stbuf->st_ino = erofsfuse_to_ino(img, vi->nid);
+	stbuf->st_mode  = vi->i_mode;
+	stbuf->st_nlink = vi->i_nlink;
+	stbuf->st_size  = vi->i_size;
+	stbuf->st_blocks = roundup(vi->i_size, EROFS_BLKSIZ) >> 9;
+	stbuf->st_uid = vi->i_uid;
+	stbuf->st_gid = vi->i_gid;
+	if (S_ISBLK(vi->i_mode) || S_ISCHR(vi->i_mode))
+		stbuf->st_rdev = vi->u.i_rdev;
+	stbuf->st_ctime = vi->i_mtime;
+	stbuf->st_mtime = stbuf->st_ctime;
+	stbuf->st_atime = stbuf->st_ctime;
+}
+
+/* the root directory with --images, which isn't in any image */
+static void erofsfuse_fill_top_stat(struct stat *stbuf)
+{
+	stbuf->st_ino = FUSE_ROOT_ID;
+	stbuf->st_mode = S_IFDIR | 0555;
+	stbuf->st_nlink = 2 + nr_images;
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	stbuf->st_ctime = erofsfuse_mount_time;
+	stbuf->st_mtime = stbuf->st_ctime;
+	stbuf->st_atime = stbuf->st_ctime;
+}
+
+/* the size is unknown until it's opened, so it's read with direct I/O */
+static void erofsfuse_fill_stats_stat(struct stat *stbuf)
+{
+	erofsfuse_fill_top_stat(stbuf);
+	stbuf->st_ino = EROFSFUSE_STATS_INO;
+	stbuf->st_mode = S_IFREG | 0444;
+	stbuf->st_nlink = 1;
+}
+
+/* inodes which don't belong to any image */
+static inline bool erofsfuse_is_virtual(fuse_ino_t ino)
+{
+	return erofsfuse_is_top(ino) || ino == EROFSFUSE_STATS_INO;
+}
+
+static int erofsfuse_show_stats(struct erofsfuse_file *f)
+{
+	struct erofs_stats st;
+	unsigned int i;
+	FILE *fp;
+
+	fp = open_memstream(&f->buf, &f->size);
+	if (!fp)
+		return -errno;
+	erofs_stats_snapshot(&st);
+	fprintf(fp, "uptime_s %llu\nimages %u\n",
+		(unsigned long long)(time(NULL) - erofsfuse_mount_time),
+		nr_images);
+	for (i = 0; i < EROFSFUSE_NR_OPS; ++i)
+		fprintf(fp, "fuse_%s %llu\n", erofsfuse_opname[i],
+			st.ops[i] | 0ULL);
+	fprintf(fp, "fuse_read_bytes %llu\n",
+		st.ops[EROFSFUSE_STAT_READ_BYTES] | 0ULL);
+	erofs_stats_show(fp, &st);
+	if (fclose(fp))
+		return -errno;
 	return 0;
 }
 
-int erofsfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-		      off_t offset, struct fuse_file_info *fi)
+static struct erofs_inode *erofsfuse_iget(fuse_req_t req, fuse_ino_t ino)
+{
+	struct erofs_inode *vi = erofs_icache_get(erofsfuse_to_image(ino)->sbi,
+						  erofsfuse_to_nid(ino));
+
+	if (IS_ERR(vi)) {
+		fuse_reply_err(req, -PTR_ERR(vi));
+		return NULL;
+	}
+	return vi;
+}
+
+static void erofsfuse_init(void *userdata, struct fuse_conn_info *conn)
 {
 	int ret;
-	struct erofs_inode dir;
-	struct erofsfuse_dir_context ctx = {
-		.ctx.dir = &dir,
-		.ctx.cb = erofsfuse_fill_dentries,
-		.filler = filler,
-		.fi = fi,
-		.buf = buf,
+
+	erofs_info("Using FUSE protocol %d.%d", conn->proto_major, conn->proto_minor);
+
+	/*
+	 * Let libfuse splice large replies into the device instead of
+	 * copying them.  max_readahead is left as offered by the kernel,
+	 * which is already the most it accepts; `-o max_readahead=' can
+	 * still lower it.
+	 */
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE |
+				       FUSE_CAP_SPLICE_MOVE);
+
+	/* threads have to be created after the daemon forks */
+	if (fusecfg.decompress_workers) {
+		ret = z_erofs_read_workers_init(fusecfg.decompress_workers);
+		if (ret)
+			erofs_warn("failed to start decompression workers: %s",
+				   erofs_strerror(ret));
+	}
+}
+
+static void erofsfuse_destroy(void *userdata)
+{
+	z_erofs_read_workers_exit();
+}
+
+static int erofsfuse_image_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct erofsfuse_image *)a)->name,
+		      ((const struct erofsfuse_image *)b)->name);
+}
+
+static void erofsfuse_lookup(fuse_req_t req, fuse_ino_t parent,
+			     const char *name)
+{
+	struct erofsfuse_image *img = erofsfuse_to_image(parent);
+	struct nameidata nd = { .sbi = img->sbi,
+				.nid = erofsfuse_to_nid(parent) };
+	struct fuse_entry_param e = {
+		.attr_timeout = fusecfg.attr_timeout,
+		.entry_timeout = fusecfg.entry_timeout,
 	};
-	erofs_dbg("readdir:%s offset=%llu", path, (long long)offset);
+	struct erofs_inode *vi;
+	int ret;
 
-	ret = erofs_ilookup(path, &dir);
-	if (ret)
-		return ret;
+	erofsfuse_count(EROFSFUSE_OP_LOOKUP);
+	if (erofsfuse_is_top(parent)) {
+		struct erofsfuse_image key = { .name = name };
 
-	erofs_dbg("path=%s nid = %llu", path, dir.nid | 0ULL);
-	if (!S_ISDIR(dir.i_mode))
-		return -ENOTDIR;
+		erofs_dbg("lookup(%s) in the image list", name);
+		/* images are sorted by name once they are all opened */
+		img = bsearch(&key, images, nr_images, sizeof(*images),
+			      erofsfuse_image_cmp);
+		if (img) {
+			nd.sbi = img->sbi;
+			nd.nid = img->sbi->root_nid;
+			ret = 0;
+		} else {
+			ret = -ENOENT;
+		}
+	} else {
+		erofs_dbg("lookup(%s) in nid %llu", name, nd.nid | 0ULL);
+		ret = erofs_namei(&nd, name, strlen(name));
+	}
 
-	if (!dir.i_size)
-		return 0;
-#ifdef NDEBUG
-	return erofs_iterate_dir(&ctx.ctx, false);
-#else
-	return erofs_iterate_dir(&ctx.ctx, true);
-#endif
+	if (ret == -ENOENT && parent == FUSE_ROOT_ID &&
+	    !strcmp(name, EROFSFUSE_STATS_NAME)) {
+		erofsfuse_fill_stats_stat(&e.attr);
+		e.ino = e.attr.st_ino;
+		fuse_reply_entry(req, &e);
+		return;
+	}
+	if (ret == -ENOENT && fusecfg.negative_timeout) {
+		/* a zero inode number asks the kernel to cache the miss */
+		e.entry_timeout = fusecfg.negative_timeout;
+		fuse_reply_entry(req, &e);
+		return;
+	}
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	vi = erofsfuse_iget(req, erofsfuse_to_ino(img, nd.nid));
+	if (!vi)
+		return;
+	erofsfuse_fill_stat(img, vi, &e.attr);
+	e.ino = e.attr.st_ino;
+	erofs_icache_put(vi);
+	fuse_reply_entry(req, &e);
 }
 
-static void *erofsfuse_init(struct fuse_conn_info *info)
+/*
+ * Inode numbers are derived from nids, so any inode can be found again
+ * from its number alone and lookups don't pin anything to be dropped here.
+ */
+static void erofsfuse_forget(fuse_req_t req, fuse_ino_t ino,
+			     unsigned long nlookup)
 {
-	erofs_info("Using FUSE protocol %d.%d", info->proto_major, info->proto_minor);
-	return NULL;
+	erofsfuse_count(EROFSFUSE_OP_FORGET);
+	fuse_reply_none(req);
 }
 
-static int erofsfuse_open(const char *path, struct fuse_file_info *fi)
+static void erofsfuse_getattr(fuse_req_t req, fuse_ino_t ino,
+			      struct fuse_file_info *fi)
 {
-	erofs_dbg("open path=%s", path);
+	struct stat stbuf = {0};
+	struct erofs_inode *vi;
 
-	if ((fi->flags & O_ACCMODE) != O_RDONLY)
-		return -EACCES;
+	erofsfuse_count(EROFSFUSE_OP_GETATTR);
+	if (erofsfuse_is_virtual(ino)) {
+		if (ino == EROFSFUSE_STATS_INO)
+			erofsfuse_fill_stats_stat(&stbuf);
+		else
+			erofsfuse_fill_top_stat(&stbuf);
+		fuse_reply_attr(req, &stbuf, fusecfg.attr_timeout);
+		return;
+	}
 
-	return 0;
+	erofs_dbg("getattr(%llu)", erofsfuse_to_nid(ino) | 0ULL);
+
+	vi = erofsfuse_iget(req, ino);
+	if (!vi)
+		return;
+	erofsfuse_fill_stat(erofsfuse_to_image(ino), vi, &stbuf);
+	erofs_icache_put(vi);
+	fuse_reply_attr(req, &stbuf, fusecfg.attr_timeout);
 }
 
-static int erofsfuse_getattr(const char *path, struct stat *stbuf)
+static void erofsfuse_open(fuse_req_t req, fuse_ino_t ino,
+			   struct fuse_file_info *fi)
 {
-	struct erofs_inode vi = {};
+	struct erofsfuse_file *f;
 	int ret;
 
-	erofs_dbg("getattr(%s)", path);
-	ret = erofs_ilookup(path, &vi);
-	if (ret)
-		return -ENOENT;
-
-	stbuf->st_mode  = vi.i_mode;
-	stbuf->st_nlink = vi.i_nlink;
-	stbuf->st_size  = vi.i_size;
-	stbuf->st_blocks = roundup(vi.i_size, EROFS_BLKSIZ) >> 9;
-	stbuf->st_uid = vi.i_uid;
-	stbuf->st_gid = vi.i_gid;
-	if (S_ISBLK(vi.i_mode) || S_ISCHR(vi.i_mode))
-		stbuf->st_rdev = vi.u.i_rdev;
-	stbuf->st_ctime = vi.i_mtime;
-	stbuf->st_mtime = stbuf->st_ctime;
-	stbuf->st_atime = stbuf->st_ctime;
-	return 0;
+	erofsfuse_count(EROFSFUSE_OP_OPEN);
+	erofs_dbg("open(%llu)", erofsfuse_to_nid(ino) | 0ULL);
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+	if (erofsfuse_is_top(ino)) {
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
+
+	f = calloc(1, sizeof(*f));
+	if (!f) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	if (ino == EROFSFUSE_STATS_INO) {
+		ret = erofsfuse_show_stats(f);
+		if (ret) {
+			free(f->buf);
+			free(f);
+			fuse_reply_err(req, -ret);
+			return;
+		}
+		fi->fh = (uintptr_t)f;
+		fi->direct_io = 1;
+		if (fuse_reply_open(req, fi)) {
+			free(f->buf);
+			free(f);
+		}
+		return;
+	}
+
+	f->vi = erofsfuse_iget(req, ino);
+	if (!f->vi) {
+		free(f);
+		return;
+	}
+
+	erofsfuse_prefetch_access(f->vi->nid);
+	erofs_mutex_init(&f->ra_lock);
+	fi->fh = (uintptr_t)f;
+	fi->keep_cache = fusecfg.keep_cache;
+	/* release() won't be called if the open was interrupted */
+	if (fuse_reply_open(req, fi)) {
+		erofs_mutex_destroy(&f->ra_lock);
+		erofs_icache_put(f->vi);
+		free(f);
+	}
 }
 
-static int erofsfuse_read(const char *path, char *buffer,
-			  size_t size, off_t offset,
-			  struct fuse_file_info *fi)
+static void erofsfuse_release(fuse_req_t req, fuse_ino_t ino,
+			      struct fuse_file_info *fi)
 {
+	struct erofsfuse_file *f = (void *)(uintptr_t)fi->fh;
+
+	erofsfuse_count(EROFSFUSE_OP_RELEASE);
+	if (f->vi) {
+		erofs_mutex_destroy(&f->ra_lock);
+		erofs_icache_put(f->vi);
+	}
+	free(f->buf);
+	free(f);
+	fuse_reply_err(req, 0);
+}
+
+#if FUSE_VERSION >= 29
+/*
+ * Reply to reads of uncompressed files with the image ranges themselves
+ * instead of a copy, so that libfuse can splice them into the device.
+ * Holes are replied from a zeroed buffer.
+ */
+static int erofsfuse_reply_data(fuse_req_t req, struct erofs_inode *vi,
+				size_t size, off_t off)
+{
+	struct erofs_map_blocks map = { .index = UINT_MAX };
+	struct fuse_bufvec *bufv;
+	struct fuse_buf *buf = NULL;
+	unsigned int nr = 1;
+	erofs_off_t pos = off, end = off + size;
+	char *zeroes = NULL;
 	int ret;
-	struct erofs_inode vi;
 
-	erofs_dbg("path:%s size=%zd offset=%llu", path, size, (long long)offset);
+	bufv = malloc(sizeof(*bufv));
+	if (!bufv)
+		return -ENOMEM;
+	bufv->count = 0;
 
-	ret = erofs_ilookup(path, &vi);
-	if (ret)
-		return ret;
+	while (pos < end) {
+		struct erofs_map_dev mdev;
+		erofs_off_t len;
+		u64 offset;
+		int fd;
+
+		map.m_la = pos;
+		ret = erofs_map_blocks(vi, &map, 0);
+		if (ret)
+			goto out;
+		if (!map.m_llen || map.m_la + map.m_llen <= pos) {
+			ret = -EFSCORRUPTED;
+			goto out;
+		}
+		len = min(end, map.m_la + map.m_llen) - pos;
+
+		if (!(map.m_flags & EROFS_MAP_MAPPED)) {
+			if (!zeroes) {
+				zeroes = calloc(1, size);
+				if (!zeroes) {
+					ret = -ENOMEM;
+					goto out;
+				}
+			}
+			fd = -1;
+			offset = 0;
+		} else {
+			mdev = (struct erofs_map_dev) {
+				.m_deviceid = map.m_deviceid,
+				.m_pa = map.m_pa,
+			};
+			ret = erofs_map_dev(vi->sbi, &mdev);
+			if (ret)
+				goto out;
+			offset = mdev.m_pa + pos - map.m_la;
+			fd = dev_get_fd(vi->sbi, mdev.m_deviceid, &offset, len);
+			if (fd < 0) {
+				ret = fd;
+				goto out;
+			}
+		}
+		pos += len;
 
-	ret = erofs_pread(&vi, buffer, size, offset);
+		/* merge with the previous range if it's contiguous */
+		if (buf && fd >= 0 && buf->fd == fd &&
+		    buf->pos + buf->size == offset) {
+			buf->size += len;
+			continue;
+		}
+
+		if (bufv->count >= nr) {
+			struct fuse_bufvec *n;
+
+			nr <<= 1;
+			n = realloc(bufv, sizeof(*bufv) +
+				    (nr - 1) * sizeof(bufv->buf[0]));
+			if (!n) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			bufv = n;
+		}
+		buf = &bufv->buf[bufv->count++];
+		if (fd < 0)
+			*buf = (struct fuse_buf) {
+				.size = len,
+				.mem = zeroes,
+				.fd = -1,
+			};
+		else
+			*buf = (struct fuse_buf) {
+				.size = len,
+				.flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK,
+				.fd = fd,
+				.pos = offset,
+			};
+	}
+	bufv->idx = 0;
+	bufv->off = 0;
+	/* errors are replied by fuse_reply_data() itself */
+	fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+	ret = 0;
+out:
+	free(zeroes);
+	free(bufv);
+	return ret;
+}
+#endif
+
+static void erofsfuse_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+			   off_t off, struct fuse_file_info *fi)
+{
+	struct erofsfuse_file *f = (void *)(uintptr_t)fi->fh;
+	struct erofs_inode *vi = f->vi;
+	char *buf;
+	int ret;
+
+	erofsfuse_count(EROFSFUSE_OP_READ);
+	if (!vi) {
+		if (off >= f->size)
+			size = 0;
+		else if (size > f->size - off)
+			size = f->size - off;
+		fuse_reply_buf(req, f->buf + off, size);
+		return;
+	}
+
+	erofs_dbg("read(%llu): size=%zd offset=%llu", vi->nid | 0ULL,
+		  size, (long long)off);
+
+	if (off >= vi->i_size) {
+		fuse_reply_buf(req, NULL, 0);
+		return;
+	}
+	if (size > vi->i_size - off)
+		size = vi->i_size - off;
+
+	erofs_stats_add_op(EROFSFUSE_STAT_READ_BYTES, size);
+	erofsfuse_trace(vi, off, size);
+	erofs_mutex_lock(&f->ra_lock);
+	erofs_readahead(vi, &f->ra, off, size);
+	erofs_mutex_unlock(&f->ra_lock);
+#if FUSE_VERSION >= 29
+	if (!erofs_inode_is_data_compressed(vi->datalayout)) {
+		ret = erofsfuse_reply_data(req, vi, size, off);
+		if (ret)
+			fuse_reply_err(req, -ret);
+		return;
+	}
+#endif
+
+	buf = malloc(size);
+	if (!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	ret = erofs_pread(vi, buf, size, off);
 	if (ret)
-		return ret;
-	if (offset >= vi.i_size)
-		return 0;
-	if (offset + size > vi.i_size)
-		return vi.i_size - offset;
-	return size;
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_buf(req, buf, size);
+	free(buf);
 }
 
-static int erofsfuse_readlink(const char *path, char *buffer, size_t size)
+static void erofsfuse_readlink(fuse_req_t req, fuse_ino_t ino)
 {
-	int ret = erofsfuse_read(path, buffer, size, 0, NULL);
+	char buf[PATH_MAX];
+	struct erofs_inode *vi;
+	int ret;
 
-	if (ret < 0)
-		return ret;
-	DBG_BUGON(ret > size);
-	if (ret == size)
-		buffer[size - 1] = '\0';
-	erofs_dbg("readlink(%s): %s", path, buffer);
+	erofsfuse_count(EROFSFUSE_OP_READLINK);
+	if (erofsfuse_is_virtual(ino)) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+
+	vi = erofsfuse_iget(req, ino);
+	if (!vi)
+		return;
+
+	if (!S_ISLNK(vi->i_mode))
+		ret = -EINVAL;
+	else if (vi->i_size >= sizeof(buf))
+		ret = -ENAMETOOLONG;
+	else {
+		erofsfuse_prefetch_access(vi->nid);
+		erofsfuse_trace(vi, 0, vi->i_size);
+		ret = erofs_pread(vi, buf, vi->i_size, 0);
+	}
+
+	if (ret) {
+		fuse_reply_err(req, -ret);
+	} else {
+		buf[vi->i_size] = '\0';
+		erofs_dbg("readlink(%llu): %s", vi->nid | 0ULL, buf);
+		fuse_reply_readlink(req, buf);
+	}
+	erofs_icache_put(vi);
+}
+
+static void erofsfuse_opendir(fuse_req_t req, fuse_ino_t ino,
+			      struct fuse_file_info *fi)
+{
+	struct erofs_inode *vi;
+
+	erofsfuse_count(EROFSFUSE_OP_OPENDIR);
+	/* no inode is kept open for the image list */
+	if (erofsfuse_is_top(ino)) {
+		fi->fh = 0;
+		fuse_reply_open(req, fi);
+		return;
+	}
+	if (ino == EROFSFUSE_STATS_INO) {
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+
+	vi = erofsfuse_iget(req, ino);
+	if (!vi)
+		return;
+
+	if (!S_ISDIR(vi->i_mode)) {
+		erofs_icache_put(vi);
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+
+	fi->fh = (uintptr_t)vi;
+	if (fuse_reply_open(req, fi))
+		erofs_icache_put(vi);
+}
+
+static void erofsfuse_releasedir(fuse_req_t req, fuse_ino_t ino,
+				 struct fuse_file_info *fi)
+{
+	erofsfuse_count(EROFSFUSE_OP_RELEASEDIR);
+	if (fi->fh)
+		erofs_icache_put((void *)(uintptr_t)fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+struct erofsfuse_dir_context {
+	struct erofs_dir_context ctx;
+	struct erofsfuse_image *img;
+	fuse_req_t req;
+	char *buf;
+	size_t size, pos;
+};
+
+static int erofsfuse_fill_dentries(struct erofs_dir_context *ctx)
+{
+	struct erofsfuse_dir_context *fusectx = (void *)ctx;
+	struct stat st = {0};
+	char dname[EROFS_NAME_LEN + 1];
+	size_t entsize;
+
+	memcpy(dname, ctx->dname, ctx->de_namelen);
+	dname[ctx->de_namelen] = '\0';
+	st.st_ino = erofsfuse_to_ino(fusectx->img, ctx->de_nid);
+	st.st_mode = erofs_ftype_to_dtype(ctx->de_ftype) << 12;
+	/*
+	 * The offset of an entry is where the next readdir call resumes,
+	 * so that it starts right at the block of the following dirent.
+	 */
+	entsize = fuse_add_direntry(fusectx->req, fusectx->buf + fusectx->pos,
+				    fusectx->size - fusectx->pos, dname, &st,
+				    ctx->de_pos + 1);
+	if (entsize > fusectx->size - fusectx->pos)
+		return 1;
+	fusectx->pos += entsize;
 	return 0;
 }
 
-static int erofsfuse_getxattr(const char *path, const char *name, char *value,
-			size_t size
+/* list ".", ".." and then all images, the offset is the entry index */
+static void erofsfuse_readdir_top(fuse_req_t req, size_t size, off_t off)
+{
+	size_t pos = 0, entsize;
+	char *buf;
+
+	buf = malloc(size);
+	if (!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	for (; off < 2 + nr_images; ++off) {
+		struct stat st = { .st_mode = S_IFDIR };
+		const char *name;
+
+		if (off < 2) {
+			st.st_ino = FUSE_ROOT_ID;
+			name = off ? ".." : ".";
+		} else {
+			struct erofsfuse_image *img = &images[off - 2];
+
+			st.st_ino = erofsfuse_to_ino(img, img->sbi->root_nid);
+			name = img->name;
+		}
+		entsize = fuse_add_direntry(req, buf + pos, size - pos, name,
+					    &st, off + 1);
+		if (entsize > size - pos)
+			break;
+		pos += entsize;
+	}
+	fuse_reply_buf(req, buf, pos);
+	free(buf);
+}
+
+static void erofsfuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			      off_t off, struct fuse_file_info *fi)
+{
+	struct erofsfuse_dir_context ctx = {
+		.ctx.dir = (void *)(uintptr_t)fi->fh,
+		.ctx.cb = erofsfuse_fill_dentries,
+		.ctx.pos = off,
+		.img = erofsfuse_to_image(ino),
+		.req = req,
+		.size = size,
+	};
+	int ret;
+
+	erofsfuse_count(EROFSFUSE_OP_READDIR);
+	if (!fi->fh) {
+		erofsfuse_readdir_top(req, size, off);
+		return;
+	}
+
+	erofs_dbg("readdir(%llu): size=%zd offset=%llu",
+		  ctx.ctx.dir->nid | 0ULL, size, (long long)off);
+
+	ctx.buf = malloc(size);
+	if (!ctx.buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+#ifdef NDEBUG
+	ret = erofs_iterate_dir(&ctx.ctx, false);
+#else
+	ret = erofs_iterate_dir(&ctx.ctx, true);
+#endif
+	/* a positive return means the reply buffer is full */
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_buf(req, ctx.buf, ctx.pos);
+	free(ctx.buf);
+}
+
+static void erofsfuse_getxattr(fuse_req_t req, fuse_ino_t ino,
+			       const char *name, size_t size
 #ifdef __APPLE__
-			, uint32_t position)
+			       , uint32_t position)
 #else
-			)
+			       )
 #endif
 {
+	struct erofs_inode *vi;
+	char *buf = NULL;
 	int ret;
-	struct erofs_inode vi;
 
-	erofs_dbg("getxattr(%s): name=%s size=%llu", path, name, size);
+	erofsfuse_count(EROFSFUSE_OP_GETXATTR);
+	if (erofsfuse_is_virtual(ino)) {
+		fuse_reply_err(req, ENOATTR);
+		return;
+	}
 
-	ret = erofs_ilookup(path, &vi);
-	if (ret)
-		return ret;
+	erofs_dbg("getxattr(%llu): name=%s size=%llu",
+		  erofsfuse_to_nid(ino) | 0ULL, name, size | 0ULL);
 
-	return erofs_getxattr(&vi, name, value, size);
+	vi = erofsfuse_iget(req, ino);
+	if (!vi)
+		return;
+
+	if (size) {
+		buf = malloc(size);
+		if (!buf) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	ret = erofs_getxattr(vi, name, buf, size);
+out:
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else if (!size)
+		fuse_reply_xattr(req, ret);
+	else
+		fuse_reply_buf(req, buf, ret);
+	free(buf);
+	erofs_icache_put(vi);
 }
 
-static int erofsfuse_listxattr(const char *path, char *list, size_t size)
+static void erofsfuse_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
 {
+	struct erofs_inode *vi;
+	char *buf = NULL;
 	int ret;
-	struct erofs_inode vi;
 
-	erofs_dbg("listxattr(%s): size=%llu", path, size);
+	erofsfuse_count(EROFSFUSE_OP_LISTXATTR);
+	if (erofsfuse_is_virtual(ino)) {
+		if (size)
+			fuse_reply_buf(req, NULL, 0);
+		else
+			fuse_reply_xattr(req, 0);
+		return;
+	}
+
+	erofs_dbg("listxattr(%llu): size=%llu",
+		  erofsfuse_to_nid(ino) | 0ULL, size | 0ULL);
 
-	ret = erofs_ilookup(path, &vi);
-	if (ret)
-		return ret;
+	vi = erofsfuse_iget(req, ino);
+	if (!vi)
+		return;
+
+	if (size) {
+		buf = malloc(size);
+		if (!buf) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
 
-	return erofs_listxattr(&vi, list, size);
+	ret = erofs_listxattr(vi, buf, size);
+out:
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else if (!size)
+		fuse_reply_xattr(req, ret);
+	else
+		fuse_reply_buf(req, buf, ret);
+	free(buf);
+	erofs_icache_put(vi);
 }
 
-static struct fuse_operations erofs_ops = {
-	.getxattr = erofsfuse_getxattr,
-	.listxattr = erofsfuse_listxattr,
-	.readlink = erofsfuse_readlink,
+static struct fuse_lowlevel_ops erofsfuse_lops = {
+	.init = erofsfuse_init,
+	.destroy = erofsfuse_destroy,
+	.lookup = erofsfuse_lookup,
+	.forget = erofsfuse_forget,
 	.getattr = erofsfuse_getattr,
-	.readdir = erofsfuse_readdir,
+	.readlink = erofsfuse_readlink,
 	.open = erofsfuse_open,
 	.read = erofsfuse_read,
-	.init = erofsfuse_init,
+	.release = erofsfuse_release,
+	.opendir = erofsfuse_opendir,
+	.readdir = erofsfuse_readdir,
+	.releasedir = erofsfuse_releasedir,
+	.getxattr = erofsfuse_getxattr,
+	.listxattr = erofsfuse_listxattr,
 };
 
-static struct options {
-	const char *disk;
-	const char *mountpoint;
-	u64 offset;
-	unsigned int debug_lvl;
-	bool show_help;
-	bool odebug;
-} fusecfg;
-
 #define OPTION(t, p) { t, offsetof(struct options, p), 1 }
 static const struct fuse_opt option_spec[] = {
 	OPTION("--offset=%lu", offset),
 	OPTION("--dbglevel=%u", debug_lvl),
+	OPTION("--decompress-workers=%u", decompress_workers),
+	OPTION("--threads=%u", threads),
+	OPTION("--blob-cache=%s", blob_cachedir),
+	OPTION("--trace=%s", trace),
+	OPTION("--prefetch=%s", prefetch),
+	OPTION("--prefetch-rate=%u", prefetch_rate),
+	OPTION("--images=%s", images),
+	OPTION("--cache-size=%u", cache_size),
+	OPTION("entry_timeout=%lf", entry_timeout),
+	OPTION("negative_timeout=%lf", negative_timeout),
+	OPTION("attr_timeout=%lf", attr_timeout),
+	{ "keep_cache", offsetof(struct options, keep_cache), 1 },
+	{ "no_keep_cache", offsetof(struct options, keep_cache), 0 },
 	OPTION("--help", show_help),
 	FUSE_OPT_KEY("--device=", 1),
 	FUSE_OPT_END
@@ -209,11 +932,25 @@ static void usage(void)
 {
 	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
 
-	fputs("usage: [options] IMAGE MOUNTPOINT\n\n"
+	fputs("usage: [options] IMAGE MOUNTPOINT\n"
+	      "       [options] --images=LIST MOUNTPOINT\n\n"
 	      "Options:\n"
 	      "    --offset=#             skip # bytes when reading IMAGE\n"
 	      "    --dbglevel=#           set output message level to # (maximum 9)\n"
 	      "    --device=#             specify an extra device to be used together\n"
+	      "    --blob-cache=DIR       keep remote devices fetched on demand in DIR\n"
+	      "    --decompress-workers=# decompress large reads with # extra threads\n"
+	      "    --threads=#            handle FUSE requests with # threads\n"
+	      "    --trace=FILE           record all reads into FILE as CSV\n"
+	      "    --prefetch=LIST        warm up files in LIST after mounting\n"
+	      "    --prefetch-rate=#      prefetch at most # MiB/s (default: 64, 0: unlimited)\n"
+	      "    --images=LIST          serve each image in LIST as a directory, with\n"
+	      "                           lines of NAME IMAGE [DEVICE...]\n"
+	      "    --cache-size=#         cache at most # MiB of inodes for all images\n"
+	      "    -o entry_timeout=T     cache names for T seconds (default: forever)\n"
+	      "    -o negative_timeout=T  cache missing names for T seconds (default: forever)\n"
+	      "    -o attr_timeout=T      cache attributes for T seconds (default: forever)\n"
+	      "    -o no_keep_cache       drop cached file data when a file is opened\n"
 #if FUSE_MAJOR_VERSION < 3
 	      "    --help                 display this help and exit\n"
 #endif
@@ -231,23 +968,219 @@ static void usage(void)
 
 static void erofsfuse_dumpcfg(void)
 {
-	erofs_dump("disk: %s\n", fusecfg.disk);
+	if (fusecfg.images)
+		erofs_dump("images: %s (%u)\n", fusecfg.images, nr_images);
+	else
+		erofs_dump("disk: %s\n", fusecfg.disk);
 	erofs_dump("offset: %llu\n", fusecfg.offset | 0ULL);
 	erofs_dump("mountpoint: %s\n", fusecfg.mountpoint);
 	erofs_dump("dbglevel: %u\n", cfg.c_dbg_lvl);
+	erofs_dump("decompress workers: %u\n", fusecfg.decompress_workers);
+	erofs_dump("threads: %u\n", fusecfg.threads);
+	erofs_dump("entry/negative/attr timeout: %g/%g/%g\n",
+		   fusecfg.entry_timeout, fusecfg.negative_timeout,
+		   fusecfg.attr_timeout);
+	erofs_dump("keep_cache: %d\n", fusecfg.keep_cache);
+	if (fusecfg.blob_cachedir)
+		erofs_dump("blob cache: %s\n", fusecfg.blob_cachedir);
+	if (fusecfg.trace)
+		erofs_dump("trace: %s\n", fusecfg.trace);
+	if (fusecfg.prefetch)
+		erofs_dump("prefetch: %s at %u MiB/s\n", fusecfg.prefetch,
+			   fusecfg.prefetch_rate);
+	if (fusecfg.cache_size)
+		erofs_dump("cache size: %u MiB\n", fusecfg.cache_size);
 }
 
-static int optional_opt_func(void *data, const char *arg, int key,
-			     struct fuse_args *outargs)
+/* add an image from the rest of a line of the list being parsed */
+static int erofsfuse_add_image(const char *name, char **save)
+{
+	struct erofsfuse_image *img, *n;
+	char *tok;
+
+	if (!strcmp(name, ".") || !strcmp(name, "..") || strchr(name, '/')) {
+		erofs_err("invalid image name %s", name);
+		return -EINVAL;
+	}
+	if (nr_images >= EROFSFUSE_MAX_IMAGES) {
+		erofs_err("too many images (%s)", name);
+		return -EINVAL;
+	}
+
+	n = realloc(images, (nr_images + 1) * sizeof(*images));
+	if (!n)
+		return -ENOMEM;
+	images = n;
+	img = &images[nr_images];
+	*img = (struct erofsfuse_image) {
+		.name = strdup(name),
+		.sbi = calloc(1, sizeof(*img->sbi)),
+	};
+	if (!img->name || !img->sbi)
+		goto err_nomem;
+	/* count it at once so that it's freed on errors */
+	++nr_images;
+
+	tok = strtok_r(NULL, " \t\n", save);
+	if (!tok) {
+		erofs_err("no image file given for %s", name);
+		return -EINVAL;
+	}
+	img->disk = strdup(tok);
+	if (!img->disk)
+		goto err_nomem;
+
+	while ((tok = strtok_r(NULL, " \t\n", save))) {
+		const char **devs;
+
+		if (img->nr_devices >= EROFS_MAX_BLOBS) {
+			erofs_err("too many devices for %s (%s)", name, tok);
+			return -EINVAL;
+		}
+		devs = realloc(img->devices,
+			       (img->nr_devices + 1) * sizeof(*devs));
+		if (!devs)
+			goto err_nomem;
+		img->devices = devs;
+		devs[img->nr_devices] = strdup(tok);
+		if (!devs[img->nr_devices])
+			goto err_nomem;
+		++img->nr_devices;
+	}
+	return 0;
+
+err_nomem:
+	/* otherwise it's freed by erofsfuse_free_images() */
+	if (img == &images[nr_images]) {
+		free((char *)img->name);
+		free(img->sbi);
+	}
+	return -ENOMEM;
+}
+
+/* read the list of images given by --images, sorted by their names */
+static int erofsfuse_load_images(const char *path)
+{
+	char *line = NULL, *name, *save;
+	unsigned int i, lineno = 0;
+	size_t n = 0;
+	FILE *fp;
+	int ret = 0;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		erofs_err("failed to open image list %s", path);
+		return -errno;
+	}
+	erofsfuse_multi = true;
+
+	while (getline(&line, &n, fp) >= 0) {
+		++lineno;
+		name = strtok_r(line, " \t\n", &save);
+		if (!name || *name == '#')
+			continue;
+		ret = erofsfuse_add_image(name, &save);
+		if (ret) {
+			erofs_err("bad image list %s at line %u", path, lineno);
+			break;
+		}
+	}
+	free(line);
+	fclose(fp);
+	if (ret)
+		return ret;
+
+	if (!nr_images) {
+		erofs_err("no image in %s", path);
+		return -EINVAL;
+	}
+	qsort(images, nr_images, sizeof(*images), erofsfuse_image_cmp);
+	for (i = 1; i < nr_images; ++i) {
+		if (!strcmp(images[i - 1].name, images[i].name)) {
+			erofs_err("duplicated image name %s", images[i].name);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+static void erofsfuse_free_images(void)
 {
+	unsigned int i, j;
+
+	/* the only image without --images comes from the command line */
+	if (erofsfuse_multi) {
+		for (i = 0; i < nr_images; ++i) {
+			for (j = 0; j < images[i].nr_devices; ++j)
+				free((char *)images[i].devices[j]);
+			free(images[i].devices);
+			free((char *)images[i].disk);
+			free((char *)images[i].name);
+			free(images[i].sbi);
+		}
+	}
+	free(images);
+	images = NULL;
+	nr_images = 0;
+}
+
+static int erofsfuse_open_image(struct erofsfuse_image *img)
+{
+	struct erofs_sb_info *sbi = img->sbi;
+	unsigned int i;
 	int ret;
 
+	/* saves copying metadata, at the cost of SIGBUS on I/O errors */
+	sbi->mmap_devices = true;
+	ret = dev_open_ro(sbi, img->disk);
+	if (ret) {
+		fprintf(stderr, "failed to open: %s\n", img->disk);
+		return ret;
+	}
+
+	/* the same blob device used by several images is only opened once */
+	sbi->blob_cachedir = fusecfg.blob_cachedir;
+	for (i = 0; i < img->nr_devices; ++i) {
+		ret = blob_open_ro(sbi, img->devices[i]);
+		if (ret)
+			goto err_dev_close;
+		++sbi->extra_devices;
+	}
+
+	ret = erofs_read_superblock(sbi);
+	if (ret) {
+		fprintf(stderr, "failed to read erofs super block of %s\n",
+			img->disk);
+		goto err_dev_close;
+	}
+	return 0;
+
+err_dev_close:
+	blob_closeall(sbi);
+	dev_close(sbi);
+	return ret;
+}
+
+static void erofsfuse_close_image(struct erofsfuse_image *img)
+{
+	erofs_put_super(img->sbi);
+	blob_closeall(img->sbi);
+	dev_close(img->sbi);
+}
+
+static int optional_opt_func(void *data, const char *arg, int key,
+			     struct fuse_args *outargs)
+{
 	switch (key) {
 	case 1:
-		ret = blob_open_ro(arg + sizeof("--device=") - 1);
-		if (ret)
+		if (fusecfg.nr_devices >= EROFS_MAX_BLOBS) {
+			erofs_err("too many devices (%s)", arg);
+			return -1;
+		}
+		fusecfg.devices[fusecfg.nr_devices] =
+			strdup(arg + sizeof("--device=") - 1);
+		if (!fusecfg.devices[fusecfg.nr_devices++])
 			return -1;
-		++sbi.extra_devices;
 		return 0;
 	case FUSE_OPT_KEY_NONOPT:
 		if (fusecfg.mountpoint)
@@ -294,10 +1227,121 @@ static void signal_handle_sigsegv(int signal)
 }
 #endif
 
+#ifdef EROFS_MT_ENABLED
+struct erofsfuse_loop {
+	struct fuse_session *se;
+	struct fuse_chan *ch;
+	sem_t finish;
+	int error;
+};
+
+static void *erofsfuse_worker(void *arg)
+{
+	struct erofsfuse_loop *loop = arg;
+	size_t bufsize = fuse_chan_bufsize(loop->ch);
+	char *buf;
+
+	/* only cancel threads while they are waiting for requests */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	buf = malloc(bufsize);
+	if (!buf) {
+		loop->error = -ENOMEM;
+		fuse_session_exit(loop->se);
+		sem_post(&loop->finish);
+		return NULL;
+	}
+
+	pthread_cleanup_push(free, buf);
+	while (!fuse_session_exited(loop->se)) {
+		struct fuse_chan *ch = loop->ch;
+		int res;
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		res = fuse_chan_recv(&ch, buf, bufsize);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (res == -EINTR)
+			continue;
+		if (res <= 0) {
+			/* 0 means the filesystem has been unmounted */
+			if (res < 0)
+				loop->error = res;
+			fuse_session_exit(loop->se);
+			break;
+		}
+		fuse_session_process(loop->se, buf, res, ch);
+	}
+	sem_post(&loop->finish);
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+/*
+ * Serve requests with a fixed number of threads rather than libfuse's
+ * own loop, which doesn't allow the thread count to be configured.
+ * All threads share the inode cache, and decompression scratch buffers
+ * are per-thread in liberofs.
+ */
+static int erofsfuse_loop_mt(struct fuse_session *se, struct fuse_chan *ch)
+{
+	struct erofsfuse_loop loop = { .se = se, .ch = ch };
+	sigset_t set, oldset;
+	pthread_t *threads;
+	unsigned int i, nr;
+	int ret = 0;
+
+	threads = calloc(fusecfg.threads, sizeof(*threads));
+	if (!threads)
+		return -ENOMEM;
+	sem_init(&loop.finish, 0, 0);
+
+	/* leave the signals which end the session to the main thread */
+	sigemptyset(&set);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGQUIT);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
+	for (nr = 0; nr < fusecfg.threads; ++nr) {
+		ret = -pthread_create(&threads[nr], NULL, erofsfuse_worker,
+				      &loop);
+		if (ret)
+			break;
+	}
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	if (ret) {
+		erofs_err("failed to create FUSE worker %u: %s", nr,
+			  erofs_strerror(ret));
+		fuse_session_exit(se);
+	}
+
+	while (!fuse_session_exited(se))
+		sem_wait(&loop.finish);
+
+	for (i = 0; i < nr; ++i)
+		pthread_cancel(threads[i]);
+	for (i = 0; i < nr; ++i)
+		pthread_join(threads[i], NULL);
+	sem_destroy(&loop.finish);
+	free(threads);
+	return ret ? ret : loop.error;
+}
+#else
+/* liberofs doesn't lock anything without multi-threading support */
+static int erofsfuse_loop_mt(struct fuse_session *se, struct fuse_chan *ch)
+{
+	return fuse_session_loop(se);
+}
+#endif
+
 int main(int argc, char *argv[])
 {
-	int ret;
+	int ret, multithreaded, foreground;
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_session *se;
+	struct fuse_chan *ch;
+	char *mountpoint;
+	unsigned int i;
 
 	erofs_init_configure();
 	printf("%s %s\n", basename(argv[0]), cfg.c_version);
@@ -310,11 +1354,29 @@ int main(int argc, char *argv[])
 	}
 #endif
 
+	fusecfg.entry_timeout = DBL_MAX;
+	fusecfg.negative_timeout = DBL_MAX;
+	fusecfg.attr_timeout = DBL_MAX;
+	fusecfg.keep_cache = 1;
+	fusecfg.prefetch_rate = 64;
+	erofs_stats_enabled = true;
+
 	/* parse options */
 	ret = fuse_opt_parse(&args, &fusecfg, option_spec, optional_opt_func);
 	if (ret)
 		goto err;
 
+	/* the only non-option argument is the mountpoint with --images */
+	if (fusecfg.images && fusecfg.disk && !fusecfg.mountpoint) {
+		fusecfg.mountpoint = fusecfg.disk;
+		fusecfg.disk = NULL;
+		ret = fuse_opt_add_arg(&args, fusecfg.mountpoint);
+		if (ret)
+			goto err_fuse_free_args;
+	} else if (fusecfg.images) {
+		usage();
+	}
+
 	if (fusecfg.show_help || !fusecfg.mountpoint)
 		usage();
 	cfg.c_dbg_lvl = fusecfg.debug_lvl;
@@ -322,27 +1384,128 @@ int main(int argc, char *argv[])
 	if (fusecfg.odebug && cfg.c_dbg_lvl < EROFS_DBG)
 		cfg.c_dbg_lvl = EROFS_DBG;
 
-	cfg.c_offset = fusecfg.offset;
+#ifdef EROFS_MT_ENABLED
+	if (!fusecfg.threads)
+		fusecfg.threads = max(2U, erofs_get_available_processors());
+#else
+	if (fusecfg.threads > 1)
+		erofs_warn("multi-threading support isn't enabled, ignoring --threads");
+	fusecfg.threads = 1;
 
-	erofsfuse_dumpcfg();
-	ret = dev_open_ro(fusecfg.disk);
-	if (ret) {
-		fprintf(stderr, "failed to open: %s\n", fusecfg.disk);
+	/* warming inline would hold up the mount for the whole list */
+	if (fusecfg.prefetch) {
+		erofs_err("multi-threading support isn't enabled, --prefetch can't be used");
+		ret = -EOPNOTSUPP;
 		goto err_fuse_free_args;
 	}
+#endif
 
-	ret = erofs_read_superblock();
-	if (ret) {
-		fprintf(stderr, "failed to read erofs super block\n");
-		goto err_dev_close;
+	if (fusecfg.images) {
+		/* these only make sense for a single image */
+		if (fusecfg.offset || fusecfg.nr_devices ||
+		    fusecfg.trace || fusecfg.prefetch) {
+			erofs_err("--offset, --device, --trace and --prefetch can't be used with --images");
+			ret = -EINVAL;
+			goto err_fuse_free_args;
+		}
+		if (sizeof(fuse_ino_t) < sizeof(u64)) {
+			erofs_err("--images isn't supported with %u-bit inode numbers",
+				  (unsigned int)sizeof(fuse_ino_t) * 8);
+			ret = -EOPNOTSUPP;
+			goto err_fuse_free_args;
+		}
+		ret = erofsfuse_load_images(fusecfg.images);
+		if (ret)
+			goto err_free_images;
+	} else {
+		images = calloc(1, sizeof(*images));
+		if (!images) {
+			ret = -ENOMEM;
+			goto err_fuse_free_args;
+		}
+		images->disk = fusecfg.disk;
+		images->devices = fusecfg.devices;
+		images->nr_devices = fusecfg.nr_devices;
+		images->sbi = &sbi;
+		nr_images = 1;
+		sbi.diskoffset = fusecfg.offset;
 	}
 
-	ret = fuse_main(args.argc, args.argv, &erofs_ops, NULL);
+	erofsfuse_dumpcfg();
+	if (fusecfg.cache_size)
+		erofs_icache_set_limit((size_t)fusecfg.cache_size << 20);
+	erofsfuse_mount_time = time(NULL);
 
-	erofs_put_super();
-err_dev_close:
-	blob_closeall();
-	dev_close();
+	for (i = 0; i < nr_images; ++i) {
+		ret = erofsfuse_open_image(&images[i]);
+		if (ret)
+			goto err_close_images;
+	}
+
+	if (fusecfg.trace) {
+		ret = erofsfuse_trace_init(&sbi, fusecfg.trace);
+		if (ret)
+			goto err_super_put;
+	}
+
+	if (fusecfg.prefetch) {
+		ret = erofsfuse_prefetch_init(&sbi, fusecfg.prefetch,
+					      fusecfg.prefetch_rate);
+		if (ret)
+			goto err_super_put;
+	}
+
+	ret = fuse_parse_cmdline(&args, &mountpoint, &multithreaded,
+				 &foreground);
+	if (ret)
+		goto err_super_put;
+
+	ch = fuse_mount(mountpoint, &args);
+	if (!ch) {
+		ret = -EIO;
+		goto err_free_mountpoint;
+	}
+
+	se = fuse_lowlevel_new(&args, &erofsfuse_lops, sizeof(erofsfuse_lops),
+			       NULL);
+	if (!se) {
+		ret = -ENOMEM;
+		goto err_unmount;
+	}
+
+	ret = fuse_set_signal_handlers(se);
+	if (ret)
+		goto err_session_destroy;
+	fuse_session_add_chan(se, ch);
+
+	ret = fuse_daemonize(foreground);
+	if (!ret && fusecfg.trace)
+		ret = erofsfuse_trace_start();
+	if (!ret && fusecfg.prefetch)
+		ret = erofsfuse_prefetch_start();
+	if (!ret) {
+		if (multithreaded && fusecfg.threads > 1)
+			ret = erofsfuse_loop_mt(se, ch);
+		else
+			ret = fuse_session_loop(se);
+	}
+
+	fuse_remove_signal_handlers(se);
+	fuse_session_remove_chan(ch);
+err_session_destroy:
+	fuse_session_destroy(se);
+err_unmount:
+	fuse_unmount(mountpoint, ch);
+err_free_mountpoint:
+	free(mountpoint);
+err_super_put:
+	erofsfuse_prefetch_exit();
+	erofsfuse_trace_exit();
+err_close_images:
+	while (i)
+		erofsfuse_close_image(&images[--i]);
+err_free_images:
+	erofsfuse_free_images();
 err_fuse_free_args:
 	fuse_opt_free_args(&args);
 err:
@@ -0,0 +1,389 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Warm up caches for a list of files right after mounting, e.g. the ones
+ * an application reads at startup (see --trace).  Background threads look
+ * up each path, which caches the inode and its extent table, and then read
+ * the on-disk extents of the listed ranges so that they are in the page
+ * cache (or fetched, for remote blobs) before they are first accessed.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "erofs/print.h"
+#include "erofs/io.h"
+#include "erofs/lock.h"
+#include "prefetch.h"
+#ifdef EROFS_MT_ENABLED
+#include <pthread.h>
+#endif
+
+#define EROFSFUSE_PREFETCH_THREADS	2
+/* read extents in pieces so that throttling and cancelling are timely */
+#define EROFSFUSE_PREFETCH_IOSIZE	(256 * 1024)
+
+struct erofsfuse_prefetch_entry {
+	char *path;
+	erofs_off_t offset, len;
+};
+
+static struct erofsfuse_prefetch {
+	struct erofs_sb_info *sbi;
+	struct erofsfuse_prefetch_entry *entries;
+	unsigned int nr, max;
+	/* in bytes per second, or 0 if unlimited */
+	u64 rate;
+	/* inodes which have been accessed through FUSE */
+	unsigned long *accessed;
+	erofs_nid_t maxnid;
+	struct timespec start;
+
+	erofs_mutex_t lock;
+	unsigned int next;	/* the next entry to be warmed */
+	u64 next_io;		/* when the next read may start, in ns */
+	bool started, stop, reported;
+	unsigned int running;
+	unsigned int warmed, early, failed;
+	u64 bytes;
+#ifdef EROFS_MT_ENABLED
+	pthread_cond_t wait;
+	pthread_t threads[EROFSFUSE_PREFETCH_THREADS];
+	unsigned int nr_threads;
+#endif
+} pf = {
+	.lock = EROFS_MUTEX_INITIALIZER,
+};
+
+static u64 erofsfuse_prefetch_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool erofsfuse_prefetch_accessed(erofs_nid_t nid)
+{
+	return nid < pf.maxnid &&
+		(__atomic_load_n(&pf.accessed[BIT_WORD(nid)],
+				 __ATOMIC_RELAXED) & BIT_MASK(nid));
+}
+
+void erofsfuse_prefetch_access(erofs_nid_t nid)
+{
+	if (!pf.accessed || nid >= pf.maxnid ||
+	    erofsfuse_prefetch_accessed(nid))
+		return;
+	__atomic_fetch_or(&pf.accessed[BIT_WORD(nid)], BIT_MASK(nid),
+			  __ATOMIC_RELAXED);
+}
+
+static void erofsfuse_prefetch_report(void)
+{
+	double secs = (erofsfuse_prefetch_now() -
+		       (pf.start.tv_sec * 1000000000ULL + pf.start.tv_nsec)) /
+		1e9;
+
+	erofs_info("prefetch %s: %u of %u entries warmed (%llu KiB) in %.3fs, %u before their first access, %u failed",
+		   pf.stop ? "cancelled" : "done", pf.warmed, pf.nr,
+		   (pf.bytes >> 10) | 0ULL, secs, pf.early, pf.failed);
+	pf.reported = true;
+}
+
+#ifdef EROFS_MT_ENABLED
+/* wait until @len more bytes can be read within the rate limit */
+static int erofsfuse_prefetch_throttle(size_t len)
+{
+	int ret = 0;
+
+	erofs_mutex_lock(&pf.lock);
+	if (!pf.stop && pf.rate) {
+		u64 now = erofsfuse_prefetch_now();
+		u64 at = max(pf.next_io, now);
+		struct timespec ts = {
+			.tv_sec = at / 1000000000,
+			.tv_nsec = at % 1000000000,
+		};
+
+		pf.next_io = at + len * 1000000000ULL / pf.rate;
+		while (!pf.stop && at > now &&
+		       pthread_cond_timedwait(&pf.wait, &pf.lock, &ts) !=
+				ETIMEDOUT)
+			;
+	}
+	if (pf.stop)
+		ret = -ECANCELED;
+	erofs_mutex_unlock(&pf.lock);
+	return ret;
+}
+
+static int erofsfuse_prefetch_extent(struct erofs_sb_info *sbi,
+				     int device_id, u64 offset, size_t len,
+				     void *priv)
+{
+	char *buf = priv;
+	size_t n;
+	int ret;
+
+	while (len) {
+		n = min_t(size_t, len, EROFSFUSE_PREFETCH_IOSIZE);
+		ret = erofsfuse_prefetch_throttle(n);
+		if (ret)
+			return ret;
+		ret = dev_read(sbi, device_id, buf, offset, n);
+		if (ret)
+			return ret;
+		__atomic_add_fetch(&pf.bytes, n, __ATOMIC_RELAXED);
+		offset += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int erofsfuse_prefetch_one(struct erofsfuse_prefetch_entry *e,
+				  char *buf)
+{
+	struct erofs_inode *vi = erofs_icache_lookup(pf.sbi, e->path);
+	erofs_off_t end;
+	int ret = 0;
+
+	if (IS_ERR(vi))
+		return PTR_ERR(vi);
+
+	if (S_ISREG(vi->i_mode) && e->offset < vi->i_size) {
+		end = vi->i_size;
+		if (e->len < vi->i_size - e->offset)
+			end = e->offset + e->len;
+		ret = erofs_iterate_extents(vi, e->offset, end,
+					    erofsfuse_prefetch_extent, buf);
+	}
+	if (!ret && !erofsfuse_prefetch_accessed(vi->nid))
+		__atomic_add_fetch(&pf.early, 1, __ATOMIC_RELAXED);
+	erofs_icache_put(vi);
+	return ret;
+}
+
+static void *erofsfuse_prefetch_worker(void *arg)
+{
+	struct erofsfuse_prefetch_entry *e;
+	char *buf = malloc(EROFSFUSE_PREFETCH_IOSIZE);
+	int ret;
+
+	while (buf) {
+		erofs_mutex_lock(&pf.lock);
+		if (pf.stop || pf.next >= pf.nr) {
+			erofs_mutex_unlock(&pf.lock);
+			break;
+		}
+		e = &pf.entries[pf.next++];
+		erofs_mutex_unlock(&pf.lock);
+
+		ret = erofsfuse_prefetch_one(e, buf);
+		if (ret == -ECANCELED)
+			break;
+
+		erofs_mutex_lock(&pf.lock);
+		if (ret) {
+			erofs_dbg("failed to prefetch %s: %s", e->path,
+				  erofs_strerror(ret));
+			++pf.failed;
+		} else {
+			++pf.warmed;
+		}
+		erofs_mutex_unlock(&pf.lock);
+	}
+	free(buf);
+
+	erofs_mutex_lock(&pf.lock);
+	if (!--pf.running && !pf.stop)
+		erofsfuse_prefetch_report();
+	erofs_mutex_unlock(&pf.lock);
+	return NULL;
+}
+#endif
+
+static int erofsfuse_prefetch_add(const char *path, erofs_off_t offset,
+				  erofs_off_t len)
+{
+	struct erofsfuse_prefetch_entry *e = NULL;
+	erofs_off_t end;
+
+	/* merge adjacent records of the same file, e.g. from a trace */
+	if (pf.nr) {
+		e = &pf.entries[pf.nr - 1];
+		if (!strcmp(e->path, path) && offset <= e->offset + e->len &&
+		    offset + len >= e->offset) {
+			end = max(e->offset + e->len, offset + len);
+			e->offset = min(e->offset, offset);
+			e->len = end - e->offset;
+			return 0;
+		}
+	}
+
+	if (pf.nr >= pf.max) {
+		unsigned int max = pf.max ? pf.max << 1 : 256;
+
+		e = realloc(pf.entries, max * sizeof(*e));
+		if (!e)
+			return -ENOMEM;
+		pf.entries = e;
+		pf.max = max;
+	}
+	e = &pf.entries[pf.nr];
+	e->path = strdup(path);
+	if (!e->path)
+		return -ENOMEM;
+	e->offset = offset;
+	e->len = len;
+	++pf.nr;
+	return 0;
+}
+
+/* parse a record of --trace, whose path is the last quoted field */
+static int erofsfuse_prefetch_add_record(char *line)
+{
+	unsigned long long offset, len;
+	char *p, *q;
+	int n = 0;
+
+	if (sscanf(line, "%*u,%*u,%*u,%llu,%llu,%*u,%n",
+		   &offset, &len, &n) != 2 || !n || line[n] != '"')
+		return -EINVAL;
+
+	for (p = q = line + n + 1; *p; ++p) {
+		if (*p == '"' && *++p != '"')
+			break;
+		*q++ = *p;
+	}
+	*q = '\0';
+	return erofsfuse_prefetch_add(line + n + 1, offset, len);
+}
+
+/*
+ * Load the list, which is either a trace written by --trace or simply one
+ * absolute path per line for whole files.
+ */
+int erofsfuse_prefetch_init(struct erofs_sb_info *sbi, const char *list,
+			    unsigned int rate)
+{
+	FILE *fp = fopen(list, "r");
+	bool trace = false;
+	unsigned int lineno = 0;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int ret = 0;
+
+	if (!fp) {
+		erofs_err("failed to open prefetch list %s", list);
+		return -errno;
+	}
+
+	while ((len = getline(&line, &size, fp)) >= 0) {
+		while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		if (!lineno++ && !strncmp(line, "time_us,", 8)) {
+			trace = true;
+			continue;
+		}
+		if (!len || line[0] == '#')
+			continue;
+
+		if (trace)
+			ret = erofsfuse_prefetch_add_record(line);
+		else if (line[0] != '/')
+			ret = -EINVAL;
+		else
+			ret = erofsfuse_prefetch_add(line, 0, ~0ULL);
+		if (ret == -EINVAL) {
+			erofs_warn("ignoring invalid line %u in %s",
+				   lineno, list);
+			ret = 0;
+		} else if (ret) {
+			break;
+		}
+	}
+	free(line);
+	fclose(fp);
+	if (ret)
+		return ret;
+
+	pf.maxnid = (erofs_nid_t)(sbi->primarydevice_blocks -
+		sbi->meta_blkaddr) << (LOG_BLOCK_SIZE - EROFS_ISLOTBITS);
+	pf.accessed = calloc(BITS_TO_LONGS(pf.maxnid), sizeof(long));
+	if (!pf.accessed)
+		return -ENOMEM;
+	pf.sbi = sbi;
+	pf.rate = (u64)rate << 20;
+	erofs_info("%u entries to prefetch from %s", pf.nr, list);
+	return 0;
+}
+
+/* start warming in the background, this should be called after daemonizing */
+int erofsfuse_prefetch_start(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &pf.start);
+	pf.started = true;
+#ifdef EROFS_MT_ENABLED
+	{
+		pthread_condattr_t attr;
+		int ret = 0;
+
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&pf.wait, &attr);
+		pthread_condattr_destroy(&attr);
+
+		erofs_mutex_lock(&pf.lock);
+		for (; pf.nr_threads < EROFSFUSE_PREFETCH_THREADS;
+		     ++pf.nr_threads) {
+			ret = -pthread_create(&pf.threads[pf.nr_threads], NULL,
+					      erofsfuse_prefetch_worker, NULL);
+			if (ret)
+				break;
+			++pf.running;
+		}
+		erofs_mutex_unlock(&pf.lock);
+		if (!pf.nr_threads)
+			return ret;
+	}
+	return 0;
+#else
+	/* erofsfuse refuses --prefetch without threads */
+	return -EOPNOTSUPP;
+#endif
+}
+
+/* cancel warming if it's still in progress, e.g. on unmount */
+void erofsfuse_prefetch_exit(void)
+{
+	unsigned int i;
+
+	if (!pf.sbi)
+		return;
+
+	erofs_mutex_lock(&pf.lock);
+	pf.stop = true;
+#ifdef EROFS_MT_ENABLED
+	pthread_cond_broadcast(&pf.wait);
+#endif
+	erofs_mutex_unlock(&pf.lock);
+#ifdef EROFS_MT_ENABLED
+	for (i = 0; i < pf.nr_threads; ++i)
+		pthread_join(pf.threads[i], NULL);
+	if (pf.nr_threads)
+		pthread_cond_destroy(&pf.wait);
+#endif
+	if (pf.started && !pf.reported)
+		erofsfuse_prefetch_report();
+
+	for (i = 0; i < pf.nr; ++i)
+		free(pf.entries[i].path);
+	free(pf.entries);
+	free(pf.accessed);
+	pf.sbi = NULL;
+}
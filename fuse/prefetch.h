@@ -0,0 +1,13 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+#ifndef __EROFSFUSE_PREFETCH_H
+#define __EROFSFUSE_PREFETCH_H
+
+#include "erofs/internal.h"
+
+int erofsfuse_prefetch_init(struct erofs_sb_info *sbi, const char *list,
+			    unsigned int rate);
+int erofsfuse_prefetch_start(void);
+void erofsfuse_prefetch_access(erofs_nid_t nid);
+void erofsfuse_prefetch_exit(void);
+
+#endif
@@ -0,0 +1,335 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Record which files and ranges are read (e.g. during application
+ * startup) so that images can be laid out or prefetched accordingly.
+ * Each thread appends to its own ring without any locking, and rings are
+ * drained into a CSV file periodically, on SIGUSR1 and on unmount.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include "erofs/print.h"
+#include "erofs/dir.h"
+#include "erofs/list.h"
+#include "erofs/lock.h"
+#include "trace.h"
+#ifdef EROFS_MT_ENABLED
+#include <pthread.h>
+#include <semaphore.h>
+#endif
+
+/* records per thread, which are dropped if the ring isn't drained in time */
+#define EROFSFUSE_TRACE_RING	(1U << 14)
+
+struct erofsfuse_trace_rec {
+	u64 time;		/* in nanoseconds since tracing started */
+	erofs_nid_t nid;
+	u64 offset;
+	u32 len;
+	u16 thread;
+	u16 first;		/* the first time this inode is read */
+};
+
+struct erofsfuse_trace_ring {
+	struct list_head list;
+	unsigned int id;
+	/* only advanced by the owner thread */
+	u64 head;
+	/* only advanced by erofsfuse_trace_flush() */
+	u64 tail;
+	u64 dropped;
+	struct erofsfuse_trace_rec recs[EROFSFUSE_TRACE_RING];
+};
+
+bool erofsfuse_tracing;
+
+static struct erofs_sb_info *trace_sbi;
+static FILE *trace_fp;
+static struct timespec trace_start;
+/* inodes which have been read, to tell first touches */
+static unsigned long *trace_seen;
+static erofs_nid_t trace_maxnid;
+static u64 trace_dropped;
+
+/* protects the list of rings and the trace file */
+static erofs_mutex_t trace_lock = EROFS_MUTEX_INITIALIZER;
+static LIST_HEAD(trace_rings);
+static unsigned int trace_nr_rings;
+
+static struct erofsfuse_trace_ring *erofsfuse_trace_new_ring(void)
+{
+	struct erofsfuse_trace_ring *ring = calloc(1, sizeof(*ring));
+
+	if (!ring)
+		return NULL;
+	erofs_mutex_lock(&trace_lock);
+	ring->id = trace_nr_rings++;
+	list_add_tail(&ring->list, &trace_rings);
+	erofs_mutex_unlock(&trace_lock);
+	return ring;
+}
+
+#ifdef EROFS_MT_ENABLED
+static pthread_key_t trace_key;
+static pthread_t trace_thread;
+static sem_t trace_sem;
+static bool trace_stop;
+
+static struct erofsfuse_trace_ring *erofsfuse_trace_ring(void)
+{
+	struct erofsfuse_trace_ring *ring = pthread_getspecific(trace_key);
+
+	if (!ring) {
+		ring = erofsfuse_trace_new_ring();
+		if (ring)
+			pthread_setspecific(trace_key, ring);
+	}
+	return ring;
+}
+
+static void erofsfuse_trace_signal(int sig)
+{
+	sem_post(&trace_sem);
+}
+
+/* drain all rings every second so that busy threads rarely drop records */
+static void *erofsfuse_trace_worker(void *arg)
+{
+	struct timespec ts;
+
+	while (!__atomic_load_n(&trace_stop, __ATOMIC_ACQUIRE)) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		++ts.tv_sec;
+		sem_timedwait(&trace_sem, &ts);
+		erofsfuse_trace_flush();
+	}
+	return NULL;
+}
+#else
+static struct erofsfuse_trace_ring *trace_ring;
+static volatile sig_atomic_t trace_flush_requested;
+
+static struct erofsfuse_trace_ring *erofsfuse_trace_ring(void)
+{
+	if (!trace_ring)
+		trace_ring = erofsfuse_trace_new_ring();
+	return trace_ring;
+}
+
+/* there are no other threads, so flush on the next read instead */
+static void erofsfuse_trace_signal(int sig)
+{
+	trace_flush_requested = 1;
+}
+#endif
+
+static bool erofsfuse_trace_first(erofs_nid_t nid)
+{
+	unsigned long mask = BIT_MASK(nid);
+
+	if (nid >= trace_maxnid)
+		return false;
+	return !(__atomic_fetch_or(&trace_seen[BIT_WORD(nid)], mask,
+				   __ATOMIC_RELAXED) & mask);
+}
+
+void __erofsfuse_trace(struct erofs_inode *vi, erofs_off_t offset, size_t len)
+{
+	struct erofsfuse_trace_ring *ring = erofsfuse_trace_ring();
+	struct erofsfuse_trace_rec *rec;
+	struct timespec ts;
+	u64 head;
+
+	if (!ring)
+		return;
+#ifndef EROFS_MT_ENABLED
+	if (trace_flush_requested ||
+	    ring->head - ring->tail >= EROFSFUSE_TRACE_RING)
+		erofsfuse_trace_flush();
+#endif
+	head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >=
+			EROFSFUSE_TRACE_RING) {
+		__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	rec = &ring->recs[head % EROFSFUSE_TRACE_RING];
+	rec->time = (ts.tv_sec - trace_start.tv_sec) * 1000000000ULL +
+		ts.tv_nsec - trace_start.tv_nsec;
+	rec->nid = vi->nid;
+	rec->offset = offset;
+	rec->len = len;
+	rec->thread = ring->id;
+	rec->first = erofsfuse_trace_first(vi->nid);
+	/* publish the record to the flusher */
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static int erofsfuse_trace_cmp(const void *a, const void *b)
+{
+	const struct erofsfuse_trace_rec *ra = a, *rb = b;
+
+	if (ra->time != rb->time)
+		return ra->time < rb->time ? -1 : 1;
+	return 0;
+}
+
+/* paths are quoted since they could contain commas or even newlines */
+static void erofsfuse_trace_putpath(const char *path)
+{
+	putc('"', trace_fp);
+	for (; *path; ++path) {
+		if (*path == '"')
+			putc('"', trace_fp);
+		putc(*path, trace_fp);
+	}
+	putc('"', trace_fp);
+}
+
+/* write out all records collected so far in time order */
+void erofsfuse_trace_flush(void)
+{
+	struct erofsfuse_trace_ring *ring;
+	struct erofsfuse_trace_rec *recs = NULL;
+	erofs_nid_t lastnid = ~0ULL;
+	char path[PATH_MAX];
+	u64 dropped = 0;
+	size_t i, nr = 0;
+
+	erofs_mutex_lock(&trace_lock);
+#ifndef EROFS_MT_ENABLED
+	trace_flush_requested = 0;
+#endif
+	list_for_each_entry(ring, &trace_rings, list)
+		nr += __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+			ring->tail;
+	if (nr) {
+		recs = malloc(nr * sizeof(*recs));
+		if (!recs) {
+			erofs_mutex_unlock(&trace_lock);
+			return;
+		}
+	}
+
+	nr = 0;
+	list_for_each_entry(ring, &trace_rings, list) {
+		u64 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		u64 tail;
+
+		for (tail = ring->tail; tail < head; ++tail)
+			recs[nr++] = ring->recs[tail % EROFSFUSE_TRACE_RING];
+		__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+		dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	}
+	qsort(recs, nr, sizeof(*recs), erofsfuse_trace_cmp);
+
+	for (i = 0; i < nr; ++i) {
+		if (recs[i].nid != lastnid) {
+			lastnid = recs[i].nid;
+			if (erofs_get_pathname(trace_sbi, lastnid, path,
+					       sizeof(path)))
+				path[0] = '\0';
+		}
+		fprintf(trace_fp, "%llu,%u,%llu,%llu,%u,%u,",
+			(recs[i].time / 1000) | 0ULL, recs[i].thread,
+			recs[i].nid | 0ULL, recs[i].offset | 0ULL,
+			recs[i].len, recs[i].first);
+		erofsfuse_trace_putpath(path);
+		putc('\n', trace_fp);
+	}
+	fflush(trace_fp);
+	free(recs);
+
+	if (dropped != trace_dropped) {
+		erofs_warn("%llu trace records dropped so far",
+			   dropped | 0ULL);
+		trace_dropped = dropped;
+	}
+	erofs_mutex_unlock(&trace_lock);
+}
+
+/* open the trace file before daemonizing, which changes the cwd */
+int erofsfuse_trace_init(struct erofs_sb_info *sbi, const char *path)
+{
+	trace_fp = fopen(path, "w");
+	if (!trace_fp) {
+		erofs_err("failed to open trace file %s", path);
+		return -errno;
+	}
+
+	trace_maxnid = (erofs_nid_t)(sbi->primarydevice_blocks -
+		sbi->meta_blkaddr) << (LOG_BLOCK_SIZE - EROFS_ISLOTBITS);
+	trace_seen = calloc(BITS_TO_LONGS(trace_maxnid), sizeof(long));
+	if (!trace_seen) {
+		fclose(trace_fp);
+		trace_fp = NULL;
+		return -ENOMEM;
+	}
+	trace_sbi = sbi;
+	fputs("time_us,thread,nid,offset,length,first,path\n", trace_fp);
+	return 0;
+}
+
+/* start recording, this should be called after daemonizing */
+int erofsfuse_trace_start(void)
+{
+	struct sigaction sa = {
+		.sa_handler = erofsfuse_trace_signal,
+		.sa_flags = SA_RESTART,
+	};
+#ifdef EROFS_MT_ENABLED
+	int ret;
+
+	ret = -pthread_key_create(&trace_key, NULL);
+	if (ret)
+		return ret;
+	sem_init(&trace_sem, 0, 0);
+	ret = -pthread_create(&trace_thread, NULL,
+			      erofsfuse_trace_worker, NULL);
+	if (ret) {
+		sem_destroy(&trace_sem);
+		pthread_key_delete(trace_key);
+		return ret;
+	}
+#endif
+	clock_gettime(CLOCK_MONOTONIC, &trace_start);
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+	erofsfuse_tracing = true;
+	return 0;
+}
+
+/* write out the rest after all FUSE threads are gone */
+void erofsfuse_trace_exit(void)
+{
+	struct erofsfuse_trace_ring *ring, *n;
+
+	if (!trace_fp)
+		return;
+
+	if (erofsfuse_tracing) {
+		erofsfuse_tracing = false;
+		signal(SIGUSR1, SIG_DFL);
+#ifdef EROFS_MT_ENABLED
+		__atomic_store_n(&trace_stop, true, __ATOMIC_RELEASE);
+		sem_post(&trace_sem);
+		pthread_join(trace_thread, NULL);
+		sem_destroy(&trace_sem);
+		pthread_key_delete(trace_key);
+#endif
+		erofsfuse_trace_flush();
+	}
+
+	list_for_each_entry_safe(ring, n, &trace_rings, list) {
+		list_del(&ring->list);
+		free(ring);
+	}
+	fclose(trace_fp);
+	trace_fp = NULL;
+	free(trace_seen);
+	trace_seen = NULL;
+}
@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+#ifndef __EROFSFUSE_TRACE_H
+#define __EROFSFUSE_TRACE_H
+
+#include "erofs/internal.h"
+
+extern bool erofsfuse_tracing;
+
+int erofsfuse_trace_init(struct erofs_sb_info *sbi, const char *path);
+int erofsfuse_trace_start(void);
+void erofsfuse_trace_flush(void);
+void erofsfuse_trace_exit(void);
+void __erofsfuse_trace(struct erofs_inode *vi, erofs_off_t offset, size_t len);
+
+/* record that [@offset, @offset + @len) of @vi is being read */
+static inline void erofsfuse_trace(struct erofs_inode *vi,
+				   erofs_off_t offset, size_t len)
+{
+	if (erofsfuse_tracing)
+		__erofsfuse_trace(vi, offset, len);
+}
+
+#endif
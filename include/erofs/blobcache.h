@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: GPL-2.0+ OR Apache-2.0 */
+#ifndef __EROFS_BLOBCACHE_H
+#define __EROFS_BLOBCACHE_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "erofs/internal.h"
+
+struct erofs_blobcache;
+
+bool erofs_blobcache_is_remote(const char *uri);
+struct erofs_blobcache *erofs_blobcache_open(const char *uri,
+					     const char *cachedir);
+int erofs_blobcache_fd(struct erofs_blobcache *bc);
+int erofs_blobcache_fill(struct erofs_blobcache *bc, u64 offset, size_t len);
+void erofs_blobcache_close(struct erofs_blobcache *bc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
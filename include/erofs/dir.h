@@ -51,10 +51,13 @@ struct erofs_dir_context {
 	struct erofs_inode *dir;
 	erofs_readdir_cb cb;
 	erofs_nid_t pnid;		/* optional */
+	/* optional, resume from the dirent at (or right after) this position */
+	erofs_off_t pos;
 
 	/* [OUT] the dirent which is under processing */
 	const char *dname;		/* please see the comment above */
 	erofs_nid_t de_nid;
+	erofs_off_t de_pos;		/* dirent position in the directory */
 	u8 de_namelen, de_ftype, flags;
 	bool dot_dotdot;
 };
@@ -62,7 +65,9 @@ struct erofs_dir_context {
 /* Iterate over inodes that are in directory */
 int erofs_iterate_dir(struct erofs_dir_context *ctx, bool fsck);
 /* Get a full pathname of the inode NID */
-int erofs_get_pathname(erofs_nid_t nid, char *buf, size_t size);
+int erofs_get_pathname(struct erofs_sb_info *sbi, erofs_nid_t nid,
+		       char *buf, size_t size);
+void erofs_drop_nid_index(struct erofs_sb_info *sbi);
 
 #ifdef __cplusplus
 }
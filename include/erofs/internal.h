@@ -68,6 +68,8 @@ typedef u32 erofs_blk_t;
 #define BLK_ROUND_UP(addr)	DIV_ROUND_UP(addr, EROFS_BLKSIZ)
 
 struct erofs_buffer_head;
+struct erofs_nid_index;
+struct erofs_shared_xattr_table;
 
 struct erofs_device_info {
 	u32 blocks;
@@ -76,6 +78,16 @@ struct erofs_device_info {
 
 #define EROFS_PACKED_NID_UNALLOCATED	-1
 
+/* an in-memory read-only mapping of an image or a blob device */
+struct erofs_devmap {
+	void *base;
+	u64 size;
+};
+
+#define EROFS_MAX_BLOBS		256
+
+struct erofs_blobcache;
+
 struct erofs_sb_info {
 	struct erofs_device_info *devs;
 
@@ -110,32 +122,54 @@ struct erofs_sb_info {
 		u16 device_id_mask;		/* used for others */
 	};
 	erofs_nid_t packed_nid;
+
+	/* the image and extra blob devices opened by dev_open*() */
+	const char *devname;
+	int devfd;
+	unsigned int nblobs;
+	int blobfd[EROFS_MAX_BLOBS];
+	struct erofs_devmap devmap[EROFS_MAX_BLOBS + 1];
+	/* map devices by dev_open_ro() and blob_open_ro(), see dev_mmap_ro() */
+	bool mmap_devices;
+	/* blobs fetched on demand from remote sources, see lib/blobcache.c */
+	struct erofs_blobcache *blobcache[EROFS_MAX_BLOBS];
+	/* where to keep fetched blobs across runs, or NULL */
+	const char *blob_cachedir;
+	/* bytes to skip before the image, applied to all device reads */
+	u64 diskoffset;
+	/* nid -> parent index for erofs_get_pathname(), built on demand */
+	struct erofs_nid_index *nid_index;
+	/* decoded shared xattrs, filled in on demand */
+	struct erofs_shared_xattr_table *shared_xattrs;
 };
 
 
 /* make sure that any user of the erofs headers has atleast 64bit off_t type */
 extern int erofs_assert_largefile[sizeof(off_t)-8];
 
-/* global sbi */
+/*
+ * global sbi, which is the image built by mkfs.erofs or the default one
+ * opened by the other tools.  The read path itself only uses inode->sbi.
+ */
 extern struct erofs_sb_info sbi;
 
-static inline erofs_off_t iloc(erofs_nid_t nid)
+static inline erofs_off_t iloc(struct erofs_sb_info *sbi, erofs_nid_t nid)
 {
-	return blknr_to_addr(sbi.meta_blkaddr) + (nid << sbi.islotbits);
+	return blknr_to_addr(sbi->meta_blkaddr) + (nid << sbi->islotbits);
 }
 
 #define EROFS_FEATURE_FUNCS(name, compat, feature) \
-static inline bool erofs_sb_has_##name(void) \
+static inline bool erofs_sb_has_##name(struct erofs_sb_info *sbi) \
 { \
-	return sbi.feature_##compat & EROFS_FEATURE_##feature; \
+	return sbi->feature_##compat & EROFS_FEATURE_##feature; \
 } \
-static inline void erofs_sb_set_##name(void) \
+static inline void erofs_sb_set_##name(struct erofs_sb_info *sbi) \
 { \
-	sbi.feature_##compat |= EROFS_FEATURE_##feature; \
+	sbi->feature_##compat |= EROFS_FEATURE_##feature; \
 } \
-static inline void erofs_sb_clear_##name(void) \
+static inline void erofs_sb_clear_##name(struct erofs_sb_info *sbi) \
 { \
-	sbi.feature_##compat &= ~EROFS_FEATURE_##feature; \
+	sbi->feature_##compat &= ~EROFS_FEATURE_##feature; \
 }
 
 EROFS_FEATURE_FUNCS(lz4_0padding, incompat, INCOMPAT_LZ4_0PADDING)
@@ -150,9 +184,17 @@ EROFS_FEATURE_FUNCS(sb_chksum, compat, COMPAT_SB_CHKSUM)
 
 #define EROFS_I_EA_INITED	(1 << 0)
 #define EROFS_I_Z_INITED	(1 << 1)
+/* (erofsfuse) the inode is owned by the inode cache */
+#define EROFS_I_CACHED		(1 << 2)
+/* (erofsfuse) xattr_name_filter is valid */
+#define EROFS_I_XATTR_FILTER	(1 << 3)
+
+struct z_erofs_extent_table;
 
 struct erofs_inode {
 	struct list_head i_hash, i_subdirs, i_xattrs;
+	/* the filesystem which this inode belongs to */
+	struct erofs_sb_info *sbi;
 
 	union {
 		/* (erofsfuse) runtime flags */
@@ -196,6 +238,8 @@ struct erofs_inode {
 
 	unsigned int xattr_shared_count;
 	unsigned int *xattr_shared_xattrs;
+	/* (erofsfuse) bloom filter of xattr names, see lib/xattr.c */
+	u64 xattr_name_filter;
 
 	erofs_nid_t nid;
 	struct erofs_buffer_head *bh;
@@ -220,6 +264,8 @@ struct erofs_inode {
 #define z_idata_size	idata_size
 		};
 	};
+	/* (erofsfuse) decoded extents of cached compressed inodes */
+	struct z_erofs_extent_table *z_extents;
 #ifdef WITH_ANDROID
 	uint64_t capabilities;
 #endif
@@ -344,25 +390,70 @@ struct erofs_map_dev {
 };
 
 /* super.c */
-int erofs_read_superblock(void);
-void erofs_put_super(void);
+int erofs_read_superblock(struct erofs_sb_info *sbi);
+void erofs_put_super(struct erofs_sb_info *sbi);
 
 /* namei.c */
+struct nameidata {
+	struct erofs_sb_info *sbi;
+	erofs_nid_t	nid;
+	unsigned int	ftype;
+};
+
 int erofs_read_inode_from_disk(struct erofs_inode *vi);
+int erofs_namei(struct nameidata *nd, const char *name, unsigned int len);
 int erofs_ilookup(const char *path, struct erofs_inode *vi);
+struct erofs_inode *erofs_icache_lookup(struct erofs_sb_info *sbi,
+					const char *path);
 int erofs_read_inode_from_disk(struct erofs_inode *vi);
 
+/* icache.c */
+struct erofs_inode *erofs_icache_get(struct erofs_sb_info *sbi,
+				     erofs_nid_t nid);
+void erofs_icache_put(struct erofs_inode *vi);
+void erofs_icache_set_limit(size_t limit);
+void erofs_icache_exit(struct erofs_sb_info *sbi);
+
+/* scratch.c */
+enum erofs_scratch_id {
+	EROFS_SCRATCH_RAW,		/* compressed data read from disk */
+	EROFS_SCRATCH_DECOMPRESS,	/* bounce buffer for decodedskip */
+	EROFS_SCRATCH_MAX
+};
+
+void *erofs_get_scratch(enum erofs_scratch_id id, size_t size);
+
+/* per-stream sequential readahead state, zeroed when a file is opened */
+struct erofs_readahead {
+	erofs_off_t next;	/* where the next sequential read would start */
+	erofs_off_t end;	/* end of the range that has been prefetched */
+	unsigned int window;
+};
+
+typedef int (*erofs_extent_fn_t)(struct erofs_sb_info *sbi, int device_id,
+				 u64 offset, size_t len, void *priv);
+
 /* data.c */
 int erofs_pread(struct erofs_inode *inode, char *buf,
 		erofs_off_t count, erofs_off_t offset);
+void erofs_readahead(struct erofs_inode *inode, struct erofs_readahead *ra,
+		     erofs_off_t offset, erofs_off_t count);
+int erofs_iterate_extents(struct erofs_inode *inode, erofs_off_t start,
+			  erofs_off_t end, erofs_extent_fn_t fn, void *priv);
+int z_erofs_read_workers_init(unsigned int nr_workers);
+void z_erofs_read_workers_exit(void);
 int erofs_map_blocks(struct erofs_inode *inode,
 		struct erofs_map_blocks *map, int flags);
 int erofs_map_dev(struct erofs_sb_info *sbi, struct erofs_map_dev *map);
-int erofs_read_one_data(struct erofs_map_blocks *map, char *buffer, u64 offset,
-			size_t len);
+int erofs_read_one_data(struct erofs_inode *inode, struct erofs_map_blocks *map,
+			char *buffer, u64 offset, size_t len);
 int z_erofs_read_one_data(struct erofs_inode *inode,
 			struct erofs_map_blocks *map, char *raw, char *buffer,
 			erofs_off_t skip, erofs_off_t length, bool trimmed);
+int z_erofs_decompress_one_data(struct erofs_inode *inode,
+			struct erofs_map_blocks *map, const char *in,
+			char *buffer, erofs_off_t skip, erofs_off_t length,
+			bool trimmed);
 
 static inline int erofs_get_occupied_size(const struct erofs_inode *inode,
 					  erofs_off_t *size)
@@ -388,11 +479,16 @@ static inline int erofs_get_occupied_size(const struct erofs_inode *inode,
 int erofs_getxattr(struct erofs_inode *vi, const char *name, char *buffer,
 		   size_t buffer_size);
 int erofs_listxattr(struct erofs_inode *vi, char *buffer, size_t buffer_size);
+int erofs_init_inode_xattrs(struct erofs_inode *vi);
+void erofs_put_shared_xattrs(struct erofs_sb_info *sbi);
 
 /* zmap.c */
 int z_erofs_fill_inode(struct erofs_inode *vi);
+int z_erofs_fill_inode_lazy(struct erofs_inode *vi);
 int z_erofs_map_blocks_iter(struct erofs_inode *vi,
 			    struct erofs_map_blocks *map, int flags);
+size_t z_erofs_extent_table_size(struct erofs_inode *vi);
+void z_erofs_drop_extent_table(struct erofs_inode *vi);
 
 #ifdef EUCLEAN
 #define EFSCORRUPTED	EUCLEAN		/* Filesystem is corrupted */
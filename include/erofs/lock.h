@@ -0,0 +1,62 @@
+/* SPDX-License-Identifier: GPL-2.0+ OR Apache-2.0 */
+#ifndef __EROFS_LOCK_H
+#define __EROFS_LOCK_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "defs.h"
+
+#if defined(HAVE_PTHREAD_H) && defined(EROFS_MT_ENABLED)
+#include <pthread.h>
+
+typedef pthread_mutex_t erofs_mutex_t;
+
+#define EROFS_MUTEX_INITIALIZER	PTHREAD_MUTEX_INITIALIZER
+
+static inline void erofs_mutex_init(erofs_mutex_t *lock)
+{
+	pthread_mutex_init(lock, NULL);
+}
+#define erofs_mutex_lock	pthread_mutex_lock
+#define erofs_mutex_unlock	pthread_mutex_unlock
+#define erofs_mutex_destroy	pthread_mutex_destroy
+
+typedef pthread_cond_t erofs_cond_t;
+
+static inline void erofs_cond_init(erofs_cond_t *cond)
+{
+	pthread_cond_init(cond, NULL);
+}
+#define erofs_cond_wait		pthread_cond_wait
+#define erofs_cond_signal	pthread_cond_signal
+#define erofs_cond_broadcast	pthread_cond_broadcast
+#define erofs_cond_destroy	pthread_cond_destroy
+#else
+typedef struct {} erofs_mutex_t;
+
+#define EROFS_MUTEX_INITIALIZER	{}
+
+static inline void erofs_mutex_init(erofs_mutex_t *lock) {}
+static inline void erofs_mutex_lock(erofs_mutex_t *lock) {}
+static inline void erofs_mutex_unlock(erofs_mutex_t *lock) {}
+static inline void erofs_mutex_destroy(erofs_mutex_t *lock) {}
+
+/* nobody else could change the condition without threads */
+typedef struct {} erofs_cond_t;
+
+static inline void erofs_cond_init(erofs_cond_t *cond) {}
+static inline void erofs_cond_wait(erofs_cond_t *cond,
+				   erofs_mutex_t *lock) {}
+static inline void erofs_cond_signal(erofs_cond_t *cond) {}
+static inline void erofs_cond_broadcast(erofs_cond_t *cond) {}
+static inline void erofs_cond_destroy(erofs_cond_t *cond) {}
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,93 @@
+/* SPDX-License-Identifier: GPL-2.0+ OR Apache-2.0 */
+#ifndef __EROFS_STATS_H
+#define __EROFS_STATS_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdio.h>
+#include "erofs/internal.h"
+
+enum erofs_stat_id {
+	EROFS_STAT_PREAD,		/* erofs_pread() calls */
+	EROFS_STAT_PREAD_BYTES,
+	EROFS_STAT_DEV_READ,		/* dev_read() calls */
+	EROFS_STAT_DEV_READ_BYTES,
+	EROFS_STAT_DEV_READ_MMAP,	/* dev_read() calls served by mmap */
+	EROFS_STAT_ICACHE_HIT,
+	EROFS_STAT_ICACHE_MISS,
+	EROFS_STAT_BLOBCACHE_HIT,	/* ranges of remote blobs all present */
+	EROFS_STAT_BLOBCACHE_MISS,
+	EROFS_STAT_BLOBCACHE_FETCH_BYTES,
+	EROFS_STAT_MAX
+};
+
+/* decompression is accounted per algorithm, including shifted/interlaced */
+#define EROFS_STAT_NR_ALGS		(Z_EROFS_COMPRESSION_INTERLACED + 1)
+/* dev_read() latency histogram, bucket i counts [2^(i-1), 2^i) us */
+#define EROFS_STAT_LAT_BUCKETS		24
+/* counters left to frontends, e.g. for their own operations */
+#define EROFS_STAT_MAX_OPS		32
+
+struct erofs_stats {
+	u64 cnt[EROFS_STAT_MAX];
+	struct {
+		u64 calls, inbytes, outbytes, ns;
+	} decompress[EROFS_STAT_NR_ALGS];
+	u64 dev_read_lat[EROFS_STAT_LAT_BUCKETS];
+	u64 ops[EROFS_STAT_MAX_OPS];
+};
+
+extern bool erofs_stats_enabled;
+
+struct erofs_stats *__erofs_stats_get(void);
+u64 __erofs_stats_now(void);
+void erofs_stats_add_decompress(int alg, u64 inbytes, u64 outbytes, u64 ns);
+void erofs_stats_add_dev_read(u64 ns);
+void erofs_stats_snapshot(struct erofs_stats *st);
+void erofs_stats_show(FILE *f, const struct erofs_stats *st);
+
+/*
+ * Counters are only ever changed by their owner thread, so plain relaxed
+ * stores are enough and readers just sum up all threads.
+ */
+static inline void __erofs_stats_inc(u64 *cnt, u64 n)
+{
+	__atomic_store_n(cnt, *cnt + n, __ATOMIC_RELAXED);
+}
+
+static inline void erofs_stats_add(enum erofs_stat_id id, u64 n)
+{
+	struct erofs_stats *s;
+
+	if (!erofs_stats_enabled)
+		return;
+	s = __erofs_stats_get();
+	if (s)
+		__erofs_stats_inc(&s->cnt[id], n);
+}
+
+static inline void erofs_stats_add_op(unsigned int op, u64 n)
+{
+	struct erofs_stats *s;
+
+	if (!erofs_stats_enabled)
+		return;
+	s = __erofs_stats_get();
+	if (s)
+		__erofs_stats_inc(&s->ops[op], n);
+}
+
+/* a timestamp in nanoseconds for latencies, or 0 if stats are disabled */
+static inline u64 erofs_stats_now(void)
+{
+	return erofs_stats_enabled ? __erofs_stats_now() : 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -24,9 +24,10 @@ static inline unsigned int inlinexattr_header_size(struct erofs_inode *vi)
 		sizeof(u32) * vi->xattr_shared_count;
 }
 
-static inline erofs_blk_t xattrblock_addr(unsigned int xattr_id)
+static inline erofs_blk_t xattrblock_addr(struct erofs_sb_info *sbi,
+					  unsigned int xattr_id)
 {
-	return sbi.xattr_blkaddr +
+	return sbi->xattr_blkaddr +
 		xattr_id * sizeof(__u32) / EROFS_BLKSIZ;
 }
 
@@ -0,0 +1,716 @@
+// SPDX-License-Identifier: GPL-2.0+ OR Apache-2.0
+/*
+ * On-demand fetching of blob devices which live on a slow or remote
+ * source, e.g. "http://host/blob" or "file:///mnt/nfs/blob".  Blobs are
+ * fetched chunk by chunk on first access into a sparse local file, and a
+ * presence bitmap records which chunks are there already, so that a read
+ * only waits for the missing chunks it covers.  With a cache directory both
+ * files are kept across runs, otherwise an unlinked temporary file is used.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include "erofs/blobcache.h"
+#include "erofs/io.h"
+#include "erofs/lock.h"
+#include "erofs/stats.h"
+#if defined(HAVE_NETDB_H) && defined(HAVE_SYS_SOCKET_H)
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#define EROFS_BLOBSRC_HTTP
+#endif
+
+#define EROFS_MODNAME	"erofs_blobcache"
+#include "erofs/print.h"
+
+void erofs_sha256(const unsigned char *in, unsigned long in_size,
+		  unsigned char out[32]);
+
+#define EROFS_BLOBCACHE_CHUNKBITS	20
+/* the maximum number of missing chunks fetched with a single request */
+#define EROFS_BLOBCACHE_MAX_RUN		16
+
+struct erofs_blobsrc {
+	const struct erofs_blobsrc_ops *ops;
+	u64 size;
+	void *private;
+};
+
+struct erofs_blobsrc_ops {
+	const char *scheme;
+	int (*open)(struct erofs_blobsrc *src, const char *path);
+	/* read @len bytes at @offset, which never go beyond the blob size */
+	int (*read)(struct erofs_blobsrc *src, void *buf, u64 offset,
+		    size_t len);
+	void (*close)(struct erofs_blobsrc *src);
+};
+
+static int erofs_blobsrc_file_open(struct erofs_blobsrc *src,
+				   const char *path)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY | O_BINARY);
+
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st)) {
+		int err = -errno;
+
+		close(fd);
+		return err;
+	}
+	src->size = st.st_size;
+	src->private = (void *)(long)fd;
+	return 0;
+}
+
+static int erofs_blobsrc_file_read(struct erofs_blobsrc *src, void *buf,
+				   u64 offset, size_t len)
+{
+	int fd = (long)src->private;
+
+	while (len) {
+		ssize_t ret = pread(fd, buf, len, offset);
+
+		if (ret <= 0)
+			return ret ? -errno : -EIO;
+		buf += ret;
+		offset += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static void erofs_blobsrc_file_close(struct erofs_blobsrc *src)
+{
+	close((long)src->private);
+}
+
+static const struct erofs_blobsrc_ops erofs_blobsrc_file = {
+	.scheme = "file://",
+	.open = erofs_blobsrc_file_open,
+	.read = erofs_blobsrc_file_read,
+	.close = erofs_blobsrc_file_close,
+};
+
+#ifdef EROFS_BLOBSRC_HTTP
+#define EROFS_HTTP_TIMEOUT	30
+#define EROFS_HTTP_RETRIES	3
+
+/* plain HTTP/1.1 range requests, one connection for each request */
+struct erofs_blobsrc_http {
+	char *host, *port;
+	/* "host[:port]" for the Host header */
+	char *hostport;
+	char *path;
+};
+
+static int erofs_http_connect(struct erofs_blobsrc_http *http)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	}, *res, *ai;
+	struct timeval tv = { .tv_sec = EROFS_HTTP_TIMEOUT };
+	int fd = -1, ret;
+
+	ret = getaddrinfo(http->host, http->port, &hints, &res);
+	if (ret) {
+		erofs_err("failed to resolve %s: %s", http->host,
+			  gai_strerror(ret));
+		return -EHOSTUNREACH;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (!connect(fd, ai->ai_addr, ai->ai_addrlen))
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0) {
+		erofs_err("failed to connect to %s", http->hostport);
+		return -ECONNREFUSED;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	return fd;
+}
+
+static int erofs_http_recv(int fd, void *buf, size_t len)
+{
+	while (len) {
+		ssize_t ret = recv(fd, buf, len, 0);
+
+		if (ret <= 0)
+			return ret ? -errno : -EIO;
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static const char *erofs_http_header(const char *hdr, const char *name)
+{
+	size_t namelen = strlen(name);
+
+	while ((hdr = strstr(hdr, "\r\n")) != NULL) {
+		hdr += 2;
+		if (!strncasecmp(hdr, name, namelen) && hdr[namelen] == ':')
+			return hdr + namelen + 1;
+	}
+	return NULL;
+}
+
+/*
+ * Request the byte range [@offset, @offset + @len) of the blob into @buf.
+ * Servers may answer with a shorter range, so the number of bytes actually
+ * received is returned.  The total size in Content-Range is stored into
+ * @size if it's still 0, and has to match it otherwise.
+ */
+static ssize_t erofs_http_get_range(struct erofs_blobsrc_http *http,
+				    void *buf, u64 offset, size_t len,
+				    u64 *size)
+{
+	char hdr[8192], *end = NULL;
+	unsigned long long first, last, total;
+	size_t hdrlen = 0, body;
+	const char *p;
+	ssize_t ret;
+	int fd, n;
+
+	fd = erofs_http_connect(http);
+	if (fd < 0)
+		return fd;
+
+	n = snprintf(hdr, sizeof(hdr), "GET %s HTTP/1.1\r\n"
+		     "Host: %s\r\n"
+		     "Range: bytes=%llu-%llu\r\n"
+		     "User-Agent: erofs-utils/%s\r\n"
+		     "Connection: close\r\n\r\n", http->path, http->hostport,
+		     offset | 0ULL, (offset + len - 1) | 0ULL, cfg.c_version);
+	if (n >= (int)sizeof(hdr)) {
+		ret = -ENAMETOOLONG;
+		goto out;
+	}
+	if (send(fd, hdr, n, MSG_NOSIGNAL) != n) {
+		ret = -EIO;
+		goto out;
+	}
+
+	/* read until the end of headers, the rest is the beginning of body */
+	while (!end) {
+		ssize_t r;
+
+		if (hdrlen >= sizeof(hdr) - 1) {
+			ret = -EIO;
+			goto out;
+		}
+		r = recv(fd, hdr + hdrlen, sizeof(hdr) - 1 - hdrlen, 0);
+		if (r <= 0) {
+			ret = r ? -errno : -EIO;
+			goto out;
+		}
+		hdrlen += r;
+		hdr[hdrlen] = '\0';
+		end = strstr(hdr, "\r\n\r\n");
+	}
+	end[2] = '\0';
+	end += 4;
+
+	if (strncmp(hdr, "HTTP/1.", 7) || strncmp(hdr + 8, " 206", 4)) {
+		erofs_err("unexpected response from %s%s: %.12s",
+			  http->hostport, http->path, hdr);
+		ret = -EIO;
+		goto out;
+	}
+
+	p = erofs_http_header(hdr, "Content-Range");
+	if (!p || sscanf(p, " bytes %llu-%llu/%llu",
+			 &first, &last, &total) != 3 ||
+	    first != offset || last < first || last - first >= len) {
+		erofs_err("bad Content-Range from %s%s", http->hostport,
+			  http->path);
+		ret = -EIO;
+		goto out;
+	}
+	if (*size && total != *size) {
+		erofs_err("size of %s%s changed from %llu to %llu",
+			  http->hostport, http->path, *size | 0ULL, total);
+		ret = -ESTALE;
+		goto out;
+	}
+	*size = total;
+	len = last - first + 1;
+
+	body = min_t(size_t, hdr + hdrlen - end, len);
+	memcpy(buf, end, body);
+	ret = erofs_http_recv(fd, buf + body, len - body);
+	if (!ret)
+		ret = len;
+out:
+	close(fd);
+	return ret;
+}
+
+static int erofs_blobsrc_http_open(struct erofs_blobsrc *src,
+				   const char *path)
+{
+	struct erofs_blobsrc_http *http;
+	const char *slash, *colon;
+	char c;
+	ssize_t ret;
+
+	http = calloc(1, sizeof(*http));
+	if (!http)
+		return -ENOMEM;
+
+	slash = strchr(path, '/');
+	if (!slash)
+		slash = path + strlen(path);
+	http->hostport = strndup(path, slash - path);
+	http->path = strdup(*slash ? slash : "/");
+	if (!http->hostport || !http->path) {
+		ret = -ENOMEM;
+		goto err_out;
+	}
+
+	colon = strrchr(http->hostport, ':');
+	if (colon && !strchr(colon, ']')) {
+		http->host = strndup(http->hostport, colon - http->hostport);
+		http->port = strdup(colon + 1);
+	} else {
+		http->host = strdup(http->hostport);
+		http->port = strdup("80");
+	}
+	if (!http->host || !http->port) {
+		ret = -ENOMEM;
+		goto err_out;
+	}
+	/* strip the brackets of IPv6 literals for getaddrinfo() */
+	if (http->host[0] == '[') {
+		memmove(http->host, http->host + 1, strlen(http->host));
+		http->host[strcspn(http->host, "]")] = '\0';
+	}
+
+	/* also checks that the server supports range requests at all */
+	ret = erofs_http_get_range(http, &c, 0, 1, &src->size);
+	if (ret < 0)
+		goto err_out;
+	src->private = http;
+	return 0;
+err_out:
+	free(http->host);
+	free(http->port);
+	free(http->hostport);
+	free(http->path);
+	free(http);
+	return ret;
+}
+
+static int erofs_blobsrc_http_read(struct erofs_blobsrc *src, void *buf,
+				   u64 offset, size_t len)
+{
+	int failures = 0;
+
+	/* keep asking for the rest until the whole range is received */
+	while (len) {
+		ssize_t ret = erofs_http_get_range(src->private, buf, offset,
+						   len, &src->size);
+
+		if (ret < 0) {
+			if (ret == -ESTALE || ++failures >= EROFS_HTTP_RETRIES)
+				return ret;
+			continue;
+		}
+		failures = 0;
+		buf += ret;
+		offset += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static void erofs_blobsrc_http_close(struct erofs_blobsrc *src)
+{
+	struct erofs_blobsrc_http *http = src->private;
+
+	free(http->host);
+	free(http->port);
+	free(http->hostport);
+	free(http->path);
+	free(http);
+}
+
+static const struct erofs_blobsrc_ops erofs_blobsrc_http = {
+	.scheme = "http://",
+	.open = erofs_blobsrc_http_open,
+	.read = erofs_blobsrc_http_read,
+	.close = erofs_blobsrc_http_close,
+};
+#endif
+
+static const struct erofs_blobsrc_ops *erofs_blobsrcs[] = {
+	&erofs_blobsrc_file,
+#ifdef EROFS_BLOBSRC_HTTP
+	&erofs_blobsrc_http,
+#endif
+};
+
+static const struct erofs_blobsrc_ops *erofs_blobsrc_find(const char *uri)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(erofs_blobsrcs); ++i)
+		if (!strncmp(uri, erofs_blobsrcs[i]->scheme,
+			     strlen(erofs_blobsrcs[i]->scheme)))
+			return erofs_blobsrcs[i];
+	return NULL;
+}
+
+bool erofs_blobcache_is_remote(const char *uri)
+{
+	return strstr(uri, "://") != NULL;
+}
+
+/* the on-disk header of presence bitmaps, followed by the bitmap itself */
+struct erofs_blobcache_hdr {
+	char magic[8];
+	__le32 chunkbits;
+	__le32 reserved;
+	__le64 size;
+};
+
+#define EROFS_BLOBCACHE_MAGIC	"EROFSBC1"
+
+struct erofs_blobcache {
+	struct erofs_blobsrc src;
+	/* the sparse local copy of the blob and its presence bitmap */
+	int fd, mapfd;
+	unsigned int chunkbits;
+	u64 nchunks;
+	u8 *present;
+	/* chunks which are being fetched by some thread */
+	u8 *busy;
+	erofs_mutex_t lock;
+	erofs_cond_t wait;
+};
+
+static inline bool erofs_blobcache_test(const u8 *map, u64 nr)
+{
+	return map[nr / BITS_PER_BYTE] & (1U << (nr % BITS_PER_BYTE));
+}
+
+static inline void erofs_blobcache_set(u8 *map, u64 nr, bool on)
+{
+	if (on)
+		map[nr / BITS_PER_BYTE] |= 1U << (nr % BITS_PER_BYTE);
+	else
+		map[nr / BITS_PER_BYTE] &= ~(1U << (nr % BITS_PER_BYTE));
+}
+
+static inline size_t erofs_blobcache_mapsize(struct erofs_blobcache *bc)
+{
+	return DIV_ROUND_UP(bc->nchunks, BITS_PER_BYTE);
+}
+
+static int erofs_blobcache_open_tmp(struct erofs_blobcache *bc)
+{
+	const char *tmpdir = getenv("TMPDIR");
+	char *name;
+	int fd;
+
+	if (asprintf(&name, "%s/erofs-blob-XXXXXX",
+		     tmpdir ? tmpdir : "/tmp") < 0)
+		return -ENOMEM;
+	fd = mkstemp(name);
+	if (fd < 0) {
+		erofs_err("failed to create a temporary blob cache %s", name);
+		free(name);
+		return -errno;
+	}
+	unlink(name);
+	free(name);
+	bc->fd = fd;
+	return 0;
+}
+
+/* reuse the presence bitmap kept by the last run if it still matches */
+static int erofs_blobcache_load_map(struct erofs_blobcache *bc)
+{
+	struct erofs_blobcache_hdr hdr;
+	size_t mapsize = erofs_blobcache_mapsize(bc);
+	u64 i, nr = 0;
+
+	if (pread(bc->mapfd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+	    !memcmp(hdr.magic, EROFS_BLOBCACHE_MAGIC, sizeof(hdr.magic)) &&
+	    le32_to_cpu(hdr.chunkbits) == bc->chunkbits &&
+	    le64_to_cpu(hdr.size) == bc->src.size &&
+	    pread(bc->mapfd, bc->present, mapsize, sizeof(hdr)) ==
+			(ssize_t)mapsize) {
+		for (i = 0; i < bc->nchunks; ++i)
+			nr += erofs_blobcache_test(bc->present, i);
+		erofs_info("%llu of %llu chunks are cached already",
+			   nr | 0ULL, bc->nchunks | 0ULL);
+		return 0;
+	}
+
+	/* otherwise, start over with an empty cache */
+	memset(bc->present, 0, mapsize);
+	memcpy(hdr.magic, EROFS_BLOBCACHE_MAGIC, sizeof(hdr.magic));
+	hdr.chunkbits = cpu_to_le32(bc->chunkbits);
+	hdr.reserved = 0;
+	hdr.size = cpu_to_le64(bc->src.size);
+	if (ftruncate(bc->fd, 0) || ftruncate(bc->mapfd, 0) ||
+	    pwrite(bc->mapfd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    ftruncate(bc->mapfd, sizeof(hdr) + mapsize))
+		return -errno;
+	return 0;
+}
+
+static int erofs_blobcache_open_dir(struct erofs_blobcache *bc,
+				    const char *uri, const char *cachedir)
+{
+	u8 digest[32];
+	char name[PATH_MAX];
+	int i, n, ret;
+
+	/* name cache files after the blob uri */
+	erofs_sha256((const u8 *)uri, strlen(uri), digest);
+	n = snprintf(name, sizeof(name), "%s/", cachedir);
+	for (i = 0; i < 16 && n < (int)sizeof(name); ++i)
+		n += snprintf(name + n, sizeof(name) - n, "%02x", digest[i]);
+	if (n + sizeof(".blob") > sizeof(name))
+		return -ENAMETOOLONG;
+
+	strcpy(name + n, ".map");
+	bc->mapfd = open(name, O_RDWR | O_CREAT | O_BINARY, 0644);
+	if (bc->mapfd < 0) {
+		ret = -errno;
+		erofs_err("failed to open blob cache %s: %s", name,
+			  erofs_strerror(ret));
+		return ret;
+	}
+	/* the presence bitmap can't be shared with other running instances */
+	if (flock(bc->mapfd, LOCK_EX | LOCK_NB)) {
+		erofs_warn("blob cache %s is in use, use a temporary one",
+			   name);
+		close(bc->mapfd);
+		bc->mapfd = -1;
+		return erofs_blobcache_open_tmp(bc);
+	}
+
+	strcpy(name + n, ".blob");
+	bc->fd = open(name, O_RDWR | O_CREAT | O_BINARY, 0644);
+	if (bc->fd < 0) {
+		ret = -errno;
+		erofs_err("failed to open blob cache %s: %s", name,
+			  erofs_strerror(ret));
+		return ret;
+	}
+	ret = erofs_blobcache_load_map(bc);
+	if (ret)
+		erofs_err("failed to initialize blob cache %s: %s", name,
+			  erofs_strerror(ret));
+	return ret;
+}
+
+struct erofs_blobcache *erofs_blobcache_open(const char *uri,
+					     const char *cachedir)
+{
+	const struct erofs_blobsrc_ops *ops = erofs_blobsrc_find(uri);
+	struct erofs_blobcache *bc;
+	size_t mapsize;
+	int ret;
+
+	if (!ops) {
+		erofs_err("unsupported blob source %s", uri);
+		return ERR_PTR(-EOPNOTSUPP);
+	}
+
+	bc = calloc(1, sizeof(*bc));
+	if (!bc)
+		return ERR_PTR(-ENOMEM);
+	bc->fd = bc->mapfd = -1;
+	bc->src.ops = ops;
+	ret = ops->open(&bc->src, uri + strlen(ops->scheme));
+	if (ret) {
+		erofs_err("failed to open blob source %s: %s", uri,
+			  erofs_strerror(ret));
+		free(bc);
+		return ERR_PTR(ret);
+	}
+
+	bc->chunkbits = EROFS_BLOBCACHE_CHUNKBITS;
+	bc->nchunks = DIV_ROUND_UP(bc->src.size, 1ULL << bc->chunkbits);
+	mapsize = erofs_blobcache_mapsize(bc);
+	bc->present = calloc(1, mapsize ? mapsize : 1);
+	bc->busy = calloc(1, mapsize ? mapsize : 1);
+	if (!bc->present || !bc->busy) {
+		ret = -ENOMEM;
+		goto err_out;
+	}
+
+	if (cachedir)
+		ret = erofs_blobcache_open_dir(bc, uri, cachedir);
+	else
+		ret = erofs_blobcache_open_tmp(bc);
+	if (ret)
+		goto err_out;
+
+	/* missing chunks are holes until they are fetched */
+	if (ftruncate(bc->fd, bc->src.size)) {
+		ret = -errno;
+		goto err_out;
+	}
+	erofs_mutex_init(&bc->lock);
+	erofs_cond_init(&bc->wait);
+	return bc;
+err_out:
+	if (bc->mapfd >= 0)
+		close(bc->mapfd);
+	if (bc->fd >= 0)
+		close(bc->fd);
+	free(bc->present);
+	free(bc->busy);
+	ops->close(&bc->src);
+	free(bc);
+	return ERR_PTR(ret);
+}
+
+int erofs_blobcache_fd(struct erofs_blobcache *bc)
+{
+	return bc->fd;
+}
+
+/* fetch chunks [@first, @last) from the source into the local file */
+static int erofs_blobcache_fetch(struct erofs_blobcache *bc,
+				 u64 first, u64 last)
+{
+	u64 pos = first << bc->chunkbits;
+	size_t len = min(last << bc->chunkbits, bc->src.size) - pos;
+	void *buf = malloc(len);
+	int ret;
+
+	if (!buf)
+		return -ENOMEM;
+
+	erofs_dbg("fetching chunks %llu-%llu", first | 0ULL, (last - 1) | 0ULL);
+	erofs_stats_add(EROFS_STAT_BLOBCACHE_FETCH_BYTES, len);
+	ret = bc->src.ops->read(&bc->src, buf, pos, len);
+	if (ret) {
+		erofs_err("failed to fetch blob range %llu+%zu: %s",
+			  pos | 0ULL, len, erofs_strerror(ret));
+		goto out;
+	}
+	if (pwrite(bc->fd, buf, len, pos) != (ssize_t)len) {
+		ret = errno ? -errno : -ENOSPC;
+		erofs_err("failed to write blob cache: %s",
+			  erofs_strerror(ret));
+	}
+out:
+	free(buf);
+	return ret;
+}
+
+/*
+ * Persist the presence bits of chunks [@first, @last).  They're only
+ * written after the data, so a killed process can't leave a chunk marked
+ * without its data (unless the whole host crashes.)
+ */
+static void erofs_blobcache_sync_map(struct erofs_blobcache *bc,
+				     u64 first, u64 last)
+{
+	size_t start = first / BITS_PER_BYTE;
+	size_t end = (last - 1) / BITS_PER_BYTE + 1;
+
+	if (bc->mapfd < 0)
+		return;
+	if (pwrite(bc->mapfd, bc->present + start, end - start,
+		   sizeof(struct erofs_blobcache_hdr) + start) !=
+			(ssize_t)(end - start))
+		erofs_warn("failed to update blob cache bitmap: %s",
+			   erofs_strerror(-errno));
+}
+
+/*
+ * Make sure that all chunks covering [@offset, @offset + @len) are in the
+ * local file.  Only missing chunks are fetched, and the caller just waits
+ * for other threads if they're fetching some of them already.
+ */
+int erofs_blobcache_fill(struct erofs_blobcache *bc, u64 offset, size_t len)
+{
+	u64 end = min_t(u64, offset + len, bc->src.size);
+	u64 nr, last, run, i;
+	bool hit = true;
+	int ret = 0;
+
+	if (offset >= end)
+		return 0;
+	nr = offset >> bc->chunkbits;
+	last = DIV_ROUND_UP(end, 1ULL << bc->chunkbits);
+
+	erofs_mutex_lock(&bc->lock);
+	while (nr < last) {
+		if (erofs_blobcache_test(bc->present, nr)) {
+			++nr;
+			continue;
+		}
+		hit = false;
+		if (erofs_blobcache_test(bc->busy, nr)) {
+			erofs_cond_wait(&bc->wait, &bc->lock);
+			continue;
+		}
+
+		/* claim the following missing chunks nobody else is fetching */
+		for (run = nr; run < last &&
+		     run - nr < EROFS_BLOBCACHE_MAX_RUN &&
+		     !erofs_blobcache_test(bc->present, run) &&
+		     !erofs_blobcache_test(bc->busy, run); ++run)
+			erofs_blobcache_set(bc->busy, run, true);
+		erofs_mutex_unlock(&bc->lock);
+
+		ret = erofs_blobcache_fetch(bc, nr, run);
+
+		erofs_mutex_lock(&bc->lock);
+		for (i = nr; i < run; ++i) {
+			erofs_blobcache_set(bc->busy, i, false);
+			if (!ret)
+				erofs_blobcache_set(bc->present, i, true);
+		}
+		if (!ret)
+			erofs_blobcache_sync_map(bc, nr, run);
+		erofs_cond_broadcast(&bc->wait);
+		if (ret)
+			break;
+		nr = run;
+	}
+	erofs_mutex_unlock(&bc->lock);
+	erofs_stats_add(hit ? EROFS_STAT_BLOBCACHE_HIT :
+			EROFS_STAT_BLOBCACHE_MISS, 1);
+	return ret;
+}
+
+void erofs_blobcache_close(struct erofs_blobcache *bc)
+{
+	if (bc->mapfd >= 0)
+		close(bc->mapfd);
+	close(bc->fd);
+	bc->src.ops->close(&bc->src);
+	erofs_cond_destroy(&bc->wait);
+	erofs_mutex_destroy(&bc->lock);
+	free(bc->present);
+	free(bc->busy);
+	free(bc);
+}
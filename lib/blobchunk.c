@@ -287,7 +287,7 @@ int erofs_blob_remap(void)
 	pos_in = 0;
 	remapped_base = erofs_blknr(pos_out);
 	ret = erofs_copy_file_range(fileno(blobfile), &pos_in,
-				    erofs_devfd, &pos_out, length);
+				    sbi.devfd, &pos_out, length);
 	bh->op = &erofs_drop_directly_bhops;
 	erofs_bdrop(bh, false);
 	return ret < length ? -EIO : 0;
@@ -337,6 +337,6 @@ int erofs_generate_devtable(void)
 	bh_devt->op = &erofs_skip_write_bhops;
 	sbi.devt_slotoff = erofs_btell(bh_devt, false) / EROFS_DEVT_SLOT_SIZE;
 	sbi.extra_devices = 1;
-	erofs_sb_set_device_table();
+	erofs_sb_set_device_table(&sbi);
 	return 0;
 }
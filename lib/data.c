@@ -9,6 +9,10 @@
 #include "erofs/io.h"
 #include "erofs/trace.h"
 #include "erofs/decompress.h"
+#include "erofs/stats.h"
+#ifdef EROFS_MT_ENABLED
+#include "erofs/workqueue.h"
+#endif
 
 static int erofs_map_blocks_flatmode(struct erofs_inode *inode,
 				     struct erofs_map_blocks *map,
@@ -33,7 +37,7 @@ static int erofs_map_blocks_flatmode(struct erofs_inode *inode,
 		map->m_plen = blknr_to_addr(lastblk) - offset;
 	} else if (tailendpacking) {
 		/* 2 - inode inline B: inode, [xattrs], inline last blk... */
-		map->m_pa = iloc(vi->nid) + vi->inode_isize +
+		map->m_pa = iloc(vi->sbi, vi->nid) + vi->inode_isize +
 			vi->xattr_isize + erofs_blkoff(map->m_la);
 		map->m_plen = inode->i_size - offset;
 
@@ -67,6 +71,7 @@ int erofs_map_blocks(struct erofs_inode *inode,
 	struct erofs_inode *vi = inode;
 	struct erofs_inode_chunk_index *idx;
 	u8 buf[EROFS_BLKSIZ];
+	const void *ptr;
 	u64 chunknr;
 	unsigned int unit;
 	erofs_off_t pos;
@@ -89,12 +94,16 @@ int erofs_map_blocks(struct erofs_inode *inode,
 		unit = EROFS_BLOCK_MAP_ENTRY_SIZE;	/* block map */
 
 	chunknr = map->m_la >> vi->u.chunkbits;
-	pos = roundup(iloc(vi->nid) + vi->inode_isize +
+	pos = roundup(iloc(vi->sbi, vi->nid) + vi->inode_isize +
 		      vi->xattr_isize, unit) + unit * chunknr;
 
-	err = blk_read(0, buf, erofs_blknr(pos), 1);
-	if (err < 0)
-		return -EIO;
+	ptr = dev_mmap_ptr(vi->sbi, 0, pos, unit);
+	if (!ptr) {
+		err = blk_read(vi->sbi, 0, buf, erofs_blknr(pos), 1);
+		if (err < 0)
+			return -EIO;
+		ptr = buf + erofs_blkoff(pos);
+	}
 
 	map->m_la = chunknr << vi->u.chunkbits;
 	map->m_plen = min_t(erofs_off_t, 1UL << vi->u.chunkbits,
@@ -102,7 +111,7 @@ int erofs_map_blocks(struct erofs_inode *inode,
 
 	/* handle block map */
 	if (!(vi->u.chunkformat & EROFS_CHUNK_FORMAT_INDEXES)) {
-		__le32 *blkaddr = (void *)buf + erofs_blkoff(pos);
+		const __le32 *blkaddr = ptr;
 
 		if (le32_to_cpu(*blkaddr) == EROFS_NULL_ADDR) {
 			map->m_flags = 0;
@@ -113,14 +122,14 @@ int erofs_map_blocks(struct erofs_inode *inode,
 		goto out;
 	}
 	/* parse chunk indexes */
-	idx = (void *)buf + erofs_blkoff(pos);
+	idx = (void *)ptr;
 	switch (le32_to_cpu(idx->blkaddr)) {
 	case EROFS_NULL_ADDR:
 		map->m_flags = 0;
 		break;
 	default:
 		map->m_deviceid = le16_to_cpu(idx->device_id) &
-			sbi.device_id_mask;
+			vi->sbi->device_id_mask;
 		map->m_pa = blknr_to_addr(le32_to_cpu(idx->blkaddr));
 		map->m_flags = EROFS_MAP_MAPPED;
 		break;
@@ -158,8 +167,8 @@ int erofs_map_dev(struct erofs_sb_info *sbi, struct erofs_map_dev *map)
 	return 0;
 }
 
-int erofs_read_one_data(struct erofs_map_blocks *map, char *buffer, u64 offset,
-			size_t len)
+int erofs_read_one_data(struct erofs_inode *inode, struct erofs_map_blocks *map,
+			char *buffer, u64 offset, size_t len)
 {
 	struct erofs_map_dev mdev;
 	int ret;
@@ -168,11 +177,12 @@ int erofs_read_one_data(struct erofs_map_blocks *map, char *buffer, u64 offset,
 		.m_deviceid = map->m_deviceid,
 		.m_pa = map->m_pa,
 	};
-	ret = erofs_map_dev(&sbi, &mdev);
+	ret = erofs_map_dev(inode->sbi, &mdev);
 	if (ret)
 		return ret;
 
-	ret = dev_read(mdev.m_deviceid, buffer, mdev.m_pa + offset, len);
+	ret = dev_read(inode->sbi, mdev.m_deviceid, buffer,
+		       mdev.m_pa + offset, len);
 	if (ret < 0)
 		return -EIO;
 	return 0;
@@ -219,7 +229,8 @@ static int erofs_read_raw_data(struct erofs_inode *inode, char *buffer,
 			map.m_la = ptr;
 		}
 
-		ret = erofs_read_one_data(&map, estart, moff, eend - map.m_la);
+		ret = erofs_read_one_data(inode, &map, estart, moff,
+					  eend - map.m_la);
 		if (ret)
 			return ret;
 		ptr = eend;
@@ -232,39 +243,64 @@ int z_erofs_read_one_data(struct erofs_inode *inode,
 			erofs_off_t skip, erofs_off_t length, bool trimmed)
 {
 	struct erofs_map_dev mdev;
+	const char *in;
 	int ret = 0;
 
 	if (map->m_flags & EROFS_MAP_FRAGMENT) {
-		struct erofs_inode packed_inode = {
-			.nid = sbi.packed_nid,
-		};
+		struct erofs_inode *packed_inode =
+			erofs_icache_get(inode->sbi, inode->sbi->packed_nid);
 
-		ret = erofs_read_inode_from_disk(&packed_inode);
-		if (ret) {
+		if (IS_ERR(packed_inode)) {
 			erofs_err("failed to read packed inode from disk");
-			return ret;
+			return PTR_ERR(packed_inode);
 		}
 
-		return erofs_pread(&packed_inode, buffer, length - skip,
-				   inode->fragmentoff + skip);
+		ret = erofs_pread(packed_inode, buffer, length - skip,
+				  inode->fragmentoff + skip);
+		erofs_icache_put(packed_inode);
+		return ret;
 	}
 
 	/* no device id here, thus it will always succeed */
 	mdev = (struct erofs_map_dev) {
 		.m_pa = map->m_pa,
 	};
-	ret = erofs_map_dev(&sbi, &mdev);
+	ret = erofs_map_dev(inode->sbi, &mdev);
 	if (ret) {
 		DBG_BUGON(1);
 		return ret;
 	}
 
-	ret = dev_read(mdev.m_deviceid, raw, mdev.m_pa, map->m_plen);
-	if (ret < 0)
-		return ret;
+	/* decompress straight from the mapping if possible */
+	in = dev_mmap_ptr(inode->sbi, mdev.m_deviceid, mdev.m_pa, map->m_plen);
+	if (!in) {
+		/* use the per-thread buffer if the caller doesn't give one */
+		if (!raw) {
+			raw = erofs_get_scratch(EROFS_SCRATCH_RAW, map->m_plen);
+			if (!raw)
+				return -ENOMEM;
+		}
+		ret = dev_read(inode->sbi, mdev.m_deviceid, raw, mdev.m_pa,
+			       map->m_plen);
+		if (ret < 0)
+			return ret;
+		in = raw;
+	}
+	return z_erofs_decompress_one_data(inode, map, in, buffer, skip,
+					   length, trimmed);
+}
+
+/* decompress a pcluster whose compressed data is already at @in */
+int z_erofs_decompress_one_data(struct erofs_inode *inode,
+			struct erofs_map_blocks *map, const char *in,
+			char *buffer, erofs_off_t skip, erofs_off_t length,
+			bool trimmed)
+{
+	int ret;
 
 	ret = z_erofs_decompress(&(struct z_erofs_decompress_req) {
-			.in = raw,
+			.sbi = inode->sbi,
+			.in = (char *)in,
 			.out = buffer,
 			.decodedskip = skip,
 			.interlaced_offset =
@@ -282,6 +318,232 @@ int z_erofs_read_one_data(struct erofs_inode *inode,
 	return 0;
 }
 
+#ifdef EROFS_MT_ENABLED
+/* reads smaller than this are always decompressed by the caller */
+#define Z_EROFS_PARALLEL_READ_MIN	(128 * 1024)
+
+static struct erofs_workqueue z_erofs_read_wq;
+
+struct z_erofs_read_extent {
+	erofs_off_t la, pa;
+	u64 llen, plen;
+	unsigned int flags;
+	unsigned short deviceid;
+	unsigned char algorithmformat;
+};
+
+struct z_erofs_read_batch {
+	struct erofs_inode *inode;
+	char *buffer;
+	erofs_off_t offset, end;
+	struct z_erofs_read_extent *extents;
+
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	unsigned int pending;
+	int err;
+};
+
+struct z_erofs_read_work {
+	struct erofs_work work;
+	struct z_erofs_read_batch *batch;
+	unsigned int first, last;
+};
+
+int z_erofs_read_workers_init(unsigned int nr_workers)
+{
+	if (z_erofs_read_wq.thread_count)
+		return -EBUSY;
+	return erofs_workqueue_create(&z_erofs_read_wq, nr_workers, 0);
+}
+
+void z_erofs_read_workers_exit(void)
+{
+	if (!z_erofs_read_wq.thread_count)
+		return;
+	erofs_workqueue_terminate(&z_erofs_read_wq);
+	erofs_workqueue_destroy(&z_erofs_read_wq);
+	z_erofs_read_wq.thread_count = 0;
+}
+
+/* decompress extents [first, last) of a batch into their own output slices */
+static int z_erofs_read_extents(struct z_erofs_read_batch *b,
+				unsigned int first, unsigned int last)
+{
+	struct erofs_map_blocks map = {
+		.index = UINT_MAX,
+	};
+	unsigned int i;
+	int ret;
+
+	for (i = first; i < last; ++i) {
+		struct z_erofs_read_extent *e = b->extents + i;
+		erofs_off_t length, skip;
+		bool trimmed;
+
+		if (b->end < e->la + e->llen) {
+			length = b->end - e->la;
+			trimmed = true;
+		} else {
+			length = e->llen;
+			trimmed = false;
+		}
+		skip = b->offset > e->la ? b->offset - e->la : 0;
+
+		if (!(e->flags & EROFS_MAP_MAPPED)) {
+			memset(b->buffer + e->la + skip - b->offset, 0,
+			       length - skip);
+			continue;
+		}
+
+		map.m_la = e->la;
+		map.m_llen = e->llen;
+		map.m_pa = e->pa;
+		map.m_plen = e->plen;
+		map.m_flags = e->flags;
+		map.m_deviceid = e->deviceid;
+		map.m_algorithmformat = e->algorithmformat;
+		ret = z_erofs_read_one_data(b->inode, &map, NULL,
+				b->buffer + e->la + skip - b->offset,
+				skip, length, trimmed);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+static void z_erofs_read_batch_done(struct z_erofs_read_batch *b, int ret)
+{
+	pthread_mutex_lock(&b->lock);
+	if (ret && !b->err)
+		b->err = ret;
+	if (!--b->pending)
+		pthread_cond_signal(&b->done);
+	pthread_mutex_unlock(&b->lock);
+}
+
+static void z_erofs_read_worker(struct erofs_workqueue *wq,
+				struct erofs_work *work)
+{
+	struct z_erofs_read_work *rw =
+		container_of(work, struct z_erofs_read_work, work);
+
+	z_erofs_read_batch_done(rw->batch,
+		z_erofs_read_extents(rw->batch, rw->first, rw->last));
+}
+
+/*
+ * Map all extents covered by a large read first, then split them into
+ * contiguous runs which are decompressed concurrently by the read workers
+ * and the caller itself.  Each run writes its own part of @buffer only.
+ */
+static int z_erofs_read_data_parallel(struct erofs_inode *inode, char *buffer,
+				      erofs_off_t size, erofs_off_t offset)
+{
+	struct z_erofs_read_batch b = {
+		.inode = inode,
+		.buffer = buffer,
+		.offset = offset,
+		.end = min_t(erofs_off_t, offset + size, inode->i_size),
+	};
+	struct erofs_map_blocks map = {
+		.index = UINT_MAX,
+	};
+	struct z_erofs_read_work *works;
+	unsigned int nr = 0, max = 0, nr_works, i;
+	erofs_off_t la = offset;
+	int ret;
+
+	/* data beyond EOF reads as zeroes */
+	if (offset + size > b.end)
+		memset(buffer + b.end - offset, 0, offset + size - b.end);
+
+	while (la < b.end) {
+		map.m_la = la;
+		ret = z_erofs_map_blocks_iter(inode, &map,
+					      EROFS_GET_BLOCKS_FIEMAP);
+		if (ret)
+			goto out;
+		if (!map.m_llen) {
+			DBG_BUGON(1);
+			ret = -EFSCORRUPTED;
+			goto out;
+		}
+
+		if (nr >= max) {
+			struct z_erofs_read_extent *e;
+
+			max = max ? max << 1 : 16;
+			e = realloc(b.extents, max * sizeof(*e));
+			if (!e) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			b.extents = e;
+		}
+		b.extents[nr++] = (struct z_erofs_read_extent) {
+			.la = map.m_la,
+			.llen = map.m_llen,
+			.pa = map.m_pa,
+			.plen = map.m_plen,
+			.flags = map.m_flags,
+			.deviceid = map.m_deviceid,
+			.algorithmformat = map.m_algorithmformat,
+		};
+		la = map.m_la + map.m_llen;
+	}
+
+	nr_works = min(nr, z_erofs_read_wq.thread_count + 1);
+	if (nr_works <= 1) {
+		ret = z_erofs_read_extents(&b, 0, nr);
+		goto out;
+	}
+
+	works = calloc(nr_works - 1, sizeof(*works));
+	if (!works) {
+		ret = z_erofs_read_extents(&b, 0, nr);
+		goto out;
+	}
+
+	pthread_mutex_init(&b.lock, NULL);
+	pthread_cond_init(&b.done, NULL);
+	b.pending = nr_works - 1;
+	for (i = 1; i < nr_works; ++i) {
+		struct z_erofs_read_work *rw = works + i - 1;
+
+		rw->batch = &b;
+		rw->first = (u64)nr * i / nr_works;
+		rw->last = (u64)nr * (i + 1) / nr_works;
+		rw->work.function = z_erofs_read_worker;
+		ret = erofs_workqueue_add(&z_erofs_read_wq, &rw->work);
+		if (ret)
+			z_erofs_read_worker(&z_erofs_read_wq, &rw->work);
+	}
+	/* the caller handles the first run rather than sitting idle */
+	ret = z_erofs_read_extents(&b, 0, nr / nr_works);
+
+	pthread_mutex_lock(&b.lock);
+	while (b.pending)
+		pthread_cond_wait(&b.done, &b.lock);
+	pthread_mutex_unlock(&b.lock);
+	if (!ret)
+		ret = b.err;
+	pthread_cond_destroy(&b.done);
+	pthread_mutex_destroy(&b.lock);
+	free(works);
+out:
+	free(b.extents);
+	return ret;
+}
+#else
+int z_erofs_read_workers_init(unsigned int nr_workers)
+{
+	return -EOPNOTSUPP;
+}
+
+void z_erofs_read_workers_exit(void) {}
+#endif
+
 static int z_erofs_read_data(struct erofs_inode *inode, char *buffer,
 			     erofs_off_t size, erofs_off_t offset)
 {
@@ -290,10 +552,17 @@ static int z_erofs_read_data(struct erofs_inode *inode, char *buffer,
 		.index = UINT_MAX,
 	};
 	bool trimmed;
-	unsigned int bufsize = 0;
-	char *raw = NULL;
 	int ret = 0;
 
+#ifdef EROFS_MT_ENABLED
+	/*
+	 * fragments are read from the packed inode by the workers themselves,
+	 * so never dispatch those again in order to avoid waiting on ourselves.
+	 */
+	if (z_erofs_read_wq.thread_count && size >= Z_EROFS_PARALLEL_READ_MIN &&
+	    inode->nid != inode->sbi->packed_nid)
+		return z_erofs_read_data_parallel(inode, buffer, size, offset);
+#endif
 	end = offset + size;
 	while (end > offset) {
 		map.m_la = end - 1;
@@ -329,28 +598,156 @@ static int z_erofs_read_data(struct erofs_inode *inode, char *buffer,
 			continue;
 		}
 
-		if (map.m_plen > bufsize) {
-			bufsize = map.m_plen;
-			raw = realloc(raw, bufsize);
-			if (!raw) {
-				ret = -ENOMEM;
-				break;
-			}
-		}
-
-		ret = z_erofs_read_one_data(inode, &map, raw,
+		ret = z_erofs_read_one_data(inode, &map, NULL,
 				buffer + end - offset, skip, length, trimmed);
 		if (ret < 0)
 			break;
 	}
-	if (raw)
-		free(raw);
 	return ret < 0 ? ret : 0;
 }
 
+#define EROFS_RA_MIN_WINDOW	(128 * 1024)
+#define EROFS_RA_MAX_WINDOW	(4 * 1024 * 1024)
+#define EROFS_RA_MAX_INDEX	(1024 * 1024)
+
+/* prefetch the index area (chunk or lcluster indexes) of a file */
+static void erofs_readahead_indexes(struct erofs_inode *inode)
+{
+	erofs_off_t pos = iloc(inode->sbi, inode->nid) + inode->inode_isize +
+		inode->xattr_isize;
+	u64 len;
+
+	if (inode->datalayout == EROFS_INODE_CHUNK_BASED) {
+		len = BLK_ROUND_UP(inode->i_size) >>
+			(inode->u.chunkbits - LOG_BLOCK_SIZE);
+		len *= sizeof(struct erofs_inode_chunk_index);
+	} else if (erofs_inode_is_data_compressed(inode->datalayout)) {
+		/* an upper bound for both legacy and compacted indexes */
+		len = Z_EROFS_VLE_LEGACY_INDEX_ALIGN(pos) - pos +
+			BLK_ROUND_UP(inode->i_size) *
+			sizeof(struct z_erofs_vle_decompressed_index);
+	} else {
+		return;
+	}
+	dev_readahead(inode->sbi, 0, pos, min_t(u64, len, EROFS_RA_MAX_INDEX));
+}
+
+/*
+ * Call @fn on each on-disk range which backs [@start, @end) of the file.
+ * Inline data is skipped since it's read together with the metadata, and
+ * pclusters are always passed as a whole.
+ */
+int erofs_iterate_extents(struct erofs_inode *inode, erofs_off_t start,
+			  erofs_off_t end, erofs_extent_fn_t fn, void *priv)
+{
+	bool compressed = erofs_inode_is_data_compressed(inode->datalayout);
+	struct erofs_map_blocks map = {
+		.index = UINT_MAX,
+	};
+	struct erofs_map_dev mdev;
+	erofs_off_t la = start, skip, len;
+	int ret;
+
+	while (la < end) {
+		map.m_la = la;
+		if (compressed)
+			ret = z_erofs_map_blocks_iter(inode, &map,
+						      EROFS_GET_BLOCKS_FIEMAP);
+		else
+			ret = erofs_map_blocks(inode, &map, 0);
+		if (ret)
+			return ret;
+		if (!map.m_llen)
+			return 0;
+		la = map.m_la + map.m_llen;
+
+		if (!(map.m_flags & EROFS_MAP_MAPPED) ||
+		    (map.m_flags & (EROFS_MAP_META | EROFS_MAP_FRAGMENT)))
+			continue;
+
+		mdev = (struct erofs_map_dev) {
+			.m_deviceid = map.m_deviceid,
+			.m_pa = map.m_pa,
+		};
+		ret = erofs_map_dev(inode->sbi, &mdev);
+		if (ret)
+			return ret;
+
+		skip = 0;
+		len = map.m_plen;
+		if (!compressed && map.m_la < start) {
+			skip = start - map.m_la;
+			if (skip >= len)
+				continue;
+			len -= skip;
+		}
+		if (!compressed && len > end - map.m_la - skip)
+			len = end - map.m_la - skip;
+		ret = fn(inode->sbi, mdev.m_deviceid, mdev.m_pa + skip, len,
+			 priv);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int erofs_readahead_extent(struct erofs_sb_info *sbi, int device_id,
+				  u64 offset, size_t len, void *priv)
+{
+	dev_readahead(sbi, device_id, offset, len);
+	return 0;
+}
+
+/*
+ * Detect sequential streams and prefetch the data following the current
+ * read (and the index blocks needed to map it) into the page cache in
+ * the background.  The window doubles each time a stream keeps going
+ * and is reset on random access.  Reads which start within the current
+ * window count as sequential too, since concurrent (e.g. async FUSE)
+ * reads of a stream can arrive slightly out of order.  Callers sharing
+ * @ra between threads have to serialize calls.
+ */
+void erofs_readahead(struct erofs_inode *inode, struct erofs_readahead *ra,
+		     erofs_off_t offset, erofs_off_t count)
+{
+	erofs_off_t end = min(offset + count, inode->i_size), start;
+
+	if (offset != ra->next &&
+	    !(ra->window && offset < ra->end &&
+	      offset + ra->window >= ra->next)) {
+		ra->next = end;
+		ra->end = 0;
+		ra->window = 0;
+		return;
+	}
+	ra->next = max(ra->next, end);
+	end = ra->next;
+
+	if (!ra->window) {
+		ra->window = EROFS_RA_MIN_WINDOW;
+		erofs_readahead_indexes(inode);
+	} else if (ra->end > end + ra->window / 2) {
+		/* still well ahead of the reader */
+		return;
+	} else {
+		ra->window = min_t(unsigned int, ra->window << 1,
+				   EROFS_RA_MAX_WINDOW);
+	}
+
+	start = max(ra->end, end);
+	end = min(end + ra->window, inode->i_size);
+	if (start >= end)
+		return;
+	erofs_iterate_extents(inode, start, end, erofs_readahead_extent, NULL);
+	ra->end = end;
+}
+
 int erofs_pread(struct erofs_inode *inode, char *buf,
 		erofs_off_t count, erofs_off_t offset)
 {
+	erofs_stats_add(EROFS_STAT_PREAD, 1);
+	erofs_stats_add(EROFS_STAT_PREAD_BYTES, count);
+
 	switch (inode->datalayout) {
 	case EROFS_INODE_FLAT_PLAIN:
 	case EROFS_INODE_FLAT_INLINE:
@@ -8,18 +8,65 @@
 #include "erofs/decompress.h"
 #include "erofs/err.h"
 #include "erofs/print.h"
+#include "erofs/stats.h"
 
 #ifdef HAVE_LIBLZMA
 #include <lzma.h>
 
+/*
+ * Keep one lzma_stream per thread: re-initializing a used stream makes
+ * liblzma reuse the decoder state and the dictionary buffer instead of
+ * allocating (and faulting in) them again for every pcluster.
+ */
+#ifdef EROFS_MT_ENABLED
+static pthread_key_t z_erofs_lzma_key;
+static pthread_once_t z_erofs_lzma_once = PTHREAD_ONCE_INIT;
+
+static void z_erofs_lzma_free(void *ptr)
+{
+	lzma_end(ptr);
+	free(ptr);
+}
+
+static void z_erofs_lzma_init(void)
+{
+	pthread_key_create(&z_erofs_lzma_key, z_erofs_lzma_free);
+}
+
+static lzma_stream *z_erofs_lzma_get_stream(void)
+{
+	lzma_stream *strm;
+
+	pthread_once(&z_erofs_lzma_once, z_erofs_lzma_init);
+	strm = pthread_getspecific(z_erofs_lzma_key);
+	if (!strm) {
+		strm = malloc(sizeof(*strm));
+		if (!strm)
+			return NULL;
+		*strm = (lzma_stream)LZMA_STREAM_INIT;
+		if (pthread_setspecific(z_erofs_lzma_key, strm)) {
+			free(strm);
+			return NULL;
+		}
+	}
+	return strm;
+}
+#else
+static lzma_stream z_erofs_lzma_stream = LZMA_STREAM_INIT;
+
+static lzma_stream *z_erofs_lzma_get_stream(void)
+{
+	return &z_erofs_lzma_stream;
+}
+#endif
+
 static int z_erofs_decompress_lzma(struct z_erofs_decompress_req *rq)
 {
 	int ret = 0;
 	u8 *dest = (u8 *)rq->out;
 	u8 *src = (u8 *)rq->in;
-	u8 *buff = NULL;
 	unsigned int inputmargin = 0;
-	lzma_stream strm;
+	lzma_stream *strm;
 	lzma_ret ret2;
 
 	while (!src[inputmargin & ~PAGE_MASK])
@@ -30,28 +77,31 @@ static int z_erofs_decompress_lzma(struct z_erofs_decompress_req *rq)
 		return -EFSCORRUPTED;
 
 	if (rq->decodedskip) {
-		buff = malloc(rq->decodedlength);
-		if (!buff)
+		dest = erofs_get_scratch(EROFS_SCRATCH_DECOMPRESS,
+					 rq->decodedlength);
+		if (!dest)
 			return -ENOMEM;
-		dest = buff;
 	}
 
-	strm = (lzma_stream)LZMA_STREAM_INIT;
-	strm.next_in = src + inputmargin;
-	strm.avail_in = rq->inputsize - inputmargin;
-	strm.next_out = dest;
-	strm.avail_out = rq->decodedlength;
+	strm = z_erofs_lzma_get_stream();
+	if (!strm)
+		return -ENOMEM;
 
-	ret2 = lzma_microlzma_decoder(&strm, strm.avail_in, rq->decodedlength,
-				      !rq->partial_decoding,
+	ret2 = lzma_microlzma_decoder(strm, rq->inputsize - inputmargin,
+				      rq->decodedlength, !rq->partial_decoding,
 				      Z_EROFS_LZMA_MAX_DICT_SIZE);
 	if (ret2 != LZMA_OK) {
 		erofs_err("fail to initialize lzma decoder %u", ret2 | 0U);
 		ret = -EFAULT;
-		goto out;
+		goto out_lzma_end;
 	}
 
-	ret2 = lzma_code(&strm, LZMA_FINISH);
+	strm->next_in = src + inputmargin;
+	strm->avail_in = rq->inputsize - inputmargin;
+	strm->next_out = dest;
+	strm->avail_out = rq->decodedlength;
+
+	ret2 = lzma_code(strm, LZMA_FINISH);
 	if (ret2 != LZMA_STREAM_END) {
 		ret = -EFSCORRUPTED;
 		goto out_lzma_end;
@@ -60,12 +110,12 @@ static int z_erofs_decompress_lzma(struct z_erofs_decompress_req *rq)
 	if (rq->decodedskip)
 		memcpy(rq->out, dest + rq->decodedskip,
 		       rq->decodedlength - rq->decodedskip);
+	return 0;
 
 out_lzma_end:
-	lzma_end(&strm);
-out:
-	if (buff)
-		free(buff);
+	/* start over with a clean stream after errors */
+	lzma_end(strm);
+	*strm = (lzma_stream)LZMA_STREAM_INIT;
 	return ret;
 }
 #endif
@@ -78,11 +128,10 @@ static int z_erofs_decompress_lz4(struct z_erofs_decompress_req *rq)
 	int ret = 0;
 	char *dest = rq->out;
 	char *src = rq->in;
-	char *buff = NULL;
 	bool support_0padding = false;
 	unsigned int inputmargin = 0;
 
-	if (erofs_sb_has_lz4_0padding()) {
+	if (erofs_sb_has_lz4_0padding(rq->sbi)) {
 		support_0padding = true;
 
 		while (!src[inputmargin & ~PAGE_MASK])
@@ -94,12 +143,16 @@ static int z_erofs_decompress_lz4(struct z_erofs_decompress_req *rq)
 	}
 
 	if (rq->decodedskip) {
-		buff = malloc(rq->decodedlength);
-		if (!buff)
+		dest = erofs_get_scratch(EROFS_SCRATCH_DECOMPRESS,
+					 rq->decodedlength);
+		if (!dest)
 			return -ENOMEM;
-		dest = buff;
 	}
 
+	/*
+	 * partial requests decode just the needed prefix of the pcluster;
+	 * otherwise decode it all to check that the input is consumed.
+	 */
 	if (rq->partial_decoding || !support_0padding)
 		ret = LZ4_decompress_safe_partial(src + inputmargin, dest,
 				rq->inputsize - inputmargin,
@@ -122,14 +175,11 @@ static int z_erofs_decompress_lz4(struct z_erofs_decompress_req *rq)
 		       rq->decodedlength - rq->decodedskip);
 
 out:
-	if (buff)
-		free(buff);
-
 	return ret;
 }
 #endif
 
-int z_erofs_decompress(struct z_erofs_decompress_req *rq)
+static int __z_erofs_decompress(struct z_erofs_decompress_req *rq)
 {
 	if (rq->alg == Z_EROFS_COMPRESSION_INTERLACED) {
 		unsigned int count, rightpart, skip;
@@ -166,3 +216,15 @@ int z_erofs_decompress(struct z_erofs_decompress_req *rq)
 #endif
 	return -EOPNOTSUPP;
 }
+
+int z_erofs_decompress(struct z_erofs_decompress_req *rq)
+{
+	u64 start = erofs_stats_now();
+	int ret = __z_erofs_decompress(rq);
+
+	if (start && !ret)
+		erofs_stats_add_decompress(rq->alg, rq->inputsize,
+					   rq->decodedlength - rq->decodedskip,
+					   erofs_stats_now() - start);
+	return ret;
+}
@@ -3,6 +3,7 @@
 #include <sys/stat.h>
 #include "erofs/print.h"
 #include "erofs/dir.h"
+#include "erofs/lock.h"
 
 static int traverse_dirents(struct erofs_dir_context *ctx,
 			    void *dentry_blk, unsigned int lblk,
@@ -32,6 +33,7 @@ static int traverse_dirents(struct erofs_dir_context *ctx,
 			de_namelen = le16_to_cpu(de[1].nameoff) - nameoff;
 
 		ctx->de_nid = le64_to_cpu(de->nid);
+		ctx->de_pos = blknr_to_addr(lblk) + ((void *)de - dentry_blk);
 		erofs_dbg("traversed nid (%llu)", ctx->de_nid | 0ULL);
 
 		ret = -EFSCORRUPTED;
@@ -63,6 +65,12 @@ static int traverse_dirents(struct erofs_dir_context *ctx,
 			break;
 		}
 
+		/* dirents before the position to resume from */
+		if (ctx->de_pos < ctx->pos) {
+			ret = 0;
+			goto skip;
+		}
+
 		ctx->dname = de_name;
 		ctx->de_namelen = de_namelen;
 		ctx->de_ftype = de->file_type;
@@ -76,8 +84,8 @@ static int traverse_dirents(struct erofs_dir_context *ctx,
 					goto out;
 				}
 				ctx->flags |= EROFS_READDIR_DOTDOT_FOUND;
-				if (sbi.root_nid == ctx->dir->nid) {
-					ctx->pnid = sbi.root_nid;
+				if (ctx->dir->sbi->root_nid == ctx->dir->nid) {
+					ctx->pnid = ctx->dir->nid;
 					ctx->flags |= EROFS_READDIR_VALID_PNID;
 				}
 				if (fsck &&
@@ -107,6 +115,7 @@ static int traverse_dirents(struct erofs_dir_context *ctx,
 			silent = true;
 			break;
 		}
+skip:
 		prev_name = de_name;
 		prev_namelen = de_namelen;
 		next_nameoff += de_namelen;
@@ -131,7 +140,7 @@ int erofs_iterate_dir(struct erofs_dir_context *ctx, bool fsck)
 		return -ENOTDIR;
 
 	ctx->flags &= ~EROFS_READDIR_ALL_SPECIAL_FOUND;
-	pos = 0;
+	pos = round_down(ctx->pos, EROFS_BLKSIZ);
 	while (pos < dir->i_size) {
 		erofs_blk_t lblk = erofs_blknr(pos);
 		erofs_off_t maxsize = min_t(erofs_off_t,
@@ -159,7 +168,8 @@ int erofs_iterate_dir(struct erofs_dir_context *ctx, bool fsck)
 		pos += maxsize;
 	}
 
-	if (fsck && (ctx->flags & EROFS_READDIR_ALL_SPECIAL_FOUND) !=
+	if (fsck && !ctx->pos &&
+	    (ctx->flags & EROFS_READDIR_ALL_SPECIAL_FOUND) !=
 			EROFS_READDIR_ALL_SPECIAL_FOUND) {
 		erofs_err("`.' or `..' dirent is missing @ nid %llu",
 			  dir->nid | 0ULL);
@@ -168,82 +178,358 @@ int erofs_iterate_dir(struct erofs_dir_context *ctx, bool fsck)
 	return err;
 }
 
-#define EROFS_PATHNAME_FOUND 1
+/*
+ * Reverse index of all dirents, sorted by nid, so that the path of any
+ * inode can be resolved by walking up its parents.  It's built once per
+ * filesystem on the first erofs_get_pathname() call.
+ */
+struct erofs_nid_entry {
+	erofs_nid_t nid, pnid;
+	/* position of the dirent in the parent directory */
+	erofs_off_t pos;
+};
 
-struct erofs_get_pathname_context {
+struct erofs_nid_index {
+	struct erofs_nid_entry *entries;
+	unsigned long count;
+};
+
+/* a directory found by the dirent at @pos of @pnid, to be indexed later */
+struct erofs_nid_index_dir {
+	erofs_nid_t nid, pnid;
+	erofs_off_t pos;
+	bool ftype_dir;
+};
+
+/*
+ * Directories are indexed level by level from a queue rather than by
+ * recursion, so that deep (or looping) trees of corrupted images can't
+ * overflow the stack.
+ */
+struct erofs_nid_index_builder {
 	struct erofs_dir_context ctx;
-	erofs_nid_t target_nid;
-	char *buf;
-	size_t size;
-	size_t pos;
+	struct erofs_sb_info *sbi;
+	struct erofs_nid_index *idx;
+	unsigned long max;
+	struct erofs_nid_index_dir *queue;
+	unsigned long qhead, qtail, qmax;
+	/* open-addressing set of directories indexed so far, as nid + 1 */
+	erofs_nid_t *seen;
+	unsigned long nr_seen, seen_mask;
+	/* the `..' dirent of the directory being indexed */
+	erofs_nid_t dotdot;
+	bool dotdot_found;
 };
 
-static int erofs_get_pathname_iter(struct erofs_dir_context *ctx)
+static erofs_mutex_t erofs_nid_index_lock = EROFS_MUTEX_INITIALIZER;
+
+static unsigned long erofs_nid_index_slot(struct erofs_nid_index_builder *b,
+					  erofs_nid_t nid)
 {
-	int ret;
-	struct erofs_get_pathname_context *pathctx = (void *)ctx;
-	const char *dname = ctx->dname;
-	size_t len = ctx->de_namelen;
-	size_t pos = pathctx->pos;
+	unsigned long i = (nid * 0x9e3779b97f4a7c15ULL) >> 16;
 
-	if (ctx->dot_dotdot)
-		return 0;
+	while (b->seen[i & b->seen_mask] &&
+	       b->seen[i & b->seen_mask] != nid + 1)
+		++i;
+	return i & b->seen_mask;
+}
 
-	if (ctx->de_nid == pathctx->target_nid) {
-		if (pos + len + 2 > pathctx->size) {
-			erofs_err("get_pathname buffer not large enough: len %zd, size %zd",
-				  pos + len + 2, pathctx->size);
-			return -ERANGE;
+static bool erofs_nid_index_seen(struct erofs_nid_index_builder *b,
+				 erofs_nid_t nid)
+{
+	return b->seen[erofs_nid_index_slot(b, nid)] == nid + 1;
+}
+
+static int erofs_nid_index_mark(struct erofs_nid_index_builder *b,
+				erofs_nid_t nid)
+{
+	if ((b->nr_seen + 1) * 2 > b->seen_mask + 1) {
+		unsigned long i, n = (b->seen_mask + 1) << 1;
+		erofs_nid_t *old = b->seen;
+		unsigned long mask = b->seen_mask;
+
+		b->seen = calloc(n, sizeof(*b->seen));
+		if (!b->seen) {
+			b->seen = old;
+			return -ENOMEM;
 		}
+		b->seen_mask = n - 1;
+		for (i = 0; i <= mask; ++i)
+			if (old[i])
+				b->seen[erofs_nid_index_slot(b, old[i] - 1)] =
+					old[i];
+		free(old);
+	}
+	b->seen[erofs_nid_index_slot(b, nid)] = nid + 1;
+	++b->nr_seen;
+	return 0;
+}
+
+static int erofs_nid_index_add(struct erofs_nid_index_builder *b,
+			       erofs_nid_t nid, erofs_nid_t pnid,
+			       erofs_off_t pos)
+{
+	struct erofs_nid_index *idx = b->idx;
 
-		pathctx->buf[pos++] = '/';
-		strncpy(pathctx->buf + pos, dname, len);
-		pathctx->buf[pos + len] = '\0';
-		return EROFS_PATHNAME_FOUND;
+	if (idx->count >= b->max) {
+		struct erofs_nid_entry *e;
+
+		b->max = b->max ? b->max << 1 : 1024;
+		e = realloc(idx->entries, b->max * sizeof(*e));
+		if (!e)
+			return -ENOMEM;
+		idx->entries = e;
 	}
+	idx->entries[idx->count++] = (struct erofs_nid_entry) {
+		.nid = nid,
+		.pnid = pnid,
+		.pos = pos,
+	};
+	return 0;
+}
 
-	if (ctx->de_ftype == EROFS_FT_DIR || ctx->de_ftype == EROFS_FT_UNKNOWN) {
-		struct erofs_inode dir = { .nid = ctx->de_nid };
+static int erofs_nid_index_iter(struct erofs_dir_context *ctx)
+{
+	struct erofs_nid_index_builder *b = (void *)ctx;
 
-		ret = erofs_read_inode_from_disk(&dir);
-		if (ret) {
-			erofs_err("read inode failed @ nid %llu", dir.nid | 0ULL);
-			return ret;
+	if (ctx->dot_dotdot) {
+		if (ctx->de_namelen == 2) {
+			b->dotdot = ctx->de_nid;
+			b->dotdot_found = true;
 		}
+		return 0;
+	}
 
-		if (S_ISDIR(dir.i_mode)) {
-			ctx->dir = &dir;
-			pathctx->pos = pos + len + 1;
-			ret = erofs_iterate_dir(ctx, false);
-			pathctx->pos = pos;
-			if (ret == EROFS_PATHNAME_FOUND) {
-				pathctx->buf[pos++] = '/';
-				strncpy(pathctx->buf + pos, dname, len);
-			}
-			return ret;
-		} else if (ctx->de_ftype == EROFS_FT_DIR) {
-			erofs_err("i_mode and file_type are inconsistent @ nid %llu",
-				  dir.nid | 0ULL);
-		}
+	if (ctx->de_ftype != EROFS_FT_DIR && ctx->de_ftype != EROFS_FT_UNKNOWN)
+		return erofs_nid_index_add(b, ctx->de_nid, ctx->dir->nid,
+					   ctx->de_pos);
+
+	/* directories are checked when they're taken from the queue */
+	if (erofs_nid_index_seen(b, ctx->de_nid))
+		return 0;
+	if (b->qtail >= b->qmax) {
+		struct erofs_nid_index_dir *q;
+
+		b->qmax = b->qmax ? b->qmax << 1 : 256;
+		q = realloc(b->queue, b->qmax * sizeof(*q));
+		if (!q)
+			return -ENOMEM;
+		b->queue = q;
 	}
+	b->queue[b->qtail++] = (struct erofs_nid_index_dir) {
+		.nid = ctx->de_nid,
+		.pnid = ctx->dir->nid,
+		.pos = ctx->de_pos,
+		.ftype_dir = ctx->de_ftype == EROFS_FT_DIR,
+	};
 	return 0;
 }
 
-int erofs_get_pathname(erofs_nid_t nid, char *buf, size_t size)
+/* index the dirents of the directory (or file) queued at @d */
+static int erofs_nid_index_dir(struct erofs_nid_index_builder *b,
+			       struct erofs_nid_index_dir *d)
 {
+	struct erofs_sb_info *sbi = b->sbi;
+	unsigned long count = b->idx->count, qtail = b->qtail;
+	struct erofs_inode *dir;
 	int ret;
-	struct erofs_inode root = { .nid = sbi.root_nid };
-	struct erofs_get_pathname_context pathctx = {
-		.ctx.flags = 0,
-		.ctx.dir = &root,
-		.ctx.cb = erofs_get_pathname_iter,
-		.target_nid = nid,
-		.buf = buf,
-		.size = size,
-		.pos = 0,
+
+	/* e.g. another name of a directory in the same parent */
+	if (erofs_nid_index_seen(b, d->nid))
+		return 0;
+
+	dir = erofs_icache_get(sbi, d->nid);
+	if (IS_ERR(dir)) {
+		erofs_err("read inode failed @ nid %llu", d->nid | 0ULL);
+		return PTR_ERR(dir);
+	}
+
+	if (!S_ISDIR(dir->i_mode)) {
+		if (d->ftype_dir)
+			erofs_err("i_mode and file_type are inconsistent @ nid %llu",
+				  d->nid | 0ULL);
+		ret = erofs_nid_index_add(b, d->nid, d->pnid, d->pos);
+		goto out;
+	}
+
+	b->ctx.dir = dir;
+	b->dotdot_found = false;
+	ret = erofs_iterate_dir(&b->ctx, false);
+	if (ret)
+		goto out;
+
+	/* only follow directories from their real parents, which avoids loops */
+	if (!b->dotdot_found || b->dotdot != d->pnid) {
+		erofs_warn("skipping directory nid %llu not under nid %llu",
+			   d->nid | 0ULL, d->pnid | 0ULL);
+		b->idx->count = count;
+		b->qtail = qtail;
+		goto out;
+	}
+
+	ret = erofs_nid_index_mark(b, d->nid);
+	if (!ret && d->nid != sbi->root_nid)
+		ret = erofs_nid_index_add(b, d->nid, d->pnid, d->pos);
+out:
+	erofs_icache_put(dir);
+	return ret;
+}
+
+static int erofs_nid_entry_cmp(const void *a, const void *b)
+{
+	const struct erofs_nid_entry *ea = a, *eb = b;
+
+	if (ea->nid != eb->nid)
+		return ea->nid < eb->nid ? -1 : 1;
+	if (ea->pnid != eb->pnid)
+		return ea->pnid < eb->pnid ? -1 : 1;
+	if (ea->pos != eb->pos)
+		return ea->pos < eb->pos ? -1 : 1;
+	return 0;
+}
+
+static struct erofs_nid_index *erofs_build_nid_index(struct erofs_sb_info *sbi)
+{
+	struct erofs_nid_index *idx;
+	struct erofs_nid_index_builder b = {
+		.ctx.cb = erofs_nid_index_iter,
+		.sbi = sbi,
+		.seen_mask = 255,
 	};
+	int ret;
+
+	idx = calloc(1, sizeof(*idx));
+	b.seen = calloc(b.seen_mask + 1, sizeof(*b.seen));
+	if (!idx || !b.seen) {
+		ret = -ENOMEM;
+		goto err_out;
+	}
+
+	/* the root is its own parent */
+	b.idx = idx;
+	ret = erofs_nid_index_dir(&b, &(struct erofs_nid_index_dir) {
+			.nid = sbi->root_nid,
+			.pnid = sbi->root_nid,
+		});
+	while (!ret && b.qhead < b.qtail) {
+		/* the queue may be reallocated while walking the directory */
+		struct erofs_nid_index_dir d = b.queue[b.qhead++];
+
+		ret = erofs_nid_index_dir(&b, &d);
+	}
+	if (ret)
+		goto err_out;
+
+	free(b.queue);
+	free(b.seen);
+	qsort(idx->entries, idx->count, sizeof(*idx->entries),
+	      erofs_nid_entry_cmp);
+	return idx;
+err_out:
+	free(b.queue);
+	free(b.seen);
+	if (idx)
+		free(idx->entries);
+	free(idx);
+	return ERR_PTR(ret);
+}
+
+/* failures are kept as well, which would be the same next time */
+static struct erofs_nid_index *erofs_get_nid_index(struct erofs_sb_info *sbi)
+{
+	struct erofs_nid_index *idx;
+
+	erofs_mutex_lock(&erofs_nid_index_lock);
+	idx = sbi->nid_index;
+	if (!idx) {
+		idx = erofs_build_nid_index(sbi);
+		if (!IS_ERR(idx) || PTR_ERR(idx) != -ENOMEM)
+			sbi->nid_index = idx;
+	}
+	erofs_mutex_unlock(&erofs_nid_index_lock);
+	return idx;
+}
+
+void erofs_drop_nid_index(struct erofs_sb_info *sbi)
+{
+	struct erofs_nid_index *idx = sbi->nid_index;
+
+	sbi->nid_index = NULL;
+	if (!idx || IS_ERR(idx))
+		return;
+	free(idx->entries);
+	free(idx);
+}
+
+static const struct erofs_nid_entry *
+erofs_nid_index_lookup(struct erofs_nid_index *idx, erofs_nid_t nid)
+{
+	unsigned long lo = 0, hi = idx->count;
+
+	while (lo < hi) {
+		unsigned long mid = lo + (hi - lo) / 2;
+
+		if (idx->entries[mid].nid < nid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < idx->count && idx->entries[lo].nid == nid)
+		return idx->entries + lo;
+	return NULL;
+}
+
+/* read back the name of the dirent at @pos of the directory @pnid */
+static int erofs_read_dirent_name(struct erofs_sb_info *sbi, erofs_nid_t pnid,
+				  erofs_off_t pos, char *name)
+{
+	char buf[EROFS_BLKSIZ];
+	struct erofs_dirent *de = (void *)buf;
+	struct erofs_inode *dir;
+	unsigned int maxsize, nameoff, namelen, ofs, end;
+	int ret;
+
+	dir = erofs_icache_get(sbi, pnid);
+	if (IS_ERR(dir))
+		return PTR_ERR(dir);
+
+	maxsize = min_t(erofs_off_t, dir->i_size - round_down(pos, EROFS_BLKSIZ),
+			EROFS_BLKSIZ);
+	ret = erofs_pread(dir, buf, maxsize, round_down(pos, EROFS_BLKSIZ));
+	erofs_icache_put(dir);
+	if (ret)
+		return ret;
+
+	ofs = erofs_blkoff(pos);
+	end = le16_to_cpu(de->nameoff);
+	if (ofs + sizeof(*de) > end || end > maxsize)
+		return -EFSCORRUPTED;
+
+	de = (void *)(buf + ofs);
+	nameoff = le16_to_cpu(de->nameoff);
+	if (nameoff >= maxsize)
+		return -EFSCORRUPTED;
+	if (ofs + sizeof(*de) >= end)
+		namelen = strnlen(buf + nameoff, maxsize - nameoff);
+	else
+		namelen = le16_to_cpu(de[1].nameoff) - nameoff;
+	if (nameoff + namelen > maxsize || namelen > EROFS_NAME_LEN)
+		return -EFSCORRUPTED;
 
-	if (nid == root.nid) {
+	memcpy(name, buf + nameoff, namelen);
+	return namelen;
+}
+
+int erofs_get_pathname(struct erofs_sb_info *sbi, erofs_nid_t nid,
+		       char *buf, size_t size)
+{
+	const struct erofs_nid_entry *e;
+	struct erofs_nid_index *idx;
+	char name[EROFS_NAME_LEN];
+	size_t pos = size;
+	int len;
+
+	if (nid == sbi->root_nid) {
 		if (size < 2) {
 			erofs_err("get_pathname buffer not large enough: len 2, size %zd",
 				  size);
@@ -255,16 +541,32 @@ int erofs_get_pathname(erofs_nid_t nid, char *buf, size_t size)
 		return 0;
 	}
 
-	ret = erofs_read_inode_from_disk(&root);
-	if (ret) {
-		erofs_err("read inode failed @ nid %llu", root.nid | 0ULL);
-		return ret;
+	idx = erofs_get_nid_index(sbi);
+	if (IS_ERR(idx))
+		return PTR_ERR(idx);
+
+	/* fill in the path backwards from the end of the buffer */
+	if (!size)
+		return -ERANGE;
+	buf[--pos] = '\0';
+	while (nid != sbi->root_nid) {
+		e = erofs_nid_index_lookup(idx, nid);
+		if (!e)
+			return -ENOENT;
+
+		len = erofs_read_dirent_name(sbi, e->pnid, e->pos, name);
+		if (len < 0)
+			return len;
+		if (pos < len + 1) {
+			erofs_err("get_pathname buffer not large enough: size %zd",
+				  size);
+			return -ERANGE;
+		}
+		pos -= len;
+		memcpy(buf + pos, name, len);
+		buf[--pos] = '/';
+		nid = e->pnid;
 	}
-
-	ret = erofs_iterate_dir(&pathctx.ctx, false);
-	if (ret == EROFS_PATHNAME_FOUND)
-		return 0;
-	if (!ret)
-		return -ENOENT;
-	return ret;
+	memmove(buf, buf + pos, size - pos);
+	return 0;
 }
@@ -0,0 +1,204 @@
+// SPDX-License-Identifier: GPL-2.0+ OR Apache-2.0
+/*
+ * Reference-counted cache of decoded on-disk inodes, used by the read
+ * path (erofsfuse, path and fragment lookups) so that repeated lookups of
+ * the same nid don't decode the inode, the z_erofs map header and the
+ * xattr summary from disk again.  Inodes of all opened filesystems share
+ * the same cache and memory cap, keyed by (sbi, nid).  Tools walking each
+ * inode only once should rather read it into a copy of their own.
+ */
+#include <stdlib.h>
+#include "erofs/print.h"
+#include "erofs/internal.h"
+#include "erofs/hashtable.h"
+#include "erofs/lock.h"
+#include "erofs/xattr.h"
+#include "erofs/stats.h"
+
+#define EROFS_ICACHE_HASH_BITS		12
+/* default memory cap of unreferenced cached inodes */
+#define EROFS_ICACHE_DEFAULT_LIMIT	(32U << 20)
+
+struct erofs_icache_node {
+	struct hlist_node hnode;
+	/* linked into the LRU list if nobody holds a reference */
+	struct list_head lru;
+	size_t size;
+	struct erofs_inode inode;
+};
+
+static DECLARE_HASHTABLE(erofs_icache_hash, EROFS_ICACHE_HASH_BITS);
+static LIST_HEAD(erofs_icache_lru);
+static erofs_mutex_t erofs_icache_lock = EROFS_MUTEX_INITIALIZER;
+static size_t erofs_icache_size, erofs_icache_limit = EROFS_ICACHE_DEFAULT_LIMIT;
+
+static void erofs_icache_free(struct erofs_icache_node *node)
+{
+	struct erofs_inode *vi = &node->inode;
+
+	if (vi->xattr_shared_xattrs)
+		free(vi->xattr_shared_xattrs);
+	if (erofs_inode_is_data_compressed(vi->datalayout))
+		z_erofs_drop_extent_table(vi);
+	free(node);
+}
+
+/* drop unreferenced inodes from the LRU tail until we are below the cap */
+static void erofs_icache_shrink(size_t limit)
+{
+	while (erofs_icache_size > limit && !list_empty(&erofs_icache_lru)) {
+		struct erofs_icache_node *node =
+			list_last_entry(&erofs_icache_lru,
+					struct erofs_icache_node, lru);
+
+		list_del(&node->lru);
+		hash_del(&node->hnode);
+		erofs_icache_size -= node->size;
+		erofs_icache_free(node);
+	}
+}
+
+static size_t erofs_icache_nodesize(struct erofs_inode *vi)
+{
+	size_t size = sizeof(struct erofs_icache_node) +
+		vi->xattr_shared_count * sizeof(*vi->xattr_shared_xattrs);
+
+	if (erofs_inode_is_data_compressed(vi->datalayout))
+		size += z_erofs_extent_table_size(vi);
+	return size;
+}
+
+/*
+ * Finish all lazy initialization before an inode becomes visible to
+ * others so that cached inodes are never modified afterwards.
+ */
+static int erofs_icache_fill(struct erofs_icache_node *node)
+{
+	struct erofs_inode *vi = &node->inode;
+	int ret;
+
+	ret = erofs_read_inode_from_disk(vi);
+	if (ret)
+		return ret;
+	vi->flags |= EROFS_I_CACHED;
+
+	if (erofs_inode_is_data_compressed(vi->datalayout)) {
+		ret = z_erofs_fill_inode_lazy(vi);
+		if (ret)
+			return ret;
+	}
+
+	ret = erofs_init_inode_xattrs(vi);
+	if (ret && ret != -ENOATTR)
+		return ret;
+
+	node->size = erofs_icache_nodesize(vi);
+	return 0;
+}
+
+static inline unsigned long erofs_icache_hashkey(struct erofs_sb_info *sbi,
+						 erofs_nid_t nid)
+{
+	return nid ^ ((unsigned long)sbi >> 6);
+}
+
+struct erofs_inode *erofs_icache_get(struct erofs_sb_info *sbi,
+				     erofs_nid_t nid)
+{
+	unsigned long key = erofs_icache_hashkey(sbi, nid);
+	struct erofs_icache_node *node, *newnode;
+	int ret;
+
+	erofs_mutex_lock(&erofs_icache_lock);
+	hash_for_each_possible(erofs_icache_hash, node, hnode, key) {
+		if (node->inode.nid != nid || node->inode.sbi != sbi)
+			continue;
+		if (!node->inode.i_count++)
+			list_del(&node->lru);
+		erofs_mutex_unlock(&erofs_icache_lock);
+		erofs_stats_add(EROFS_STAT_ICACHE_HIT, 1);
+		return &node->inode;
+	}
+	erofs_mutex_unlock(&erofs_icache_lock);
+	erofs_stats_add(EROFS_STAT_ICACHE_MISS, 1);
+
+	newnode = calloc(1, sizeof(*newnode));
+	if (!newnode)
+		return ERR_PTR(-ENOMEM);
+	newnode->inode.sbi = sbi;
+	newnode->inode.nid = nid;
+	ret = erofs_icache_fill(newnode);
+	if (ret) {
+		erofs_icache_free(newnode);
+		return ERR_PTR(ret);
+	}
+
+	erofs_mutex_lock(&erofs_icache_lock);
+	/* someone else may have inserted the same nid in the meantime */
+	hash_for_each_possible(erofs_icache_hash, node, hnode, key) {
+		if (node->inode.nid != nid || node->inode.sbi != sbi)
+			continue;
+		if (!node->inode.i_count++)
+			list_del(&node->lru);
+		erofs_mutex_unlock(&erofs_icache_lock);
+		erofs_icache_free(newnode);
+		return &node->inode;
+	}
+	newnode->inode.i_count = 1;
+	hash_add(erofs_icache_hash, &newnode->hnode, key);
+	erofs_icache_size += newnode->size;
+	erofs_icache_shrink(erofs_icache_limit);
+	erofs_mutex_unlock(&erofs_icache_lock);
+	return &newnode->inode;
+}
+
+void erofs_icache_put(struct erofs_inode *vi)
+{
+	struct erofs_icache_node *node =
+		container_of(vi, struct erofs_icache_node, inode);
+
+	erofs_mutex_lock(&erofs_icache_lock);
+	DBG_BUGON(!vi->i_count);
+	if (!--vi->i_count) {
+		/* account for the extent table built since it was inserted */
+		erofs_icache_size -= node->size;
+		node->size = erofs_icache_nodesize(vi);
+		erofs_icache_size += node->size;
+		list_add(&node->lru, &erofs_icache_lru);
+		erofs_icache_shrink(erofs_icache_limit);
+	}
+	erofs_mutex_unlock(&erofs_icache_lock);
+}
+
+/* set the memory cap shared by the cached inodes of all filesystems */
+void erofs_icache_set_limit(size_t limit)
+{
+	erofs_mutex_lock(&erofs_icache_lock);
+	erofs_icache_limit = limit;
+	erofs_icache_shrink(limit);
+	erofs_mutex_unlock(&erofs_icache_lock);
+}
+
+/* drop all cached inodes of a filesystem which is going away */
+void erofs_icache_exit(struct erofs_sb_info *sbi)
+{
+	struct erofs_icache_node *node;
+	struct hlist_node *tmp;
+	unsigned int bkt;
+
+	erofs_mutex_lock(&erofs_icache_lock);
+	hash_for_each_safe(erofs_icache_hash, bkt, tmp, node, hnode) {
+		if (node->inode.sbi != sbi)
+			continue;
+		if (node->inode.i_count) {
+			erofs_warn("inode nid %llu is still referenced",
+				   node->inode.nid | 0ULL);
+			continue;
+		}
+		list_del(&node->lru);
+		hash_del(&node->hnode);
+		erofs_icache_size -= node->size;
+		erofs_icache_free(node);
+	}
+	erofs_mutex_unlock(&erofs_icache_lock);
+}
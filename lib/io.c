@@ -10,9 +10,16 @@
 #ifndef _GNU_SOURCE
 #define _GNU_SOURCE
 #endif
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include "erofs/io.h"
+#include "erofs/blobcache.h"
+#include "erofs/lock.h"
+#include "erofs/stats.h"
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 #ifdef HAVE_LINUX_FS_H
 #include <linux/fs.h>
 #endif
@@ -23,10 +30,8 @@
 #define EROFS_MODNAME	"erofs_io"
 #include "erofs/print.h"
 
-static const char *erofs_devname;
-int erofs_devfd = -1;
+/* size limit of the image being written by mkfs.erofs (the global sbi) */
 static u64 erofs_devsz;
-static unsigned int erofs_nblobs, erofs_blobfd[256];
 
 int dev_get_blkdev_size(int fd, u64 *bytes)
 {
@@ -48,12 +53,82 @@ int dev_get_blkdev_size(int fd, u64 *bytes)
 	return -errno;
 }
 
-void dev_close(void)
+/*
+ * Faults on a shared mapping raise SIGBUS if the device hits a media error
+ * or gets truncated, so only long-running readers which care about the
+ * saved copies (i.e. erofsfuse) opt in, fsck and dump stay with pread().
+ */
+static void dev_mmap_ro(int fd, struct erofs_devmap *dm)
+{
+#ifdef HAVE_SYS_MMAN_H
+	struct stat st;
+	u64 size;
+	void *base;
+
+	if (fstat(fd, &st))
+		return;
+
+	if (S_ISBLK(st.st_mode)) {
+		if (dev_get_blkdev_size(fd, &size))
+			return;
+	} else if (S_ISREG(st.st_mode)) {
+		size = st.st_size;
+	} else {
+		return;
+	}
+
+	/* e.g. huge images on 32-bit hosts, just use pread() then */
+	if (!size || size > SIZE_MAX)
+		return;
+
+	base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		erofs_dbg("failed to mmap device (%s), fall back to pread",
+			  erofs_strerror(-errno));
+		return;
+	}
+	dm->base = base;
+	dm->size = size;
+#endif
+}
+
+static void dev_munmap(struct erofs_devmap *dm)
+{
+#ifdef HAVE_SYS_MMAN_H
+	if (dm->base)
+		munmap(dm->base, dm->size);
+#endif
+	dm->base = NULL;
+	dm->size = 0;
+}
+
+/*
+ * Return a pointer to @len bytes at @offset of the given device if the
+ * device is mapped in memory, or NULL so that callers use dev_read().
+ */
+const void *dev_mmap_ptr(struct erofs_sb_info *sbi, int device_id,
+			 u64 offset, size_t len)
+{
+	struct erofs_devmap *dm;
+
+	if (device_id < 0 || device_id > sbi->nblobs)
+		return NULL;
+	dm = &sbi->devmap[device_id];
+	if (!dm->base)
+		return NULL;
+
+	offset += sbi->diskoffset;
+	if (offset > dm->size || len > dm->size - offset)
+		return NULL;
+	return dm->base + offset;
+}
+
+void dev_close(struct erofs_sb_info *sbi)
 {
-	close(erofs_devfd);
-	erofs_devname = NULL;
-	erofs_devfd   = -1;
-	erofs_devsz   = 0;
+	dev_munmap(&sbi->devmap[0]);
+	close(sbi->devfd);
+	sbi->devname = NULL;
+	sbi->devfd   = -1;
 }
 
 int dev_open(const char *dev)
@@ -100,39 +175,167 @@ int dev_open(const char *dev)
 		return -EINVAL;
 	}
 
-	erofs_devname = dev;
-	erofs_devfd = fd;
+	sbi.devname = dev;
+	sbi.devfd = fd;
 
 	erofs_info("successfully to open %s", dev);
 	return 0;
 }
 
-void blob_closeall(void)
+/*
+ * Blob devices opened by the read path are shared by all filesystems in
+ * the process, e.g. layers of the same container image served by one
+ * erofsfuse, so that each blob is opened, mapped and fetched only once.
+ */
+struct erofs_shared_blob {
+	struct list_head list;
+	unsigned int refcount;
+	/* remote blobs are identified by their URI, local ones by inode */
+	char *uri;
+	dev_t dev;
+	ino_t ino;
+	int fd;
+	struct erofs_blobcache *bc;
+	struct erofs_devmap map;
+};
+
+static LIST_HEAD(erofs_shared_blobs);
+static erofs_mutex_t erofs_shared_blobs_lock = EROFS_MUTEX_INITIALIZER;
+
+static void blob_put(int fd)
+{
+	struct erofs_shared_blob *b;
+
+	erofs_mutex_lock(&erofs_shared_blobs_lock);
+	list_for_each_entry(b, &erofs_shared_blobs, list) {
+		if (b->fd != fd)
+			continue;
+		if (!--b->refcount) {
+			list_del(&b->list);
+			dev_munmap(&b->map);
+			if (b->bc)
+				erofs_blobcache_close(b->bc);
+			else
+				close(b->fd);
+			free(b->uri);
+			free(b);
+		}
+		break;
+	}
+	erofs_mutex_unlock(&erofs_shared_blobs_lock);
+}
+
+static struct erofs_shared_blob *blob_get(const char *dev,
+					  const char *cachedir, bool map)
+{
+	struct erofs_shared_blob *b, *nb;
+	bool remote = erofs_blobcache_is_remote(dev);
+	struct stat st;
+	int fd = -1;
+
+	if (!remote) {
+		fd = open(dev, O_RDONLY | O_BINARY);
+		if (fd < 0) {
+			erofs_err("failed to open(%s).", dev);
+			return ERR_PTR(-errno);
+		}
+		if (fstat(fd, &st)) {
+			erofs_err("failed to fstat(%s).", dev);
+			close(fd);
+			return ERR_PTR(-errno);
+		}
+	}
+
+	erofs_mutex_lock(&erofs_shared_blobs_lock);
+	list_for_each_entry(b, &erofs_shared_blobs, list) {
+		if (remote ? b->uri && !strcmp(b->uri, dev) :
+		    !b->uri && b->dev == st.st_dev && b->ino == st.st_ino) {
+			++b->refcount;
+			erofs_mutex_unlock(&erofs_shared_blobs_lock);
+			if (fd >= 0)
+				close(fd);
+			return b;
+		}
+	}
+
+	nb = calloc(1, sizeof(*nb));
+	if (!nb) {
+		b = ERR_PTR(-ENOMEM);
+		goto err_unlock;
+	}
+	/*
+	 * Remote blobs are fetched into a sparse local file on demand, which
+	 * can't be mapped since missing chunks would just read as zeroes.
+	 */
+	if (remote) {
+		nb->uri = strdup(dev);
+		if (!nb->uri) {
+			b = ERR_PTR(-ENOMEM);
+			goto err_free;
+		}
+		nb->bc = erofs_blobcache_open(dev, cachedir);
+		if (IS_ERR(nb->bc)) {
+			b = ERR_PTR(PTR_ERR(nb->bc));
+			goto err_free;
+		}
+		nb->fd = erofs_blobcache_fd(nb->bc);
+	} else {
+		nb->dev = st.st_dev;
+		nb->ino = st.st_ino;
+		nb->fd = fd;
+		if (map)
+			dev_mmap_ro(fd, &nb->map);
+	}
+	nb->refcount = 1;
+	list_add_tail(&nb->list, &erofs_shared_blobs);
+	erofs_mutex_unlock(&erofs_shared_blobs_lock);
+	return nb;
+
+err_free:
+	free(nb->uri);
+	free(nb);
+err_unlock:
+	erofs_mutex_unlock(&erofs_shared_blobs_lock);
+	if (fd >= 0)
+		close(fd);
+	return b;
+}
+
+void blob_closeall(struct erofs_sb_info *sbi)
 {
 	unsigned int i;
 
-	for (i = 0; i < erofs_nblobs; ++i)
-		close(erofs_blobfd[i]);
-	erofs_nblobs = 0;
+	for (i = 0; i < sbi->nblobs; ++i) {
+		blob_put(sbi->blobfd[i]);
+		sbi->blobcache[i] = NULL;
+		sbi->devmap[i + 1] = (struct erofs_devmap) { .base = NULL };
+	}
+	sbi->nblobs = 0;
 }
 
-int blob_open_ro(const char *dev)
+int blob_open_ro(struct erofs_sb_info *sbi, const char *dev)
 {
-	int fd = open(dev, O_RDONLY | O_BINARY);
+	struct erofs_shared_blob *b;
 
-	if (fd < 0) {
-		erofs_err("failed to open(%s).", dev);
-		return -errno;
+	if (sbi->nblobs >= EROFS_MAX_BLOBS) {
+		erofs_err("too many blob devices (%s).", dev);
+		return -EINVAL;
 	}
 
-	erofs_blobfd[erofs_nblobs] = fd;
-	erofs_info("successfully to open blob%u %s", erofs_nblobs, dev);
-	++erofs_nblobs;
+	b = blob_get(dev, sbi->blob_cachedir, sbi->mmap_devices);
+	if (IS_ERR(b))
+		return PTR_ERR(b);
+	sbi->blobfd[sbi->nblobs] = b->fd;
+	sbi->blobcache[sbi->nblobs] = b->bc;
+	if (sbi->mmap_devices)
+		sbi->devmap[sbi->nblobs + 1] = b->map;
+	erofs_info("successfully to open blob%u %s", sbi->nblobs, dev);
+	++sbi->nblobs;
 	return 0;
 }
 
-/* XXX: temporary soluation. Disk I/O implementation needs to be refactored. */
-int dev_open_ro(const char *dev)
+/* open an image read-only for the read path, see inode->sbi */
+int dev_open_ro(struct erofs_sb_info *sbi, const char *dev)
 {
 	int fd = open(dev, O_RDONLY | O_BINARY);
 
@@ -141,9 +344,10 @@ int dev_open_ro(const char *dev)
 		return -errno;
 	}
 
-	erofs_devfd = fd;
-	erofs_devname = dev;
-	erofs_devsz = INT64_MAX;
+	sbi->devfd = fd;
+	sbi->devname = dev;
+	if (sbi->mmap_devices)
+		dev_mmap_ro(fd, &sbi->devmap[0]);
 	return 0;
 }
 
@@ -172,19 +376,19 @@ int dev_write(const void *buf, u64 offset, size_t len)
 	}
 
 #ifdef HAVE_PWRITE64
-	ret = pwrite64(erofs_devfd, buf, len, (off64_t)offset);
+	ret = pwrite64(sbi.devfd, buf, len, (off64_t)offset);
 #else
-	ret = pwrite(erofs_devfd, buf, len, (off_t)offset);
+	ret = pwrite(sbi.devfd, buf, len, (off_t)offset);
 #endif
 	if (ret != (int)len) {
 		if (ret < 0) {
 			erofs_err("Failed to write data into device - %s:[%" PRIu64 ", %zd].",
-				  erofs_devname, offset, len);
+				  sbi.devname, offset, len);
 			return -errno;
 		}
 
 		erofs_err("Writing data into device - %s:[%" PRIu64 ", %zd] - was truncated.",
-			  erofs_devname, offset, len);
+			  sbi.devname, offset, len);
 		return -ERANGE;
 	}
 	return 0;
@@ -199,7 +403,7 @@ int dev_fillzero(u64 offset, size_t len, bool padding)
 		return 0;
 
 #if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
-	if (!padding && fallocate(erofs_devfd, FALLOC_FL_PUNCH_HOLE |
+	if (!padding && fallocate(sbi.devfd, FALLOC_FL_PUNCH_HOLE |
 				  FALLOC_FL_KEEP_SIZE, offset, len) >= 0)
 		return 0;
 #endif
@@ -217,7 +421,7 @@ int dev_fsync(void)
 {
 	int ret;
 
-	ret = fsync(erofs_devfd);
+	ret = fsync(sbi.devfd);
 	if (ret) {
 		erofs_err("Could not fsync device!!!");
 		return -EIO;
@@ -234,7 +438,7 @@ int dev_resize(unsigned int blocks)
 	if (cfg.c_dry_run || erofs_devsz != INT64_MAX)
 		return 0;
 
-	ret = fstat(erofs_devfd, &st);
+	ret = fstat(sbi.devfd, &st);
 	if (ret) {
 		erofs_err("failed to fstat.");
 		return -errno;
@@ -244,38 +448,82 @@ int dev_resize(unsigned int blocks)
 	if (st.st_size == length)
 		return 0;
 	if (st.st_size > length)
-		return ftruncate(erofs_devfd, length);
+		return ftruncate(sbi.devfd, length);
 
 	length = length - st.st_size;
 #if defined(HAVE_FALLOCATE)
-	if (fallocate(erofs_devfd, 0, st.st_size, length) >= 0)
+	if (fallocate(sbi.devfd, 0, st.st_size, length) >= 0)
 		return 0;
 #endif
 	return dev_fillzero(st.st_size, length, true);
 }
 
-int dev_read(int device_id, void *buf, u64 offset, size_t len)
+/*
+ * Get the file backing @device_id and turn @offset into an offset in it,
+ * for callers which do I/O on the file by themselves (e.g. splice).
+ */
+static int __dev_get_fd(struct erofs_sb_info *sbi, int device_id,
+			u64 *offset)
+{
+	*offset += sbi->diskoffset;
+	if (!device_id)
+		return sbi->devfd;
+	if (device_id < 0 || device_id > sbi->nblobs)
+		return -ENODEV;
+	return sbi->blobfd[device_id - 1];
+}
+
+/*
+ * Get the file which backs @len bytes at @offset of the given device, and
+ * turn @offset into the file offset.  Missing parts of remote blobs are
+ * fetched first so that the range can be read from the file directly.
+ */
+int dev_get_fd(struct erofs_sb_info *sbi, int device_id, u64 *offset,
+	       size_t len)
+{
+	int fd = __dev_get_fd(sbi, device_id, offset);
+	int ret;
+
+	if (fd < 0 || !device_id || !sbi->blobcache[device_id - 1])
+		return fd;
+	ret = erofs_blobcache_fill(sbi->blobcache[device_id - 1],
+				  *offset, len);
+	return ret ? ret : fd;
+}
+
+int dev_read(struct erofs_sb_info *sbi, int device_id,
+	     void *buf, u64 offset, size_t len)
 {
 	int read_count, fd;
+	const void *ptr;
+	u64 start;
 
 	if (cfg.c_dry_run)
 		return 0;
 
-	offset += cfg.c_offset;
-
 	if (!buf) {
 		erofs_err("buf is NULL");
 		return -EINVAL;
 	}
 
-	if (!device_id) {
-		fd = erofs_devfd;
-	} else {
-		if (device_id > erofs_nblobs) {
+	erofs_stats_add(EROFS_STAT_DEV_READ, 1);
+	erofs_stats_add(EROFS_STAT_DEV_READ_BYTES, len);
+	/* page faults on the mapping are I/O too, so time both paths */
+	start = erofs_stats_now();
+	ptr = dev_mmap_ptr(sbi, device_id, offset, len);
+	if (ptr) {
+		memcpy(buf, ptr, len);
+		erofs_stats_add(EROFS_STAT_DEV_READ_MMAP, 1);
+		if (start)
+			erofs_stats_add_dev_read(erofs_stats_now() - start);
+		return 0;
+	}
+
+	fd = dev_get_fd(sbi, device_id, &offset, len);
+	if (fd < 0) {
+		if (fd == -ENODEV)
 			erofs_err("invalid device id %d", device_id);
-			return -ENODEV;
-		}
-		fd = erofs_blobfd[device_id - 1];
+		return fd;
 	}
 
 	while (len > 0) {
@@ -287,11 +535,11 @@ int dev_read(int device_id, void *buf, u64 offset, size_t len)
 		if (read_count == -1 || read_count == 0) {
 			if (errno) {
 				erofs_err("Failed to read data from device - %s:[%" PRIu64 ", %zd].",
-					  erofs_devname, offset, len);
+					  sbi->devname, offset, len);
 				return -errno;
 			} else {
 				erofs_err("Reach EOF of device - %s:[%" PRIu64 ", %zd].",
-					  erofs_devname, offset, len);
+					  sbi->devname, offset, len);
 				return -EINVAL;
 			}
 		}
@@ -300,9 +548,24 @@ int dev_read(int device_id, void *buf, u64 offset, size_t len)
 		len -= read_count;
 		buf += read_count;
 	}
+	if (start)
+		erofs_stats_add_dev_read(erofs_stats_now() - start);
 	return 0;
 }
 
+/* hint the kernel to start reading the range in the background */
+void dev_readahead(struct erofs_sb_info *sbi, int device_id,
+		   u64 offset, size_t len)
+{
+#ifdef HAVE_POSIX_FADVISE
+	/* never wait for remote blobs here, dev_read() will fetch them */
+	int fd = __dev_get_fd(sbi, device_id, &offset);
+
+	if (fd >= 0)
+		(void)posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+#endif
+}
+
 static ssize_t __erofs_copy_file_range(int fd_in, erofs_off_t *off_in,
 				       int fd_out, erofs_off_t *off_out,
 				       size_t length)
@@ -22,19 +22,26 @@ static dev_t erofs_new_decode_dev(u32 dev)
 	return makedev(major, minor);
 }
 
+/* decode the on-disk inode @vi->nid of the filesystem @vi->sbi */
 int erofs_read_inode_from_disk(struct erofs_inode *vi)
 {
+	struct erofs_sb_info *sbi = vi->sbi;
 	int ret, ifmt;
 	char buf[sizeof(struct erofs_inode_extended)];
+	const char *ptr;
 	struct erofs_inode_compact *dic;
 	struct erofs_inode_extended *die;
-	const erofs_off_t inode_loc = iloc(vi->nid);
+	const erofs_off_t inode_loc = iloc(sbi, vi->nid);
 
-	ret = dev_read(0, buf, inode_loc, sizeof(*dic));
-	if (ret < 0)
-		return -EIO;
+	/* parse the inode in place if the image is mapped */
+	ptr = dev_mmap_ptr(sbi, 0, inode_loc, sizeof(*die));
+	if (!ptr) {
+		ret = dev_read(sbi, 0, buf, inode_loc, sizeof(*dic));
+		if (ret < 0)
+			return -EIO;
+	}
 
-	dic = (struct erofs_inode_compact *)buf;
+	dic = (struct erofs_inode_compact *)(ptr ? ptr : buf);
 	ifmt = le16_to_cpu(dic->i_format);
 
 	vi->datalayout = erofs_inode_datalayout(ifmt);
@@ -47,12 +54,15 @@ int erofs_read_inode_from_disk(struct erofs_inode *vi)
 	case EROFS_INODE_LAYOUT_EXTENDED:
 		vi->inode_isize = sizeof(struct erofs_inode_extended);
 
-		ret = dev_read(0, buf + sizeof(*dic), inode_loc + sizeof(*dic),
-			       sizeof(*die) - sizeof(*dic));
-		if (ret < 0)
-			return -EIO;
+		if (!ptr) {
+			ret = dev_read(sbi, 0, buf + sizeof(*dic),
+				       inode_loc + sizeof(*dic),
+				       sizeof(*die) - sizeof(*dic));
+			if (ret < 0)
+				return -EIO;
+		}
 
-		die = (struct erofs_inode_extended *)buf;
+		die = (struct erofs_inode_extended *)(ptr ? ptr : buf);
 		vi->xattr_isize = erofs_xattr_ibody_size(die->i_xattr_icount);
 		vi->i_mode = le16_to_cpu(die->i_mode);
 
@@ -114,8 +124,8 @@ int erofs_read_inode_from_disk(struct erofs_inode *vi)
 		vi->i_gid = le16_to_cpu(dic->i_gid);
 		vi->i_nlink = le16_to_cpu(dic->i_nlink);
 
-		vi->i_mtime = sbi.build_time;
-		vi->i_mtime_nsec = sbi.build_time_nsec;
+		vi->i_mtime = sbi->build_time;
+		vi->i_mtime_nsec = sbi->build_time_nsec;
 
 		vi->i_size = le32_to_cpu(dic->i_size);
 		if (vi->datalayout == EROFS_INODE_CHUNK_BASED)
@@ -144,97 +154,138 @@ bogusimode:
 	return -EFSCORRUPTED;
 }
 
-struct erofs_dirent *find_target_dirent(erofs_nid_t pnid,
-					void *dentry_blk,
-					const char *name, unsigned int len,
-					unsigned int nameoff,
-					unsigned int maxsize)
+static int erofs_dirnamecmp(const char *name, unsigned int len,
+			    const char *dname, unsigned int dlen)
+{
+	int ret = memcmp(name, dname, min(len, dlen));
+
+	return ret ? ret : (int)len - (int)dlen;
+}
+
+/*
+ * Dirents are sorted by name, so binary search @name in a directory
+ * block.  If it isn't there, *@diff tells whether @name sorts before
+ * (< 0) or after (> 0) all dirents of the block, or in between (0).
+ */
+static struct erofs_dirent *find_target_dirent(erofs_nid_t pnid,
+					       void *dentry_blk,
+					       const char *name,
+					       unsigned int len,
+					       unsigned int nameoff,
+					       unsigned int maxsize, int *diff)
 {
 	struct erofs_dirent *de = dentry_blk;
-	const struct erofs_dirent *end = dentry_blk + nameoff;
+	const int ndirents = nameoff / sizeof(*de);
+	int head = 0, back = ndirents - 1;
 
-	while (de < end) {
-		const char *de_name;
+	while (head <= back) {
+		const int mid = head + (back - head) / 2;
+		unsigned int de_nameoff = le16_to_cpu(de[mid].nameoff);
+		const char *de_name = (char *)dentry_blk + de_nameoff;
 		unsigned int de_namelen;
+		int ret;
 
-		nameoff = le16_to_cpu(de->nameoff);
-		de_name = (char *)dentry_blk + nameoff;
+		if (de_nameoff < nameoff || de_nameoff >= maxsize)
+			goto bogus;
 
 		/* the last dirent in the block? */
-		if (de + 1 >= end)
-			de_namelen = strnlen(de_name, maxsize - nameoff);
+		if (mid >= ndirents - 1)
+			de_namelen = strnlen(de_name, maxsize - de_nameoff);
 		else
-			de_namelen = le16_to_cpu(de[1].nameoff) - nameoff;
+			de_namelen = le16_to_cpu(de[mid + 1].nameoff) -
+					de_nameoff;
 
 		/* a corrupted entry is found */
-		if (nameoff + de_namelen > maxsize ||
-		    de_namelen > EROFS_NAME_LEN) {
-			erofs_err("bogus dirent @ nid %llu", pnid | 0ULL);
-			DBG_BUGON(1);
-			return ERR_PTR(-EFSCORRUPTED);
-		}
-
-		if (len == de_namelen && !memcmp(de_name, name, de_namelen))
-			return de;
-		++de;
+		if (de_nameoff + de_namelen > maxsize ||
+		    de_namelen > EROFS_NAME_LEN)
+			goto bogus;
+
+		ret = erofs_dirnamecmp(name, len, de_name, de_namelen);
+		if (!ret)
+			return de + mid;
+		if (ret > 0)
+			head = mid + 1;
+		else
+			back = mid - 1;
 	}
+	*diff = !head ? -1 : head >= ndirents;
 	return NULL;
+bogus:
+	erofs_err("bogus dirent @ nid %llu", pnid | 0ULL);
+	DBG_BUGON(1);
+	return ERR_PTR(-EFSCORRUPTED);
 }
 
-struct nameidata {
-	erofs_nid_t	nid;
-	unsigned int	ftype;
-};
-
+/* look up one component @name in directory @nd->nid and move @nd to it */
 int erofs_namei(struct nameidata *nd,
 		const char *name, unsigned int len)
 {
 	erofs_nid_t nid = nd->nid;
-	int ret;
+	int ret, head, back;
 	char buf[EROFS_BLKSIZ];
-	struct erofs_inode vi = { .nid = nid };
-	erofs_off_t offset;
+	struct erofs_inode *vi;
 
-	ret = erofs_read_inode_from_disk(&vi);
-	if (ret)
-		return ret;
+	vi = erofs_icache_get(nd->sbi, nid);
+	if (IS_ERR(vi))
+		return PTR_ERR(vi);
 
-	offset = 0;
-	while (offset < vi.i_size) {
+	if (!S_ISDIR(vi->i_mode)) {
+		erofs_icache_put(vi);
+		return -ENOTDIR;
+	}
+
+	/* binary search the block which could contain @name */
+	ret = -ENOENT;
+	head = 0;
+	back = erofs_blknr(vi->i_size + EROFS_BLKSIZ - 1) - 1;
+	while (head <= back) {
+		const int mid = head + (back - head) / 2;
+		erofs_off_t offset = blknr_to_addr(mid);
 		erofs_off_t maxsize = min_t(erofs_off_t,
-					    vi.i_size - offset, EROFS_BLKSIZ);
+					    vi->i_size - offset, EROFS_BLKSIZ);
 		struct erofs_dirent *de = (void *)buf;
 		unsigned int nameoff;
+		int diff;
 
-		ret = erofs_pread(&vi, buf, maxsize, offset);
+		ret = erofs_pread(vi, buf, maxsize, offset);
 		if (ret)
-			return ret;
+			break;
 
 		nameoff = le16_to_cpu(de->nameoff);
 		if (nameoff < sizeof(struct erofs_dirent) ||
 		    nameoff >= EROFS_BLKSIZ) {
 			erofs_err("invalid de[0].nameoff %u @ nid %llu",
 				  nameoff, nid | 0ULL);
-			return -EFSCORRUPTED;
+			ret = -EFSCORRUPTED;
+			break;
 		}
 
 		de = find_target_dirent(nid, buf, name, len,
-					nameoff, maxsize);
-		if (IS_ERR(de))
-			return PTR_ERR(de);
+					nameoff, maxsize, &diff);
+		if (IS_ERR(de)) {
+			ret = PTR_ERR(de);
+			break;
+		}
 
 		if (de) {
 			nd->nid = le64_to_cpu(de->nid);
-			return 0;
+			break;
 		}
-		offset += maxsize;
+		ret = -ENOENT;
+		if (!diff)
+			break;
+		if (diff < 0)
+			back = mid - 1;
+		else
+			head = mid + 1;
 	}
-	return -ENOENT;
+	erofs_icache_put(vi);
+	return ret;
 }
 
 static int link_path_walk(const char *name, struct nameidata *nd)
 {
-	nd->nid = sbi.root_nid;
+	nd->nid = nd->sbi->root_nid;
 
 	while (*name == '/')
 		name++;
@@ -261,10 +312,11 @@ static int link_path_walk(const char *name, struct nameidata *nd)
 	return 0;
 }
 
+/* look up @path in the filesystem @vi->sbi and read the inode into @vi */
 int erofs_ilookup(const char *path, struct erofs_inode *vi)
 {
 	int ret;
-	struct nameidata nd;
+	struct nameidata nd = { .sbi = vi->sbi };
 
 	ret = link_path_walk(path, &nd);
 	if (ret)
@@ -273,3 +325,15 @@ int erofs_ilookup(const char *path, struct erofs_inode *vi)
 	vi->nid = nd.nid;
 	return erofs_read_inode_from_disk(vi);
 }
+
+struct erofs_inode *erofs_icache_lookup(struct erofs_sb_info *sbi,
+					const char *path)
+{
+	int ret;
+	struct nameidata nd = { .sbi = sbi };
+
+	ret = link_path_walk(path, &nd);
+	if (ret)
+		return ERR_PTR(ret);
+	return erofs_icache_get(sbi, nd.nid);
+}
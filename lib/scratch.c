@@ -0,0 +1,80 @@
+// SPDX-License-Identifier: GPL-2.0+ OR Apache-2.0
+/*
+ * Per-thread scratch buffers for the read path, so that hot paths don't
+ * need to allocate temporary buffers on each call.
+ */
+#include <stdlib.h>
+#include "erofs/internal.h"
+
+struct erofs_scratch {
+	void *buf[EROFS_SCRATCH_MAX];
+	size_t size[EROFS_SCRATCH_MAX];
+};
+
+#ifdef EROFS_MT_ENABLED
+static pthread_key_t erofs_scratch_key;
+static pthread_once_t erofs_scratch_once = PTHREAD_ONCE_INIT;
+
+static void erofs_scratch_free(void *ptr)
+{
+	struct erofs_scratch *s = ptr;
+	int i;
+
+	for (i = 0; i < EROFS_SCRATCH_MAX; ++i)
+		free(s->buf[i]);
+	free(s);
+}
+
+static void erofs_scratch_init(void)
+{
+	pthread_key_create(&erofs_scratch_key, erofs_scratch_free);
+}
+
+static struct erofs_scratch *erofs_scratch_get(void)
+{
+	struct erofs_scratch *s;
+
+	pthread_once(&erofs_scratch_once, erofs_scratch_init);
+	s = pthread_getspecific(erofs_scratch_key);
+	if (!s) {
+		s = calloc(1, sizeof(*s));
+		if (s && pthread_setspecific(erofs_scratch_key, s)) {
+			free(s);
+			s = NULL;
+		}
+	}
+	return s;
+}
+#else
+static struct erofs_scratch erofs_scratch;
+
+static struct erofs_scratch *erofs_scratch_get(void)
+{
+	return &erofs_scratch;
+}
+#endif
+
+/*
+ * Get the calling thread's scratch buffer @id with at least @size bytes.
+ * The old contents are not kept when it grows.  Callers mustn't hold it
+ * across calls which could use the same buffer id (e.g. erofs_pread()).
+ */
+void *erofs_get_scratch(enum erofs_scratch_id id, size_t size)
+{
+	struct erofs_scratch *s = erofs_scratch_get();
+	void *buf;
+
+	if (!s)
+		return NULL;
+
+	if (size > s->size[id]) {
+		size = round_up(size, EROFS_BLKSIZ);
+		buf = malloc(size);
+		if (!buf)
+			return NULL;
+		free(s->buf[id]);
+		s->buf[id] = buf;
+		s->size[id] = size;
+	}
+	return s->buf[id];
+}
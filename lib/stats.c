@@ -0,0 +1,211 @@
+// SPDX-License-Identifier: GPL-2.0+ OR Apache-2.0
+/*
+ * Runtime counters of the read path (reads, device I/O, decompression and
+ * cache hits).  Each thread counts into its own copy without any atomic
+ * read-modify-write or locking, and copies are only summed up when the
+ * counters are shown, so keeping them enabled in production is cheap.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "erofs/stats.h"
+#include "erofs/lock.h"
+
+struct erofs_stats_node {
+	struct list_head list;
+	struct erofs_stats st;
+};
+
+bool erofs_stats_enabled;
+
+/* protects the list of per-thread counters and those of exited threads */
+static erofs_mutex_t erofs_stats_lock = EROFS_MUTEX_INITIALIZER;
+static LIST_HEAD(erofs_stats_list);
+static struct erofs_stats erofs_stats_exited;
+
+/* all counters are u64, so they can simply be added up word by word */
+static void erofs_stats_sum(struct erofs_stats *dst,
+			    const struct erofs_stats *src)
+{
+	const u64 *s = (const u64 *)src;
+	u64 *d = (u64 *)dst;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(*src) / sizeof(u64); ++i)
+		d[i] += __atomic_load_n(&s[i], __ATOMIC_RELAXED);
+}
+
+static struct erofs_stats_node *erofs_stats_new(void)
+{
+	struct erofs_stats_node *node = calloc(1, sizeof(*node));
+
+	if (!node)
+		return NULL;
+	erofs_mutex_lock(&erofs_stats_lock);
+	list_add_tail(&node->list, &erofs_stats_list);
+	erofs_mutex_unlock(&erofs_stats_lock);
+	return node;
+}
+
+#ifdef EROFS_MT_ENABLED
+static pthread_key_t erofs_stats_key;
+static pthread_once_t erofs_stats_once = PTHREAD_ONCE_INIT;
+
+/* keep the counters of exiting threads, e.g. decompression workers */
+static void erofs_stats_free(void *ptr)
+{
+	struct erofs_stats_node *node = ptr;
+
+	erofs_mutex_lock(&erofs_stats_lock);
+	erofs_stats_sum(&erofs_stats_exited, &node->st);
+	list_del(&node->list);
+	erofs_mutex_unlock(&erofs_stats_lock);
+	free(node);
+}
+
+static void erofs_stats_init(void)
+{
+	pthread_key_create(&erofs_stats_key, erofs_stats_free);
+}
+
+struct erofs_stats *__erofs_stats_get(void)
+{
+	struct erofs_stats_node *node;
+
+	pthread_once(&erofs_stats_once, erofs_stats_init);
+	node = pthread_getspecific(erofs_stats_key);
+	if (!node) {
+		node = erofs_stats_new();
+		if (!node)
+			return NULL;
+		pthread_setspecific(erofs_stats_key, node);
+	}
+	return &node->st;
+}
+#else
+static struct erofs_stats_node *erofs_stats_node;
+
+struct erofs_stats *__erofs_stats_get(void)
+{
+	if (!erofs_stats_node)
+		erofs_stats_node = erofs_stats_new();
+	return erofs_stats_node ? &erofs_stats_node->st : NULL;
+}
+#endif
+
+u64 __erofs_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void erofs_stats_add_decompress(int alg, u64 inbytes, u64 outbytes, u64 ns)
+{
+	struct erofs_stats *s;
+
+	if (!erofs_stats_enabled || alg < 0 || alg >= EROFS_STAT_NR_ALGS)
+		return;
+	s = __erofs_stats_get();
+	if (!s)
+		return;
+	__erofs_stats_inc(&s->decompress[alg].calls, 1);
+	__erofs_stats_inc(&s->decompress[alg].inbytes, inbytes);
+	__erofs_stats_inc(&s->decompress[alg].outbytes, outbytes);
+	__erofs_stats_inc(&s->decompress[alg].ns, ns);
+}
+
+void erofs_stats_add_dev_read(u64 ns)
+{
+	struct erofs_stats *s;
+	u64 us = ns / 1000;
+	unsigned int i;
+
+	if (!erofs_stats_enabled)
+		return;
+	s = __erofs_stats_get();
+	if (!s)
+		return;
+	i = us ? 64 - __builtin_clzll(us) : 0;
+	if (i >= EROFS_STAT_LAT_BUCKETS)
+		i = EROFS_STAT_LAT_BUCKETS - 1;
+	__erofs_stats_inc(&s->dev_read_lat[i], 1);
+}
+
+/* sum up the counters of all threads so far */
+void erofs_stats_snapshot(struct erofs_stats *st)
+{
+	struct erofs_stats_node *node;
+
+	memset(st, 0, sizeof(*st));
+	erofs_mutex_lock(&erofs_stats_lock);
+	erofs_stats_sum(st, &erofs_stats_exited);
+	list_for_each_entry(node, &erofs_stats_list, list)
+		erofs_stats_sum(st, &node->st);
+	erofs_mutex_unlock(&erofs_stats_lock);
+}
+
+static const char *erofs_stats_algname[EROFS_STAT_NR_ALGS] = {
+	[Z_EROFS_COMPRESSION_LZ4] = "lz4",
+	[Z_EROFS_COMPRESSION_LZMA] = "lzma",
+	[Z_EROFS_COMPRESSION_SHIFTED] = "shifted",
+	[Z_EROFS_COMPRESSION_INTERLACED] = "interlaced",
+};
+
+static void erofs_stats_show_ratio(FILE *f, const char *name, u64 hit,
+				   u64 miss)
+{
+	fprintf(f, "%s_hit %llu\n%s_miss %llu\n", name, hit | 0ULL,
+		name, miss | 0ULL);
+	if (hit + miss)
+		fprintf(f, "%s_hit_ratio %.4f\n", name,
+			(double)hit / (hit + miss));
+}
+
+/* print counters as "name value" lines, which are easy to parse */
+void erofs_stats_show(FILE *f, const struct erofs_stats *st)
+{
+	u64 decompressed = 0;
+	unsigned int i;
+
+	fprintf(f, "pread_calls %llu\npread_bytes %llu\n",
+		st->cnt[EROFS_STAT_PREAD] | 0ULL,
+		st->cnt[EROFS_STAT_PREAD_BYTES] | 0ULL);
+
+	for (i = 0; i < EROFS_STAT_NR_ALGS; ++i) {
+		const char *name = erofs_stats_algname[i];
+
+		if (!st->decompress[i].calls)
+			continue;
+		fprintf(f, "decompress_%s_calls %llu\n"
+			"decompress_%s_bytes_in %llu\n"
+			"decompress_%s_bytes_out %llu\n"
+			"decompress_%s_time_us %llu\n",
+			name, st->decompress[i].calls | 0ULL,
+			name, st->decompress[i].inbytes | 0ULL,
+			name, st->decompress[i].outbytes | 0ULL,
+			name, (st->decompress[i].ns / 1000) | 0ULL);
+		decompressed += st->decompress[i].outbytes;
+	}
+	fprintf(f, "decompress_bytes_out %llu\n", decompressed | 0ULL);
+
+	fprintf(f, "dev_read_calls %llu\ndev_read_bytes %llu\n"
+		"dev_read_mmap %llu\n",
+		st->cnt[EROFS_STAT_DEV_READ] | 0ULL,
+		st->cnt[EROFS_STAT_DEV_READ_BYTES] | 0ULL,
+		st->cnt[EROFS_STAT_DEV_READ_MMAP] | 0ULL);
+	for (i = 0; i < EROFS_STAT_LAT_BUCKETS - 1; ++i)
+		fprintf(f, "dev_read_latency_us_lt_%llu %llu\n", 1ULL << i,
+			st->dev_read_lat[i] | 0ULL);
+	fprintf(f, "dev_read_latency_us_ge_%llu %llu\n", 1ULL << (i - 1),
+		st->dev_read_lat[i] | 0ULL);
+
+	erofs_stats_show_ratio(f, "icache", st->cnt[EROFS_STAT_ICACHE_HIT],
+			       st->cnt[EROFS_STAT_ICACHE_MISS]);
+	erofs_stats_show_ratio(f, "blobcache",
+			       st->cnt[EROFS_STAT_BLOBCACHE_HIT],
+			       st->cnt[EROFS_STAT_BLOBCACHE_MISS]);
+	fprintf(f, "blobcache_fetch_bytes %llu\n",
+		st->cnt[EROFS_STAT_BLOBCACHE_FETCH_BYTES] | 0ULL);
+}
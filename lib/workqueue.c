@@ -49,17 +49,16 @@ static void *workqueue_thread(void *arg)
 		wq->next_item = wi->next;
 		wq->item_count--;
 
-		if (wq->max_queued && wq->next_item) {
+		if (wq->next_item) {
 			/* more work, wake up another worker */
 			pthread_cond_signal(&wq->wakeup);
 		}
 		wi->next = NULL;
 
+		/* @wi may be freed by its owner as soon as this returns */
 		pthread_mutex_unlock(&wq->lock);
 		(wi->function)(wq, wi);
 		pthread_mutex_lock(&wq->lock);
-
-		wi->function = NULL;
 	}
 	return NULL;
 }
@@ -17,6 +17,7 @@
 #include "erofs/xattr.h"
 #include "erofs/cache.h"
 #include "erofs/io.h"
+#include "erofs/lock.h"
 #include "liberofs_private.h"
 
 #define EA_HASHTABLE_BITS 16
@@ -715,7 +716,134 @@ char *erofs_export_xattr_ibody(struct list_head *ixattrs, unsigned int size)
 	return buf;
 }
 
+/*
+ * Shared xattrs are referenced by many inodes, so keep each one decoded
+ * in memory once it has been read.  Entries are never freed until the
+ * filesystem is put, so they can be used without holding the lock.
+ */
+#define EROFS_SHARED_XATTR_HASH_BITS	10
+
+struct erofs_shared_xattr {
+	struct hlist_node node;
+	unsigned int id;
+	u8 index, name_len;
+	u16 value_size;
+	char data[];		/* name, then value */
+};
+
+struct erofs_shared_xattr_table {
+	DECLARE_HASHTABLE(hash, EROFS_SHARED_XATTR_HASH_BITS);
+};
+
+static erofs_mutex_t erofs_shared_xattr_lock = EROFS_MUTEX_INITIALIZER;
+
+static struct erofs_shared_xattr *
+erofs_lookup_shared_xattr(struct erofs_shared_xattr_table *tbl,
+			  unsigned int id)
+{
+	struct erofs_shared_xattr *sx;
+
+	hash_for_each_possible(tbl->hash, sx, node, id)
+		if (sx->id == id)
+			return sx;
+	return NULL;
+}
+
+static struct erofs_shared_xattr *
+erofs_read_shared_xattr(struct erofs_sb_info *sbi, unsigned int id)
+{
+	erofs_off_t pos = blknr_to_addr(xattrblock_addr(sbi, id)) +
+		xattrblock_offset(id);
+	struct erofs_xattr_entry entry;
+	struct erofs_shared_xattr *sx;
+	unsigned int value_sz;
+	int ret;
+
+	ret = dev_read(sbi, 0, &entry, pos, sizeof(entry));
+	if (ret < 0)
+		return ERR_PTR(-EIO);
+
+	value_sz = le16_to_cpu(entry.e_value_size);
+	sx = malloc(sizeof(*sx) + entry.e_name_len + value_sz);
+	if (!sx)
+		return ERR_PTR(-ENOMEM);
+	ret = dev_read(sbi, 0, sx->data, pos + sizeof(entry),
+		       entry.e_name_len + value_sz);
+	if (ret < 0) {
+		free(sx);
+		return ERR_PTR(-EIO);
+	}
+	sx->id = id;
+	sx->index = entry.e_name_index;
+	sx->name_len = entry.e_name_len;
+	sx->value_size = value_sz;
+	return sx;
+}
+
+static struct erofs_shared_xattr *
+erofs_get_shared_xattr(struct erofs_sb_info *sbi, unsigned int id)
+{
+	struct erofs_shared_xattr_table *tbl;
+	struct erofs_shared_xattr *sx, *old;
+
+	erofs_mutex_lock(&erofs_shared_xattr_lock);
+	tbl = sbi->shared_xattrs;
+	if (!tbl) {
+		tbl = malloc(sizeof(*tbl));
+		if (!tbl) {
+			erofs_mutex_unlock(&erofs_shared_xattr_lock);
+			return ERR_PTR(-ENOMEM);
+		}
+		hash_init(tbl->hash);
+		sbi->shared_xattrs = tbl;
+	}
+	sx = erofs_lookup_shared_xattr(tbl, id);
+	erofs_mutex_unlock(&erofs_shared_xattr_lock);
+	if (sx)
+		return sx;
+
+	sx = erofs_read_shared_xattr(sbi, id);
+	if (IS_ERR(sx))
+		return sx;
+
+	erofs_mutex_lock(&erofs_shared_xattr_lock);
+	old = erofs_lookup_shared_xattr(tbl, id);
+	if (old) {
+		free(sx);
+		sx = old;
+	} else {
+		hash_add(tbl->hash, &sx->node, id);
+	}
+	erofs_mutex_unlock(&erofs_shared_xattr_lock);
+	return sx;
+}
+
+void erofs_put_shared_xattrs(struct erofs_sb_info *sbi)
+{
+	struct erofs_shared_xattr_table *tbl = sbi->shared_xattrs;
+	struct erofs_shared_xattr *sx;
+	struct hlist_node *tmp;
+	unsigned int bkt;
+
+	if (!tbl)
+		return;
+	hash_for_each_safe(tbl->hash, bkt, tmp, sx, node) {
+		hash_del(&sx->node);
+		free(sx);
+	}
+	free(tbl);
+	sbi->shared_xattrs = NULL;
+}
+
+/* which bit of erofs_inode.xattr_name_filter stands for a given name */
+static u64 erofs_xattr_filter_bit(u8 index, const char *name,
+				  unsigned int len)
+{
+	return 1ULL << ((BKDRHash((char *)name, len) ^ index) & 63);
+}
+
 struct xattr_iter {
+	struct erofs_sb_info *sbi;
 	char page[EROFS_BLKSIZ];
 
 	void *kaddr;
@@ -724,7 +852,9 @@ struct xattr_iter {
 	unsigned int ofs;
 };
 
-static int init_inode_xattrs(struct erofs_inode *vi)
+static void erofs_xattr_build_filter(struct erofs_inode *vi);
+
+int erofs_init_inode_xattrs(struct erofs_inode *vi)
 {
 	struct xattr_iter it;
 	unsigned int i;
@@ -756,10 +886,10 @@ static int init_inode_xattrs(struct erofs_inode *vi)
 		return -ENOATTR;
 	}
 
-	it.blkaddr = erofs_blknr(iloc(vi->nid) + vi->inode_isize);
-	it.ofs = erofs_blkoff(iloc(vi->nid) + vi->inode_isize);
+	it.blkaddr = erofs_blknr(iloc(vi->sbi, vi->nid) + vi->inode_isize);
+	it.ofs = erofs_blkoff(iloc(vi->sbi, vi->nid) + vi->inode_isize);
 
-	ret = blk_read(0, it.page, it.blkaddr, 1);
+	ret = blk_read(vi->sbi, 0, it.page, it.blkaddr, 1);
 	if (ret < 0)
 		return -EIO;
 
@@ -779,7 +909,7 @@ static int init_inode_xattrs(struct erofs_inode *vi)
 			/* cannot be unaligned */
 			DBG_BUGON(it.ofs != EROFS_BLKSIZ);
 
-			ret = blk_read(0, it.page, ++it.blkaddr, 1);
+			ret = blk_read(vi->sbi, 0, it.page, ++it.blkaddr, 1);
 			if (ret < 0) {
 				free(vi->xattr_shared_xattrs);
 				vi->xattr_shared_xattrs = NULL;
@@ -796,6 +926,9 @@ static int init_inode_xattrs(struct erofs_inode *vi)
 
 	vi->flags |= EROFS_I_EA_INITED;
 
+	/* cached inodes live long enough to make the name filter worth it */
+	if (vi->flags & EROFS_I_CACHED)
+		erofs_xattr_build_filter(vi);
 	return ret;
 }
 
@@ -824,7 +957,7 @@ static inline int xattr_iter_fixup(struct xattr_iter *it)
 
 	it->blkaddr += erofs_blknr(it->ofs);
 
-	ret = blk_read(0, it->page, it->blkaddr, 1);
+	ret = blk_read(it->sbi, 0, it->page, it->blkaddr, 1);
 	if (ret < 0)
 		return -EIO;
 
@@ -847,10 +980,11 @@ static int inline_xattr_iter_pre(struct xattr_iter *it,
 
 	inline_xattr_ofs = vi->inode_isize + xattr_header_sz;
 
-	it->blkaddr = erofs_blknr(iloc(vi->nid) + inline_xattr_ofs);
-	it->ofs = erofs_blkoff(iloc(vi->nid) + inline_xattr_ofs);
+	it->sbi = vi->sbi;
+	it->blkaddr = erofs_blknr(iloc(vi->sbi, vi->nid) + inline_xattr_ofs);
+	it->ofs = erofs_blkoff(iloc(vi->sbi, vi->nid) + inline_xattr_ofs);
 
-	ret = blk_read(0, it->page, it->blkaddr, 1);
+	ret = blk_read(vi->sbi, 0, it->page, it->blkaddr, 1);
 	if (ret < 0)
 		return -EIO;
 
@@ -1037,30 +1171,27 @@ static int inline_getxattr(struct erofs_inode *vi, struct getxattr_iter *it)
 
 static int shared_getxattr(struct erofs_inode *vi, struct getxattr_iter *it)
 {
+	struct erofs_shared_xattr *sx;
 	unsigned int i;
-	int ret = -ENOATTR;
 
 	for (i = 0; i < vi->xattr_shared_count; ++i) {
-		erofs_blk_t blkaddr =
-			xattrblock_addr(vi->xattr_shared_xattrs[i]);
-
-		it->it.ofs = xattrblock_offset(vi->xattr_shared_xattrs[i]);
+		sx = erofs_get_shared_xattr(vi->sbi, vi->xattr_shared_xattrs[i]);
+		if (IS_ERR(sx))
+			return PTR_ERR(sx);
 
-		if (!i || blkaddr != it->it.blkaddr) {
-			ret = blk_read(0, it->it.page, blkaddr, 1);
-			if (ret < 0)
-				return -EIO;
+		if (sx->index != it->index || sx->name_len != it->len ||
+		    memcmp(sx->data, it->name, it->len))
+			continue;
 
-			it->it.kaddr = it->it.page;
-			it->it.blkaddr = blkaddr;
+		if (it->buffer) {
+			if (it->buffer_size < sx->value_size)
+				return -ERANGE;
+			memcpy(it->buffer, sx->data + sx->name_len,
+			       sx->value_size);
 		}
-
-		ret = xattr_foreach(&it->it, &find_xattr_handlers, NULL);
-		if (ret != -ENOATTR)
-			break;
+		return sx->value_size;
 	}
-
-	return ret ? ret : it->buffer_size;
+	return -ENOATTR;
 }
 
 int erofs_getxattr(struct erofs_inode *vi, const char *name, char *buffer,
@@ -1074,7 +1205,7 @@ int erofs_getxattr(struct erofs_inode *vi, const char *name, char *buffer,
 	if (!name)
 		return -EINVAL;
 
-	ret = init_inode_xattrs(vi);
+	ret = erofs_init_inode_xattrs(vi);
 	if (ret)
 		return ret;
 
@@ -1087,6 +1218,12 @@ int erofs_getxattr(struct erofs_inode *vi, const char *name, char *buffer,
 	if (it.len > EROFS_NAME_LEN)
 		return -ERANGE;
 
+	/* most lookups miss, answer them without reading any xattr */
+	if ((vi->flags & EROFS_I_XATTR_FILTER) &&
+	    !(vi->xattr_name_filter &
+	      erofs_xattr_filter_bit(it.index, it.name, it.len)))
+		return -ENOATTR;
+
 	it.buffer = buffer;
 	it.buffer_size = buffer_size;
 
@@ -1177,29 +1314,108 @@ static int inline_listxattr(struct erofs_inode *vi, struct listxattr_iter *it)
 
 static int shared_listxattr(struct erofs_inode *vi, struct listxattr_iter *it)
 {
-	unsigned int i;
-	int ret = 0;
+	struct erofs_shared_xattr *sx;
+	unsigned int i, prefix_len;
 
 	for (i = 0; i < vi->xattr_shared_count; ++i) {
-		erofs_blk_t blkaddr =
-			xattrblock_addr(vi->xattr_shared_xattrs[i]);
-
-		it->it.ofs = xattrblock_offset(vi->xattr_shared_xattrs[i]);
-		if (!i || blkaddr != it->it.blkaddr) {
-			ret = blk_read(0, it->it.page, blkaddr, 1);
-			if (ret < 0)
-				return -EIO;
+		sx = erofs_get_shared_xattr(vi->sbi, vi->xattr_shared_xattrs[i]);
+		if (IS_ERR(sx))
+			return PTR_ERR(sx);
 
-			it->it.kaddr = it->it.page;
-			it->it.blkaddr = blkaddr;
+		prefix_len = xattr_types[sx->index].prefix_len;
+		if (!it->buffer) {
+			it->buffer_ofs += prefix_len + sx->name_len + 1;
+			continue;
 		}
+		if (it->buffer_ofs + prefix_len + sx->name_len + 1 >
+		    it->buffer_size)
+			return -ERANGE;
+
+		memcpy(it->buffer + it->buffer_ofs,
+		       xattr_types[sx->index].prefix, prefix_len);
+		it->buffer_ofs += prefix_len;
+		memcpy(it->buffer + it->buffer_ofs, sx->data, sx->name_len);
+		it->buffer_ofs += sx->name_len;
+		it->buffer[it->buffer_ofs++] = '\0';
+	}
+	return it->buffer_ofs;
+}
+
+struct filter_iter {
+	struct xattr_iter it;
+
+	u8 index, name_len;
+	char name[EROFS_NAME_LEN];
+	u64 filter;
+};
+
+static int xattr_entryfilter(struct xattr_iter *_it,
+			     struct erofs_xattr_entry *entry)
+{
+	struct filter_iter *it = container_of(_it, struct filter_iter, it);
+
+	it->index = entry->e_name_index;
+	it->name_len = entry->e_name_len;
+	return 0;
+}
+
+static int xattr_namefilter(struct xattr_iter *_it,
+			    unsigned int processed, char *buf, unsigned int len)
+{
+	struct filter_iter *it = container_of(_it, struct filter_iter, it);
 
-		ret = xattr_foreach(&it->it, &list_xattr_handlers, NULL);
+	memcpy(it->name + processed, buf, len);
+	return 0;
+}
+
+static int xattr_addfilter(struct xattr_iter *_it, unsigned int value_sz)
+{
+	struct filter_iter *it = container_of(_it, struct filter_iter, it);
+
+	it->filter |= erofs_xattr_filter_bit(it->index, it->name,
+					     it->name_len);
+	return 1;	/* skip the value */
+}
+
+static const struct xattr_iter_handlers filter_xattr_handlers = {
+	.entry = xattr_entryfilter,
+	.name = xattr_namefilter,
+	.alloc_buffer = xattr_addfilter,
+	.value = NULL
+};
+
+/*
+ * Summarize the names of all xattrs of an inode in a 64-bit bloom filter,
+ * so that erofs_getxattr() can reject most missing names at once.
+ */
+static void erofs_xattr_build_filter(struct erofs_inode *vi)
+{
+	struct erofs_shared_xattr *sx;
+	struct filter_iter it;
+	unsigned int remaining, i;
+	int ret;
+
+	it.filter = 0;
+	ret = inline_xattr_iter_pre(&it.it, vi);
+	if (ret < 0 && ret != -ENOATTR)
+		return;
+
+	remaining = ret < 0 ? 0 : ret;
+	while (remaining) {
+		ret = xattr_foreach(&it.it, &filter_xattr_handlers, &remaining);
 		if (ret)
-			break;
+			return;
 	}
 
-	return ret ? ret : it->buffer_ofs;
+	for (i = 0; i < vi->xattr_shared_count; ++i) {
+		sx = erofs_get_shared_xattr(vi->sbi, vi->xattr_shared_xattrs[i]);
+		if (IS_ERR(sx))
+			return;
+		it.filter |= erofs_xattr_filter_bit(sx->index, sx->data,
+						    sx->name_len);
+	}
+	vi->xattr_name_filter = it.filter;
+	vi->flags |= EROFS_I_XATTR_FILTER;
 }
 
 int erofs_listxattr(struct erofs_inode *vi, char *buffer, size_t buffer_size)
@@ -1207,7 +1423,7 @@ int erofs_listxattr(struct erofs_inode *vi, char *buffer, size_t buffer_size)
 	int ret;
 	struct listxattr_iter it;
 
-	ret = init_inode_xattrs(vi);
+	ret = erofs_init_inode_xattrs(vi);
 	if (ret == -ENOATTR)
 		return 0;
 	if (ret)
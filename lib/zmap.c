@@ -7,8 +7,10 @@
  * Created by Gao Xiang <gaoxiang25@huawei.com>
  * Modified by Huang Jianan <huangjianan@oppo.com>
  */
+#include <stdlib.h>
 #include "erofs/io.h"
 #include "erofs/print.h"
+#include "erofs/lock.h"
 
 static int z_erofs_do_map_blocks(struct erofs_inode *vi,
 				 struct erofs_map_blocks *map,
@@ -16,8 +18,10 @@ static int z_erofs_do_map_blocks(struct erofs_inode *vi,
 
 int z_erofs_fill_inode(struct erofs_inode *vi)
 {
-	if (!erofs_sb_has_big_pcluster() &&
-	    !erofs_sb_has_ztailpacking() && !erofs_sb_has_fragments() &&
+	struct erofs_sb_info *sbi = vi->sbi;
+
+	if (!erofs_sb_has_big_pcluster(sbi) &&
+	    !erofs_sb_has_ztailpacking(sbi) && !erofs_sb_has_fragments(sbi) &&
 	    vi->datalayout == EROFS_INODE_FLAT_COMPRESSION_LEGACY) {
 		vi->z_advise = 0;
 		vi->z_algorithmtype[0] = 0;
@@ -29,7 +33,7 @@ int z_erofs_fill_inode(struct erofs_inode *vi)
 	return 0;
 }
 
-static int z_erofs_fill_inode_lazy(struct erofs_inode *vi)
+int z_erofs_fill_inode_lazy(struct erofs_inode *vi)
 {
 	int ret;
 	erofs_off_t pos;
@@ -39,8 +43,9 @@ static int z_erofs_fill_inode_lazy(struct erofs_inode *vi)
 	if (vi->flags & EROFS_I_Z_INITED)
 		return 0;
 
-	pos = round_up(iloc(vi->nid) + vi->inode_isize + vi->xattr_isize, 8);
-	ret = dev_read(0, buf, pos, sizeof(buf));
+	pos = round_up(iloc(vi->sbi, vi->nid) + vi->inode_isize +
+		       vi->xattr_isize, 8);
+	ret = dev_read(vi->sbi, 0, buf, pos, sizeof(buf));
 	if (ret < 0)
 		return -EIO;
 
@@ -126,11 +131,20 @@ static int z_erofs_reload_indexes(struct z_erofs_maprecorder *m,
 	int ret;
 	struct erofs_map_blocks *const map = m->map;
 	char *mpage = map->mpage;
+	const void *ptr;
+
+	/* decode indexes in place if the image is mapped */
+	ptr = dev_mmap_ptr(m->inode->sbi, 0, blknr_to_addr(eblk), EROFS_BLKSIZ);
+	if (ptr) {
+		m->kaddr = (void *)ptr;
+		return 0;
+	}
 
+	m->kaddr = mpage;
 	if (map->index == eblk)
 		return 0;
 
-	ret = blk_read(0, mpage, eblk, 1);
+	ret = blk_read(m->inode->sbi, 0, mpage, eblk, 1);
 	if (ret < 0)
 		return -EIO;
 
@@ -143,7 +157,7 @@ static int legacy_load_cluster_from_disk(struct z_erofs_maprecorder *m,
 					 unsigned long lcn)
 {
 	struct erofs_inode *const vi = m->inode;
-	const erofs_off_t ibase = iloc(vi->nid);
+	const erofs_off_t ibase = iloc(vi->sbi, vi->nid);
 	const erofs_off_t pos =
 		Z_EROFS_VLE_LEGACY_INDEX_ALIGN(ibase + vi->inode_isize +
 					       vi->xattr_isize) +
@@ -343,8 +357,8 @@ static int compacted_load_cluster_from_disk(struct z_erofs_maprecorder *m,
 {
 	struct erofs_inode *const vi = m->inode;
 	const unsigned int lclusterbits = vi->z_logical_clusterbits;
-	const erofs_off_t ebase = round_up(iloc(vi->nid) + vi->inode_isize +
-					   vi->xattr_isize, 8) +
+	const erofs_off_t ebase = round_up(iloc(vi->sbi, vi->nid) +
+					   vi->inode_isize + vi->xattr_isize, 8) +
 		sizeof(struct z_erofs_map_header);
 	const unsigned int totalidx = BLK_ROUND_UP(vi->i_size);
 	unsigned int compacted_4b_initial, compacted_2b;
@@ -670,10 +684,163 @@ out:
 	return err;
 }
 
+/*
+ * Inodes owned by the inode cache can keep all their extents decoded in
+ * a table sorted by logical address.  It is built with one forward pass
+ * over the index area, after which a lookup is a binary search instead
+ * of decoding (and looking back over) lcluster indexes on each call.
+ */
+#define Z_EROFS_EXTENT_TABLE_MIN_LCLUSTERS	16
+
+struct z_erofs_extent {
+	erofs_off_t la, pa;
+	u32 plen;
+	u16 flags;
+	u8 algorithmformat;
+};
+
+struct z_erofs_extent_table {
+	unsigned int nr;
+	struct z_erofs_extent extents[];
+};
+
+static erofs_mutex_t z_erofs_extent_lock = EROFS_MUTEX_INITIALIZER;
+
+static struct z_erofs_extent_table *
+z_erofs_build_extent_table(struct erofs_inode *vi)
+{
+	struct erofs_map_blocks map = { .index = UINT_MAX };
+	struct z_erofs_extent_table *t = NULL, *nt;
+	unsigned int nr = 0, max = 0;
+	erofs_off_t la = 0;
+	int err;
+
+	while (la < vi->i_size) {
+		map.m_la = la;
+		err = z_erofs_do_map_blocks(vi, &map, EROFS_GET_BLOCKS_FIEMAP);
+		if (err)
+			goto err_out;
+
+		/* extents should exactly follow each other */
+		if (map.m_la != la || !map.m_llen) {
+			erofs_err("bogus extent @ la %llu of nid %llu",
+				  la | 0ULL, vi->nid | 0ULL);
+			err = -EFSCORRUPTED;
+			goto err_out;
+		}
+
+		if (nr >= max) {
+			max = max ? max << 1 : 64;
+			nt = realloc(t, sizeof(*t) + max * sizeof(t->extents[0]));
+			if (!nt) {
+				err = -ENOMEM;
+				goto err_out;
+			}
+			t = nt;
+		}
+		t->extents[nr++] = (struct z_erofs_extent) {
+			.la = map.m_la,
+			.pa = map.m_pa,
+			.plen = map.m_plen,
+			.flags = map.m_flags,
+			.algorithmformat = map.m_algorithmformat,
+		};
+		la = map.m_la + map.m_llen;
+	}
+	t->nr = nr;
+
+	/* give the unused slots back */
+	nt = realloc(t, sizeof(*t) + nr * sizeof(t->extents[0]));
+	return nt ? nt : t;
+err_out:
+	free(t);
+	return ERR_PTR(err);
+}
+
+static struct z_erofs_extent_table *
+z_erofs_get_extent_table(struct erofs_inode *vi)
+{
+	struct z_erofs_extent_table *t;
+
+	if (!(vi->flags & EROFS_I_CACHED) ||
+	    (vi->i_size >> vi->z_logical_clusterbits) <
+			Z_EROFS_EXTENT_TABLE_MIN_LCLUSTERS)
+		return NULL;
+
+	erofs_mutex_lock(&z_erofs_extent_lock);
+	t = vi->z_extents;
+	erofs_mutex_unlock(&z_erofs_extent_lock);
+
+	if (!t) {
+		/*
+		 * Build it without holding the lock; if it fails, the error
+		 * is recorded so that lookups just fall back to the indexes.
+		 */
+		t = z_erofs_build_extent_table(vi);
+
+		erofs_mutex_lock(&z_erofs_extent_lock);
+		if (!vi->z_extents) {
+			vi->z_extents = t;
+		} else {
+			if (!IS_ERR(t))
+				free(t);
+			t = vi->z_extents;
+		}
+		erofs_mutex_unlock(&z_erofs_extent_lock);
+	}
+	return IS_ERR(t) ? NULL : t;
+}
+
+static void z_erofs_extent_table_lookup(struct erofs_inode *vi,
+					struct z_erofs_extent_table *t,
+					struct erofs_map_blocks *map)
+{
+	unsigned int l = 0, r = t->nr;
+	struct z_erofs_extent *e;
+
+	/* find the last extent which starts at or before m_la */
+	while (r - l > 1) {
+		unsigned int mid = l + (r - l) / 2;
+
+		if (t->extents[mid].la <= map->m_la)
+			l = mid;
+		else
+			r = mid;
+	}
+	e = &t->extents[l];
+
+	map->m_la = e->la;
+	map->m_llen = (l + 1 < t->nr ? e[1].la : vi->i_size) - e->la;
+	map->m_pa = e->pa;
+	map->m_plen = e->plen;
+	map->m_flags = e->flags;
+	map->m_algorithmformat = e->algorithmformat;
+}
+
+size_t z_erofs_extent_table_size(struct erofs_inode *vi)
+{
+	struct z_erofs_extent_table *t;
+
+	erofs_mutex_lock(&z_erofs_extent_lock);
+	t = vi->z_extents;
+	erofs_mutex_unlock(&z_erofs_extent_lock);
+	if (!t || IS_ERR(t))
+		return 0;
+	return sizeof(*t) + t->nr * sizeof(t->extents[0]);
+}
+
+void z_erofs_drop_extent_table(struct erofs_inode *vi)
+{
+	if (vi->z_extents && !IS_ERR(vi->z_extents))
+		free(vi->z_extents);
+	vi->z_extents = NULL;
+}
+
 int z_erofs_map_blocks_iter(struct erofs_inode *vi,
 			    struct erofs_map_blocks *map,
 			    int flags)
 {
+	struct z_erofs_extent_table *t;
 	int err = 0;
 
 	/* when trying to read beyond EOF, leave it unmapped */
@@ -697,6 +864,11 @@ int z_erofs_map_blocks_iter(struct erofs_inode *vi,
 		goto out;
 	}
 
+	t = z_erofs_get_extent_table(vi);
+	if (t) {
+		z_erofs_extent_table_lookup(vi, t, map);
+		goto out;
+	}
 	err = z_erofs_do_map_blocks(vi, map, flags);
 out:
 	DBG_BUGON(err < 0 && err != -ENOMEM);